@@ -0,0 +1,96 @@
+/*
+ * MUSL scheduler benchmark.
+ * Runs a mix of busy scripts and scripts that mostly SLEEP()
+ * on a mu_sched, and reports how long it took.
+ *
+ * Usage: bench [workers] [busy] [sleepers]
+ *
+ * Build it with `make bench`; it needs musl.c compiled
+ * with WITH_THREADS defined.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "musl.h"
+
+static const char *busy_script =
+	"let s = 0\n"
+	"for i = 1 to 200 do\n"
+	"  let s = s + i\n"
+	"next\n";
+
+/* Each sleeper sleeps 10 times for 20ms */
+static const char *sleep_script =
+	"for i = 1 to 10 do\n"
+	"  SLEEP(20)\n"
+	"next\n";
+
+static struct mu_pool *pool;
+static int failed;
+
+static void done(struct musl *m, int result, void *data) {
+	if(!result) {
+		fprintf(stderr, "ERROR: %s\n", mu_error_msg(m));
+		__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+	}
+	mu_pool_release(pool, m);
+}
+
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	int workers = argc > 1 ? atoi(argv[1]) : 4;
+	int busy = argc > 2 ? atoi(argv[2]) : 2000;
+	int sleepers = argc > 3 ? atoi(argv[3]) : 10000;
+	struct mu_script *bs, *ss;
+	struct mu_sched *s;
+	struct musl *m;
+	double t0, t1, t2;
+	int i;
+
+	t0 = seconds();
+	if(!(pool = mu_pool_create(busy + sleepers, NULL, NULL))
+			|| !(s = mu_sched_create(workers, 0))) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 1;
+	}
+
+	m = mu_pool_acquire(pool);
+	if(!(bs = mu_compile(m, busy_script)) || !(ss = mu_compile(m, sleep_script))) {
+		fprintf(stderr, "ERROR: %s\n", mu_error_msg(m));
+		return 1;
+	}
+	mu_pool_release(pool, m);
+
+	/* Interleave the busy scripts with the sleepers */
+	for(i = 0; i < busy + sleepers; i++) {
+		int b = (long long)i * busy / (busy + sleepers) != (long long)(i + 1) * busy / (busy + sleepers);
+		m = mu_pool_acquire(pool);
+		if(!m || !mu_sched_spawn(s, m, b ? bs : ss, done, NULL)) {
+			fprintf(stderr, "ERROR: Couldn't spawn script %d\n", i);
+			return 1;
+		}
+	}
+
+	t1 = seconds();
+	mu_sched_run(s);
+	t2 = seconds();
+
+	printf("workers:     %d\n", workers);
+	printf("scripts:     %d busy, %d sleeping\n", busy, sleepers);
+	printf("setup:       %.3f s\n", t1 - t0);
+	printf("run:         %.3f s\n", t2 - t1);
+	printf("throughput:  %.0f scripts/s\n", (busy + sleepers) / (t2 - t1));
+	printf("failed:      %d\n", failed);
+
+	mu_sched_free(s);
+	mu_free_script(bs);
+	mu_free_script(ss);
+	mu_pool_free(pool);
+	return failed != 0;
+}
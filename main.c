@@ -12,6 +12,10 @@
 #include <string.h>
 #include <time.h>
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef WITH_REGEX
 #include <sys/types.h>
 #include <regex.h>
@@ -29,6 +33,9 @@
  */
 struct user_data {
 	FILE * files[NUM_FILES];
+	FILE *out, *err;	/* Where PRINT() and errors go */
+	unsigned int seed;	/* The state of RANDOM() */
+	int no_input;		/* INPUT() is not allowed (see -j) */
 };
 
 /* These functions are declared at the bottom of this file.
@@ -54,30 +61,21 @@ static struct mu_par my_call(struct musl *m, int argc, struct mu_par argv[]);
 static struct mu_par my_halt(struct musl *m, int argc, struct mu_par argv[]);
 static struct mu_par my_dump(struct musl *m, int argc, struct mu_par argv[]);
 
-int main(int argc, char *argv[]) {
-	char *s;
-	int r, i;
+/* Sets up an interpreter with the functions of the standalone interpreter */
+static struct musl *create_interpreter(struct user_data *data) {
 	struct musl *m;
+	int i;
 
-	struct user_data data;
-
-	srand(time(NULL)); /* For in case */
-
-	for(r = 0; r < NUM_FILES; r++)
-		data.files[r] = NULL;
-
-	if(argc <= 1) {
-		fprintf(stderr, "Usage: %s FILE1 FILE2 ...\n", argv[0]);
-		return 1;
-	}
+	for(i = 0; i < NUM_FILES; i++)
+		data->files[i] = NULL;
+	data->seed = (unsigned int)time(NULL);
+	data->no_input = 0;
 
-	if(!(m = mu_create())) {
-		fprintf(stderr, "ERROR: Couldn't create MUSL structure\n");
-		exit(EXIT_FAILURE);
-	}
+	if(!(m = mu_create()))
+		return NULL;
 
 	/* Store a pointer to our user data in the musl structure */
-	mu_set_data(m, &data);
+	mu_set_data(m, data);
 
 	/* Add the custom functions to the interpreter here.
 	 * Function names must be in lowercase.
@@ -114,33 +112,223 @@ int main(int argc, char *argv[]) {
 	/* You can also access array variables like this: */
 	mu_set_str(m, "myarray$[foo]", "XYZZY");
 
-	for(i = 1; i < argc; i++) {
-		/* mu_readfile() is a helper function to read an entire
-		 * script file into memory
-		 */
-		if(!(s = mu_readfile(argv[i]))) {
-			fprintf(stderr, "ERROR: Unable to read \"%s\"\n", argv[i]);
-			break;
-		}
+	return m;
+}
+
+static void close_files(struct user_data *data) {
+	int i;
+	for(i = 0; i < NUM_FILES; i++)
+		if(data->files[i])
+			fclose(data->files[i]);
+}
+
+/* Runs a script file.
+ * Returns 1 on success, 0 if the script had errors or -1 if it could not be read */
+static int run_file(struct musl *m, const char *fname) {
+	struct user_data *data = mu_get_data(m);
+	char *s;
+	int rv;
+
+	/* mu_readfile() is a helper function to read an entire
+	 * script file into memory
+	 */
+	if(!(s = mu_readfile(fname))) {
+		fprintf(data->err, "ERROR: Unable to read \"%s\"\n", fname);
+		return -1;
+	}
 
 #ifdef TEST
-		printf("============\n%s\n============\n", s);
+	fprintf(data->out, "============\n%s\n============\n", s);
 #endif
 
-		/* Run the script from the string */
-		if(!mu_run(m, s)) {
-			/* This is how you retrieve info about interpreter errors: */
-			fprintf(stderr, "ERROR:Line %d: %s:\n>> %s\n", mu_cur_line(m), mu_error_msg(m),
-					mu_error_text(m));
-			mu_dump(m, stderr);
-		}
+	/* Run the script from the string */
+	if(!(rv = mu_run(m, s))) {
+		/* This is how you retrieve info about interpreter errors: */
+		fprintf(data->err, "ERROR:Line %d: %s:\n>> %s\n", mu_cur_line(m), mu_error_msg(m),
+				mu_error_text(m));
+		mu_dump(m, data->err);
+	}
+
+	/* The return value of mu_readfile() also needs to be free()'ed.
+	 * Just don't free() it if you're still going to call mu_cur_line()
+	 */
+	free(s);
+	return rv;
+}
+
+#ifdef WITH_THREADS
+/* The -j option: Each script is run in its own interpreter on one
+ * of a pool of threads. A script's output and its errors go to two
+ * temporary files that are copied to stdout and stderr once the scripts
+ * before it have finished, so that they appear in the same order as
+ * without -j.
+ * The scripts can't share stdin, so INPUT() is an error, and each
+ * has its own RANDOM() sequence.
+ */
+struct job {
+	const char *fname;
+	FILE *out, *err;
+	double time;
+	int ok, done;
+};
+
+static struct job *jobs;
+static int njobs, next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_job(struct job *j) {
+	struct user_data data;
+	struct musl *m;
+	double start = seconds();
+
+	if(!(j->out = tmpfile()) || !(j->err = tmpfile())) {
+		if(j->out)
+			fclose(j->out);
+		j->out = NULL;
+		return;
+	}
+	data.out = j->out;
+	data.err = j->err;
+	if((m = create_interpreter(&data)) != NULL) {
+		data.seed += (unsigned int)(j - jobs) * 2654435761u;
+		data.no_input = 1;
+		j->ok = run_file(m, j->fname) > 0;
+		mu_cleanup(m);
+	} else
+		fprintf(j->err, "ERROR: Couldn't create MUSL structure\n");
+	close_files(&data);
+	j->time = seconds() - start;
+}
+
+static void *job_worker(void *arg) {
+	int i;
+	while((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs) {
+		run_job(&jobs[i]);
+		pthread_mutex_lock(&job_lock);
+		jobs[i].done = 1;
+		pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&job_lock);
+	}
+	return NULL;
+}
+
+/* Copies a job's temporary file to f and closes it */
+static void copy_output(FILE *tmp, FILE *f) {
+	int c;
+	rewind(tmp);
+	while((c = fgetc(tmp)) != EOF)
+		fputc(c, f);
+	fclose(tmp);
+	fflush(f);
+}
+
+static int run_parallel(int nthreads, int nfiles, char *files[]) {
+	pthread_t *threads;
+	double start = seconds(), total = 0;
+	int i, n, failed = 0;
+
+	jobs = calloc(nfiles, sizeof *jobs);
+	threads = calloc(nthreads, sizeof *threads);
+	if(!jobs || !threads) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 1;
+	}
+	njobs = nfiles;
+	for(i = 0; i < nfiles; i++)
+		jobs[i].fname = files[i];
+
+	for(n = 0; n < nthreads && n < nfiles; n++)
+		if(pthread_create(&threads[n], NULL, job_worker, NULL) != 0)
+			break;
+	if(n == 0) {
+		/* Couldn't start any threads */
+		job_worker(NULL);
+	}
+
+	/* Emit the output in order */
+	for(i = 0; i < nfiles; i++) {
+		struct job *j = &jobs[i];
+		pthread_mutex_lock(&job_lock);
+		while(!j->done)
+			pthread_cond_wait(&job_done, &job_lock);
+		pthread_mutex_unlock(&job_lock);
+
+		if(j->out) {
+			copy_output(j->out, stdout);
+			copy_output(j->err, stderr);
+		} else
+			fprintf(stderr, "ERROR: Couldn't create a temporary file for \"%s\"\n", j->fname);
+	}
+
+	for(i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Summary */
+	fprintf(stderr, "============\n");
+	for(i = 0; i < nfiles; i++) {
+		fprintf(stderr, "%-40s %9.3fs %s\n", jobs[i].fname, jobs[i].time,
+				jobs[i].ok ? "ok" : "FAILED");
+		total += jobs[i].time;
+		if(!jobs[i].ok)
+			failed++;
+	}
+	fprintf(stderr, "%d scripts, %d failed, %.3fs run time in %.3fs on %d threads\n",
+			nfiles, failed, total, seconds() - start, nthreads);
+
+	free(jobs);
+	free(threads);
+	return failed ? 1 : 0;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+	int i, nthreads = 0;
+	struct musl *m;
+
+	struct user_data data;
+
+	srand(time(NULL)); /* For in case */
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(!strcmp(argv[i], "-j") && i + 1 < argc)
+			nthreads = atoi(argv[++i]);
+		else
+			break;
+	}
 
-		/* The return value of mu_readfile() also needs to be free()'ed.
-		 * Just don't free() it if you're still going to call mu_cur_line()
-		 */
-		free(s);
+	if(i >= argc) {
+		fprintf(stderr, "Usage: %s [-j N] FILE1 FILE2 ...\n", argv[0]);
+		fprintf(stderr, "  -j N  Run each FILE in its own interpreter on N threads\n");
+		return 1;
 	}
 
+	if(nthreads > 0) {
+#ifdef WITH_THREADS
+		return run_parallel(nthreads, argc - i, argv + i);
+#else
+		fprintf(stderr, "ERROR: -j requires compiling with WITH_THREADS\n");
+		return 1;
+#endif
+	}
+
+	data.out = stdout;
+	data.err = stderr;
+	if(!(m = create_interpreter(&data))) {
+		fprintf(stderr, "ERROR: Couldn't create MUSL structure\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(; i < argc; i++)
+		if(run_file(m, argv[i]) < 0)
+			break;
+
 #ifdef TEST
 	/* This is how you retrieve variable values from the interpreter: */
 	printf("============\nmystr$= \"%s\"\nmynum= %d\nmyarray$[foo]= \"%s\"\n",
@@ -150,9 +338,7 @@ int main(int argc, char *argv[]) {
 	/* Destroy the interpreter when we're done with it */
 	mu_cleanup(m);
 
-	for(i = 0; i < NUM_FILES; i++)
-		if(data.files[i])
-			fclose(data.files[i]);
+	close_files(&data);
 
 	return 0;
 }
@@ -168,16 +354,17 @@ int main(int argc, char *argv[]) {
  */
 static struct mu_par my_print(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {argc}};
+	struct user_data *data = mu_get_data(m);
 	int i;
 	for(i = 0; i < argc; i++) {
 		if(i > 0)
-			fputc(' ', stdout);
+			fputc(' ', data->out);
 		if(argv[i].type == mu_str)
-			fputs(argv[i].v.s, stdout);
+			fputs(argv[i].v.s, data->out);
 		else
-			printf("%d", argv[i].v.i);
+			fprintf(data->out, "%d", argv[i].v.i);
 	}
-	fputs("\n", stdout);
+	fputs("\n", data->out);
 	return rv;
 }
 
@@ -187,18 +374,22 @@ static struct mu_par my_print(struct musl *m, int argc, struct mu_par argv[]) {
  *# the second form converts the value to an integer internally.\n
  *# Trailing newline characters are removed.\n
  *# It returns the input string. If the optional {{@var}} parameter
- *# is specified, {{var}} is also set to the input string.
+ *# is specified, {{var}} is also set to the input string.\n
+ *# It can't be used when the scripts are run with {{-j}}.
  */
 static struct mu_par my_input_s(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv;
 	char *c;
+	struct user_data *data = mu_get_data(m);
+	if(data->no_input)
+		mu_throw(m, "INPUT$() can't be used with -j");
 	if(argc == 0)
-		fputs("> ", stdout);
+		fputs("> ", data->out);
 	else {
-		fputs(mu_par_str(m, 0, argc, argv), stdout);
-		fputc(' ', stdout);
+		fputs(mu_par_str(m, 0, argc, argv), data->out);
+		fputc(' ', data->out);
 	}
-	fflush(stdout);
+	fflush(data->out);
 
 	rv.type = mu_str;
 	rv.v.s = malloc(INPUT_BUFFER_SIZE + 1);
@@ -223,13 +414,16 @@ static struct mu_par my_input_s(struct musl *m, int argc, struct mu_par argv[])
 static struct mu_par my_input(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv;
 	char buffer[50];
+	struct user_data *data = mu_get_data(m);
+	if(data->no_input)
+		mu_throw(m, "INPUT() can't be used with -j");
 	if(argc == 0)
-		fputs("> ", stdout);
+		fputs("> ", data->out);
 	else {
-		fputs(mu_par_str(m, 0, argc, argv), stdout);
-		fputc(' ', stdout);
+		fputs(mu_par_str(m, 0, argc, argv), data->out);
+		fputc(' ', data->out);
 	}
-	fflush(stdout);
+	fflush(data->out);
 
 	rv.type = mu_int;
 	rv.v.i = 0;
@@ -385,7 +579,14 @@ static struct mu_par my_fwrite(struct musl *m, int argc, struct mu_par argv[]) {
  */
 static struct mu_par my_srand(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {0}};
-	srand(argc?mu_par_int(m, 0, argc, argv):time(NULL));
+	unsigned int seed = argc?mu_par_int(m, 0, argc, argv):time(NULL);
+#ifdef WITH_THREADS
+	/* Scripts may be running on other threads (see -j) */
+	struct user_data *data = mu_get_data(m);
+	data->seed = seed;
+#else
+	srand(seed);
+#endif
 	return rv;
 }
 
@@ -398,7 +599,12 @@ static struct mu_par my_srand(struct musl *m, int argc, struct mu_par argv[]) {
  */
 static struct mu_par my_rand(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {0}};
+#ifdef WITH_THREADS
+	struct user_data *data = mu_get_data(m);
+	rv.v.i = rand_r(&data->seed);
+#else
 	rv.v.i = rand();
+#endif
 	if(argc == 1) {
 		int f = mu_par_int(m,0, argc, argv);
 		if(f <= 0) 
@@ -424,6 +630,9 @@ static struct mu_par my_time(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_str, {0}};
 	time_t t;
 	struct tm *tmp;
+#ifdef WITH_THREADS
+	struct tm tm;
+#endif
 	const char *fmt = "%Y/%m/%d %H:%M:%S";
 	
 	char buffer[50];
@@ -432,7 +641,12 @@ static struct mu_par my_time(struct musl *m, int argc, struct mu_par argv[]) {
 		fmt = mu_par_str(m,0, argc, argv);
 	
 	time(&t);
+#ifdef WITH_THREADS
+	/* Scripts may be running on other threads (see -j) */
+	tmp = localtime_r(&t, &tm);
+#else
 	tmp = localtime(&t);
+#endif
 	if(!tmp) {
 		mu_throw(m, "localtime() error in TIME()");
 	}
@@ -534,9 +748,6 @@ static struct mu_par my_call(struct musl *m, int argc, struct mu_par argv[]) {
  		 * clean up after yourself.
 		 * The NULL parameter to mu_throw() lets it keep the current value of m->error_msg
 		 */		
-		/* FIXME: This call to mu_throw() causes the parameter to CALL() to be leaked. 
-			devnotes.txt explains the situation.
-		*/
 		mu_throw(m, NULL); 
 	}
 	return rv;
@@ -559,6 +770,7 @@ static struct mu_par my_halt(struct musl *m, int argc, struct mu_par argv[]) {
  */
 static struct mu_par my_dump(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {0}};
-	mu_dump(m, stderr);
+	struct user_data *data = mu_get_data(m);
+	mu_dump(m, data->err);
 	return rv;
 }
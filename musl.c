@@ -35,6 +35,10 @@
  *]
  */
 
+#if defined(WITH_MMAP) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE	/* For memfd_create() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,6 +47,20 @@
 #include <stdarg.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
+
+#ifdef WITH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef WITH_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "musl.h"
 
@@ -51,24 +69,42 @@
 #	define snprintf _snprintf
 #endif
 
-/* Maximum size of tokens (identifiers and quoted strings) */
+/* Initial size of the token buffer, and the size of the local
+ * buffers used for variable names. Longer tokens and names are
+ * allocated on the heap. */
 #define TOK_SIZE	80
 
-/* Maximum number of parameters that can be passed to a function */
-#define MAX_PARAMS 20
+/* Number of arguments of a call that are kept on the C stack;
+ * calls with more arguments keep them on the heap */
+#define INLINE_ARGS 8
+
+/* Default maximum nested gosubs; see mu_set_limit() */
+#define MAX_GOSUB 1000
+
+/* Default max number of nested FOR loops; see mu_set_limit() */
+#define MAX_FOR 100
 
-/* Maximum nested gosubs */
-#define MAX_GOSUB 20
+/* Initial size of the GOSUB and FOR stacks once they're used */
+#define STACK_SIZE 8
 
-/* Max number of nested FOR loops */
-#define MAX_FOR 5
+/* Initial size of hash tables; must be a power of 2 */
+#define HASH_SIZE 64
 
-/* Size of hash tables; must be prime */
-#define HASH_SIZE 199
+/* Number of call sites whose functions are remembered; must be a power of 2 */
+#define CALL_CACHE_SIZE 64
+
+/* Default number of statements a scheduled script
+ * runs before another one gets a turn */
+#define SCHED_SLICE 1000
 
 #define MAX_ERROR_TEXT 128
 
-typedef struct var* hash_table[HASH_SIZE];
+/* Hash tables grow by doubling whenever they hold more
+ * elements than they have buckets. */
+typedef struct {
+	struct var **b;
+	unsigned int n, size;
+} hash_table;
 
 /*
  * Structures
@@ -76,27 +112,140 @@ typedef struct var* hash_table[HASH_SIZE];
 
 enum types {nil, num, str, oper, go};
 
+/* A local variable in a GOSUB frame.
+ * The name points to the identifier in the LOCAL statement.
+ */
+struct local {
+	const char *name;
+	size_t len;
+	struct mu_par val;
+};
+
+/* The arguments of a call while they are evaluated and while the
+ * function runs. The lists of the calls in progress are linked through
+ * m->args, so that mu_throw() can free the arguments of the calls that
+ * it unwinds. Calls don't have to catch errors themselves.
+ */
+struct args {
+	struct mu_par *argv;
+	int argc, size;
+	struct mu_par buf[INLINE_ARGS];
+	struct mu_arg *typed;	/* Converted arguments on the heap, or NULL */
+	struct args *prev;
+};
+
+/* A call site in the script, and the function that it calls.
+ * Entries whose gen isn't the interpreter's call_gen are stale. */
+struct call_site {
+	const char *pos;
+	unsigned int gen;
+	struct var *fun;
+};
+
+/* A GOSUB stack frame.
+ * GOSUB label(args) puts the arguments in the first slots of the
+ * frame, and LOCAL names the slots in the order that they are
+ * declared. The slots are kept when the frame is popped so that
+ * the next GOSUB to the same depth can reuse them.
+ */
+struct frame {
+	const char *ret;
+	struct local *locals;
+	int nlocals, nnamed, size;
+};
+
 struct musl {
 	const char *s, *last, *start;
-	char token[TOK_SIZE];
+	char *token;
+	size_t tok_size;
+
+	/* T_STRING tokens: Points either directly into the script,
+	 * or into the token buffer if the string contained escapes. */
+	const char *str;
+	size_t str_len;
 
 	hash_table vars,	/* variables */
-		labels,			/* Labels */
-		funcs;			/* Functions */
+		funcs,			/* Functions */
+		chans;			/* Channels registered with mu_add_chan() */
+
+	/* The script being executed */
+	const struct mu_script *script;
 
 	int active;
 
-	const char *gosub_stack[MAX_GOSUB];
-	int gosub_sp;
+	/* Options set through mu_set_option() */
+	int short_circuit;
+
+	/* The stacks are grown on demand, up to the *_max limits */
+	struct frame *gosub_stack;
+	int gosub_sp, gosub_size, gosub_max;
+
+	/* Value of the last RETURN to the C domain */
+	struct mu_par retval;
+	int has_retval;
 
-	const char *for_stack[MAX_FOR];
-	int for_sp;
+	const char **for_stack;
+	int for_sp, for_size, for_max;
 
 	jmp_buf on_error;
+	/* The argument lists in progress, and the first one
+	 * that is not unwound by a longjmp() to on_error */
+	struct args *args, *args_base;
+
+	/* Functions looked up by fparams(). call_gen changes when another
+	 * script is executed or functions are added. */
+	struct call_site calls[CALL_CACHE_SIZE];
+	unsigned int call_gen;
+	/* Changes when variables are deleted or hidden by new ones, so
+	 * that mu_expr objects don't use the variables they looked up */
+	unsigned int var_epoch;
+	/* Unique for each interpreter that mu_create() returns, even
+	 * one that reuses the memory of an interpreter that was freed */
+	unsigned long id;
 	char error_msg[MAX_ERROR_TEXT];
 	char error_text[MAX_ERROR_TEXT];
 
 	void *user; /* Stores arbitrary user data */
+
+	/* Statement budget of mu_exec_budget() and mu_resume() */
+	int budget, preempt, suspended;
+	int depth; /* Nesting of program() */
+
+	/* Script compiled by mu_run_budget(), kept while suspended */
+	struct mu_script *own_script;
+
+	/* Script kept by mu_load() for mu_call(), with its own copy of the text */
+	struct mu_script *loaded;
+
+	/* Asynchronous calls (see mu_suspend()): The results of the calls
+	 * made since the start of the current statement are logged, so
+	 * that the statement can be executed again when the call completes,
+	 * with the logged calls returning their results instead. */
+	int async;		/* The mu_async_calls option */
+	int pending;	/* Token of the pending call, or 0 */
+	int last_token;
+	int slice;		/* Budget to continue with after mu_complete() */
+	const char *stmt_start;
+	struct mu_par *log;
+	int nlog, log_size, log_pos;
+
+	/* Index in the mu_pool that owns the interpreter, or -1 */
+	int pool_slot;
+
+	/* Interpreters that run PARMAP() subroutines read the global
+	 * variables and functions of the interpreter that called it */
+	const struct musl *parent;
+	int max_threads;	/* PARMAP() threads; 0 for one per CPU */
+
+#ifdef WITH_THREADS
+	/* Task of a mu_sched that is running the interpreter */
+	struct mu_task *task;
+#endif
+
+#ifdef WITH_MMAP
+	/* Read-only variables from mu_attach_frozen(), or NULL */
+	const hash_table *frozen;
+#endif
 };
 
 /*
@@ -131,8 +280,14 @@ struct musl {
 
 #define T_NE		272	/* Not-Equals '<>' operator */
 
-struct {
-	char * name;
+#define T_LOCAL		273
+
+#define T_SELECT	274
+#define T_CASE		275
+#define T_ELSE		276
+
+static const struct {
+	const char * name;
 	int val;
 } keywords[] = {{"let",T_LET},
 				{"if",T_IF},
@@ -150,6 +305,10 @@ struct {
 				{"do",T_DO},
 				{"step",T_STEP},
 				{"next",T_NEXT},
+				{"local",T_LOCAL},
+				{"select",T_SELECT},
+				{"case",T_CASE},
+				{"else",T_ELSE},
 				{NULL, 0}};
 
 static int iskeyword(const char *s) {
@@ -172,50 +331,105 @@ static void *mu_alloc(struct musl *m, size_t len) {
 
 struct var {
 	char *name;
-	enum mu_ptype type; /* for struct musl->vars only */
+	/* For struct musl->vars; in struct musl->funcs mu_str
+	 * marks a function with a signature in v.sig */
+	enum mu_ptype type;
 	union {
 		int i;
 		char *s;
 		const char *c;
 		mu_func fun;
+		struct func_sig *sig;
+		void *p;
 	} v;
+	unsigned int hash;
 	struct var *next;
 };
 
-static void init_table(hash_table tbl) {
-	int i;
-	for(i = 0; i < HASH_SIZE; i++)
-		tbl[i] = NULL;
+/* A function added with mu_add_func_sig() */
+struct func_sig {
+	mu_sig_func fun;
+	int min, max;	/* Number of arguments; max is -1 if there is no limit */
+	char ret;		/* Return type 'i' or 's', or 0 */
+	char lenient;	/* Ignore surplus arguments, like the old built-ins */
+	char types[1];	/* Parameter types; the last one repeats if max is -1 */
+};
+
+static void init_table(hash_table *tbl) {
+	tbl->b = NULL;
+	tbl->n = 0;
+	tbl->size = 0;
 }
 
 static void free_element(struct var* v, void (*cfun)(struct var *)) {
-	if(!v) return;
-	free_element(v->next, cfun);
-	if(cfun) cfun(v);
-	free(v->name);
-	free(v);
+	while(v) {
+		struct var *next = v->next;
+		if(cfun) cfun(v);
+		free(v->name);
+		free(v);
+		v = next;
+	}
 }
 
-static void clear_table(hash_table tbl, void (*cfun)(struct var *)) {
-	int i;
-	for(i = 0; i < HASH_SIZE; i++)
-		free_element(tbl[i], cfun);
+static void clear_table(hash_table *tbl, void (*cfun)(struct var *)) {
+	unsigned int i;
+	for(i = 0; i < tbl->size; i++)
+		free_element(tbl->b[i], cfun);
+	free(tbl->b);
+	init_table(tbl);
+}
+
+/* Like clear_table(), but keeps the buckets for reuse */
+static void empty_table(hash_table *tbl, void (*cfun)(struct var *)) {
+	unsigned int i;
+	for(i = 0; i < tbl->size; i++) {
+		free_element(tbl->b[i], cfun);
+		tbl->b[i] = NULL;
+	}
+	tbl->n = 0;
 }
 
 static unsigned int hash(const char *s) {
-	unsigned int i = 0x5555;
+	/* FNV-1a */
+	unsigned int i = 2166136261u;
 	for(;s[0];s++)
-		i = i << 3 ^ (s[0] | (s[0] << 8));
-	return i % HASH_SIZE;
+		i = (i ^ (unsigned char)s[0]) * 16777619u;
+	return i;
 }
 
-static struct var *find_var(hash_table tbl, const char *name) {
+static struct var *find_var(const hash_table *tbl, const char *name) {
 	struct var* v;
-	unsigned int h = hash(name);
-	if(tbl[h])
-		for(v = tbl[h]; v; v = v->next)
-			if(!strcmp(v->name, name))
-				return v;
+	unsigned int h;
+	if(!tbl->size) return NULL;
+	h = hash(name);
+	for(v = tbl->b[h & (tbl->size - 1)]; v; v = v->next)
+		if(v->hash == h && !strcmp(v->name, name))
+			return v;
+	return NULL;
+}
+
+/* Looks up a global variable, falling back to the frozen variables and
+ * to the parent's variables in a PARMAP() subroutine. Neither of those
+ * must be modified. */
+static struct var *get_var(const struct musl *m, const char *name) {
+	struct var *v;
+	do {
+		if((v = find_var(&m->vars, name)) != NULL)
+			return v;
+#ifdef WITH_MMAP
+		if(m->frozen && (v = find_var(m->frozen, name)) != NULL)
+			return v;
+#endif
+	} while((m = m->parent) != NULL);
+	return NULL;
+}
+
+static struct var *get_func(const struct musl *m, const char *name) {
+	struct var *v;
+	do {
+		if((v = find_var(&m->funcs, name)) != NULL)
+			return v;
+	} while((m = m->parent) != NULL);
 	return NULL;
 }
 
@@ -226,24 +440,155 @@ static struct var *new_var(const char *name) {
 		free(v);
 		return NULL;
 	}
+	v->hash = hash(name);
 	v->next = NULL;
 	return v;
 }
 
-static void put_var(hash_table tbl, struct var *val) {
-	struct var* v;
-	unsigned int h = hash(val->name);
-	if(tbl[h]) {
-		for(v = tbl[h]; v->next; v= v->next);
-		v->next = val;
-	} else
-		tbl[h] = val;
+/* Makes room for at least n elements in the table without
+ * rehashing. Returns 0 if it runs out of memory or n is too large. */
+static int reserve_table(hash_table *tbl, unsigned int n) {
+	struct var **b, *v, *next;
+	unsigned int i, size = tbl->size ? tbl->size : HASH_SIZE;
+	while(size < n) {
+		if(size > UINT_MAX / 2)
+			return 0;
+		size <<= 1;
+	}
+	if(size == tbl->size)
+		return 1;
+	if(!(b = calloc(size, sizeof *b)))
+		return 0;
+	for(i = 0; i < tbl->size; i++) {
+		/* Reverse the chain first so that the nodes keep their order */
+		struct var *r = NULL;
+		for(v = tbl->b[i]; v; v = next) {
+			next = v->next;
+			v->next = r;
+			r = v;
+		}
+		for(v = r; v; v = next) {
+			next = v->next;
+			v->next = b[v->hash & (size - 1)];
+			b[v->hash & (size - 1)] = v;
+		}
+	}
+	free(tbl->b);
+	tbl->b = b;
+	tbl->size = size;
+	return 1;
+}
+
+static int put_var(hash_table *tbl, struct var *val) {
+	unsigned int h;
+	if(tbl->n >= tbl->size && !reserve_table(tbl, tbl->size ? tbl->size << 1 : HASH_SIZE))
+		return 0;
+	h = val->hash & (tbl->size - 1);
+	val->next = tbl->b[h];
+	tbl->b[h] = val;
+	tbl->n++;
+	return 1;
+}
+
+/* Finds the variable name in tbl, or adds it with the value 0 */
+static struct var *make_var(hash_table *tbl, const char *name) {
+	struct var *v = find_var(tbl, name);
+	if(!v) {
+		if(!(v = new_var(name))) return NULL;
+		v->type = mu_int;
+		v->v.i = 0;
+		if(!put_var(tbl, v)) {
+			free_element(v, NULL);
+			return NULL;
+		}
+	}
+	return v;
+}
+
+/* Finds or adds the global variable name. A new variable can hide a
+ * frozen variable or one of the parent's that a mu_expr looked up. */
+static struct var *make_global(struct musl *m, const char *name) {
+	struct var *v = find_var(&m->vars, name);
+	if(v)
+		return v;
+	if(get_var(m, name))
+		m->var_epoch++;
+	return make_var(&m->vars, name);
+}
+
+static void set_var_int(struct var *v, int num) {
+	if(v->type == mu_str)
+		free(v->v.s);
+	v->type = mu_int;
+	v->v.i = num;
+}
+
+/* Sets v to a copy of val, reusing its old string if it has one */
+static int set_var_str(struct var *v, const char *val) {
+	size_t len = strlen(val);
+	char *old = v->type == mu_str ? v->v.s : NULL, *s;
+	if(old && val >= old && val <= old + strlen(old)) {
+		/* val is (part of) the old string */
+		if(!(s = strdup(val)))
+			return 0;
+		free(old);
+	} else {
+		if(!(s = realloc(old, len + 1))) {
+			set_var_int(v, 0);
+			return 0;
+		}
+		memcpy(s, val, len + 1);
+	}
+	v->type = mu_str;
+	v->v.s = s;
+	return 1;
 }
 
+/*
+ * A script whose labels have been scanned by mu_compile().
+ * It is never modified afterwards, so interpreters on different
+ * threads can share it without locking.
+ */
+struct mu_script {
+	const char *text;
+	hash_table labels;
+	/* The SELECT and CASE keywords in the order they appear in the text */
+	struct select_ref *selects;
+	int nselects, selects_size;
+	/* Set if a token spans lines */
+	int multiline;
+};
+
+/*
+ * A SELECT CASE statement. The cases' values are constants, so
+ * mu_compile() puts them in tables, and SELECT CASE jumps straight
+ * to the body of the matching case.
+ */
+struct select {
+	const char *pos;	/* The SELECT keyword */
+	const char *other;	/* The body of CASE ELSE, or NULL */
+	const char *end;	/* After END SELECT */
+	hash_table strs;	/* Bodies by the text of the cases */
+	hash_table ints;	/* Bodies by the numbers of the cases */
+	const char **jump;	/* Bodies for the numbers min..max, if they're dense */
+	int min, max;
+	struct select *outer;	/* The enclosing SELECT CASE while scanning */
+};
+
+struct select_ref {
+	const char *pos;
+	struct select *sel;
+};
+
+/* Interpreters point here when they're not running a script */
+static const struct mu_script no_script = {NULL, {NULL, 0, 0}, NULL, 0, 0, 0};
+
 /*
  * Error handling
  */
 
+static void end_args(struct musl *m, struct args *a);
+
 void mu_throw(struct musl *m, const char *msg, ...) {
 	if(msg) {
 		va_list arg;
@@ -251,6 +596,10 @@ void mu_throw(struct musl *m, const char *msg, ...) {
 		vsnprintf (m->error_msg, MAX_ERROR_TEXT-1, msg, arg);
 		va_end (arg);
 	}
+	/* The message may refer to the arguments, so they are freed after
+	 * formatting it, but before the longjmp() discards their frames */
+	while(m->args != m->args_base)
+		end_args(m, m->args);
 	longjmp(m->on_error, -1);
 }
 
@@ -283,8 +632,19 @@ static struct musl *tok_reset(struct musl *m) {
 	return m;
 }
 
+/* Appends c to the token buffer, growing it if necessary */
+static void tok_add(struct musl *m, size_t *n, char c) {
+	if(*n + 1 >= m->tok_size) {
+		char *t = realloc(m->token, m->tok_size << 1);
+		if(!t) mu_throw(m, "Out of memory");
+		m->token = t;
+		m->tok_size <<= 1;
+	}
+	m->token[(*n)++] = c;
+}
+
 static int tokenize(struct musl *m) {
-	char *t;
+	size_t n = 0;
 	if(!m->s) return T_END;
 
 	m->last = m->s;
@@ -318,56 +678,61 @@ whitespace:
 		return T_END;
 	else if(m->s[0] == '"' || m->s[0] == '\'') {
 		char term = m->s[0];
-		for(m->s++, t=m->token; m->s[0] != term;) {
+		const char *start = ++m->s;
+
+		/* Strings without escapes are used directly from the script */
+		while(m->s[0] != term && m->s[0] != '\\') {
+			if(!m->s[0])
+				mu_throw(m, "Unterminated string");
+			m->s++;
+		}
+		if(m->s[0] == term) {
+			m->str = start;
+			m->str_len = m->s++ - start;
+			return T_STRING;
+		}
+
+		for(m->s = start; m->s[0] != term;) {
 			if(!m->s[0])
 				mu_throw(m, "Unterminated string");
-			else if(t - m->token > TOK_SIZE - 2)
-				mu_throw(m, "Token too long");
 			else if(m->s[0] == '\\') {
 				switch(m->s[1])
 				{
 					case '\0': mu_throw(m, "Unterminated string"); break;
-					case 'n' : *t++ = '\n'; break;
-					case 'r' : *t++ = '\r'; break;
-					case 't' : *t++ = '\t'; break;
-					case 'b' : *t++ = '\b'; break;
-					case 'a' : *t++ = '\a'; break;
-					default : *t++ = m->s[1]; break;
+					case 'n' : tok_add(m, &n, '\n'); break;
+					case 'r' : tok_add(m, &n, '\r'); break;
+					case 't' : tok_add(m, &n, '\t'); break;
+					case 'b' : tok_add(m, &n, '\b'); break;
+					case 'a' : tok_add(m, &n, '\a'); break;
+					default : tok_add(m, &n, m->s[1]); break;
 				}
 				m->s+=2;
 			} else
-				*t++ = *m->s++;
+				tok_add(m, &n, *m->s++);
 		}
 		m->s++;
-		t[0] = '\0';
+		m->token[n] = '\0';
+		m->str = m->token;
+		m->str_len = n;
 		return T_STRING;
 	} else if(tolower(m->s[0]) == 'r' && (m->s[1] == '"' || m->s[1] == '\'')) {
 		/* Python inspired "raw" string */
 		char term = m->s[1];
-		for(m->s+=2, t=m->token; m->s[0] != term;) {
+		for(m->s+=2, m->str = m->s; m->s[0] != term; m->s++)
 			if(!m->s[0])
 				mu_throw(m, "Unterminated string");
-			else if(t - m->token > TOK_SIZE - 2)
-				mu_throw(m, "Token too long");
-			*t++ = *m->s++;
-		}
-		m->s++;
-		t[0] = '\0';
+		m->str_len = m->s++ - m->str;
 		return T_STRING;
 	} else if(isalpha(m->s[0]) || m->s[0] == '_') {
 		int k, v = T_IDENT;
-		for(t = m->token; isalnum(m->s[0]) || m->s[0] == '_' || m->s[0] == '$';) {
-			if(t - m->token > TOK_SIZE - 2)
-				mu_throw(m, "Token too long");
-			*t++ = tolower(*m->s++);
-		}
-		t[0] = '\0';
+		while(isalnum(m->s[0]) || m->s[0] == '_' || m->s[0] == '$')
+			tok_add(m, &n, tolower(*m->s++));
+		m->token[n] = '\0';
 		return (k = iskeyword(m->token))?k:v;
 	} else if(isdigit(m->s[0])) {
-		for(t=m->token; isdigit(m->s[0]);*t++ = *m->s++)
-			if(t-m->token > TOK_SIZE - 2)
-				mu_throw(m, "Token too long");
-		t[0] = '\0';
+		while(isdigit(m->s[0]))
+			tok_add(m, &n, *m->s++);
+		m->token[n] = '\0';
 		return T_NUMBER;
 	} else if(strchr(OPERATORS,m->s[0]))
 		return *m->s++;
@@ -375,6 +740,32 @@ whitespace:
 	return 0;
 }
 
+/* Copies the current token into buf if it fits,
+ * otherwise into a new buffer on the heap. */
+static char *tok_copy(struct musl *m, char *buf, size_t size) {
+	size_t len = strlen(m->token);
+	char *name = buf;
+	if(len >= size)
+		name = mu_alloc(m, len + 1);
+	memcpy(name, m->token, len + 1);
+	return name;
+}
+
+/* Builds the name "a[key]" of an array element in buf if it
+ * fits, otherwise in a new buffer on the heap. */
+static char *arr_name(struct musl *m, char *buf, size_t size, const char *a, const char *key) {
+	size_t alen = strlen(a), klen = strlen(key);
+	char *name = buf;
+	if(alen + klen + 3 > size)
+		name = mu_alloc(m, alen + klen + 3);
+	memcpy(name, a, alen);
+	name[alen] = '[';
+	memcpy(name + alen + 1, key, klen);
+	name[alen + klen + 1] = ']';
+	name[alen + klen + 2] = '\0';
+	return name;
+}
+
 char *mu_readfile(const char *fname) {
 	FILE *f;
 	long len,r;
@@ -408,6 +799,7 @@ char *mu_readfile(const char *fname) {
  *[
  */
 
+static void expect(struct musl *m, int tok, const char *what);
 static const char *stmt(struct musl *m);
 static struct mu_par fparams(const char *name, struct musl *m);
 static struct mu_par expr(struct musl *m);
@@ -420,153 +812,699 @@ static struct mu_par mul_expr(struct musl *m);
 static struct mu_par uexpr(struct musl *m);
 static struct mu_par atom(struct musl *m);
 
-static int scan_labels(struct musl *m){
-	const char *store = m->s;
-	int t = T_END, ft = 1, c, ln = -1;
+static void add_label(struct musl *m, hash_table *labels) {
+	struct var *lbl = new_var(m->token), *o;
+	if(!lbl) mu_throw(m, "Out of memory");
+	lbl->v.c = m->s;
+	/* The first label with a name wins. Later ones are kept behind
+	 * it so that mu_reload() can fall back on them. */
+	if((o = find_var(labels, m->token)) != NULL) {
+		lbl->next = o->next;
+		o->next = lbl;
+		labels->n++;
+		return;
+	}
+	if(!put_var(labels, lbl)) {
+		free_element(lbl, NULL);
+		mu_throw(m, "Out of memory");
+	}
+}
+
+/* Makes room for another SELECT or CASE keyword in sc */
+static void grow_selects(struct musl *m, struct mu_script *sc) {
+	if(sc->nselects == sc->selects_size) {
+		int size = sc->selects_size ? sc->selects_size << 1 : 8;
+		struct select_ref *r = realloc(sc->selects, size * sizeof *r);
+		if(!r) mu_throw(m, "Out of memory");
+		sc->selects = r;
+		sc->selects_size = size;
+	}
+}
+
+static void add_select_ref(struct mu_script *sc, const char *pos, struct select *sel) {
+	sc->selects[sc->nselects].pos = pos;
+	sc->selects[sc->nselects++].sel = sel;
+}
+
+static struct select *begin_select(struct musl *m, struct mu_script *sc, struct select *outer) {
+	struct select *sel;
+	grow_selects(m, sc);
+	if(!(sel = malloc(sizeof *sel)))
+		mu_throw(m, "Out of memory");
+	sel->pos = m->last;
+	sel->other = NULL;
+	sel->end = NULL;
+	init_table(&sel->strs);
+	init_table(&sel->ints);
+	sel->jump = NULL;
+	sel->min = INT_MAX;
+	sel->max = INT_MIN;
+	sel->outer = outer;
+	add_select_ref(sc, m->last, sel);
+	expect(m, T_CASE, "CASE");
+	return sel;
+}
+
+/*# value ::= ['-'] NUMBER | STRING
+ */
+static int case_value(struct musl *m, int *num) {
+	int t, neg = 0;
+	if((t = tokenize(m)) == '-') {
+		neg = 1;
+		t = tokenize(m);
+	}
+	if(t == T_NUMBER)
+		*num = neg ? -atoi(m->token) : atoi(m->token);
+	else if(t != T_STRING || neg)
+		mu_throw(m, "Constant expected after CASE");
+	return t;
+}
+
+/* Adds a case to one of the tables of a SELECT CASE,
+ * unless an earlier case has the same value */
+static int add_case(struct musl *m, hash_table *tbl, const char *key, const char *body) {
+	struct var *v;
+	if(find_var(tbl, key))
+		return 0;
+	if(!(v = new_var(key)))
+		mu_throw(m, "Out of memory");
+	v->v.c = body;
+	if(!put_var(tbl, v)) {
+		free_element(v, NULL);
+		mu_throw(m, "Out of memory");
+	}
+	return 1;
+}
+
+static void scan_case(struct musl *m, struct mu_script *sc, struct select *sel) {
+	const char *values, *body;
+	char buf[16];
+	int t, num;
+	size_t i, n;
+
+	if(sel->other)
+		mu_throw(m, "CASE after CASE ELSE");
+	grow_selects(m, sc);
+	add_select_ref(sc, m->last, sel);
+
+	if(tokenize(m) == T_ELSE) {
+		sel->other = m->s;
+	} else {
+		/* Find the body first; the values are read again to add them */
+		values = tok_reset(m)->s;
+		do {
+			case_value(m, &num);
+		} while(tokenize(m) == ',');
+		tok_reset(m);
+		body = m->s;
+
+		m->s = values;
+		do {
+			if((t = case_value(m, &num)) == T_STRING) {
+				/* Strings without escapes aren't terminated in the script */
+				if(m->str != m->token) {
+					for(i = 0, n = 0; i < m->str_len; i++)
+						tok_add(m, &n, m->str[i]);
+					m->token[n] = '\0';
+				}
+				add_case(m, &sel->strs, m->token, body);
+				num = atoi(m->token);
+			}
+			snprintf(buf, sizeof buf, "%d", num);
+			if(t == T_NUMBER)
+				add_case(m, &sel->strs, buf, body);
+			if(add_case(m, &sel->ints, buf, body)) {
+				if(num < sel->min) sel->min = num;
+				if(num > sel->max) sel->max = num;
+			}
+		} while(tokenize(m) == ',');
+		tok_reset(m);
+	}
+
+	if((t = tokenize(m)) != ':' && t != T_LF && t != T_END)
+		mu_throw(m, "':' or <LF> expected");
+	tok_reset(m);
+}
+
+/* Puts the bodies in a jump table if the numbers of the cases are dense */
+static void end_cases(struct musl *m, struct select *sel) {
+	struct var *v;
+	unsigned int i;
+	sel->end = m->s;
+	if(!sel->ints.n || (double)sel->max - sel->min >= 4.0 * sel->ints.n + 16)
+		return;
+	if(!(sel->jump = calloc((size_t)(sel->max - sel->min) + 1, sizeof *sel->jump)))
+		mu_throw(m, "Out of memory");
+	for(i = 0; i < sel->ints.size; i++)
+		for(v = sel->ints.b[i]; v; v = v->next)
+			sel->jump[atoi(v->name) - sel->min] = v->v.c;
+	clear_table(&sel->ints, NULL);
+}
+
+/* Scans the lines from m->s up to end (or the end of the text if end
+ * is NULL), adding their labels and SELECT CASEs to sc. ln is the last
+ * numbered label before them; the last one among them is returned. */
+static int scan_labels(struct musl *m, struct mu_script *sc, const char *end, int ln) {
+	const char *store = m->s, *x;
+	struct select *sel = NULL;
+	int t = T_END, p = T_END, ft = 1, c, lines = 0, nl = 0;
 
 	while(ft || (t=tokenize(m)) != T_END) {
 		if(ft || t == T_LF) {
-			int t2 = tokenize(m);
-			if(t2 == T_NUMBER) {
+			int t2;
+			if(t == T_LF && m->s[-1] == '\n')
+				lines++;
+			if(end && m->s >= end)
+				break;
+			if((t2 = tokenize(m)) == T_NUMBER) {
 				if((c = atoi(m->token)) <= ln)
 					mu_throw(m, "Label %d out of sequence", c);
 				ln = c;
-				if(find_var(m->labels, m->token)) {
+				if(find_var(&sc->labels, m->token)) {
 					mu_throw(m, "Duplicate label '%s'", m->token);
-				} else {
-					struct var * lbl = new_var(m->token);
-					if(!lbl) mu_throw(m, "Out of memory");
-					lbl->v.c = m->s;
-					put_var(m->labels, lbl);
-				}
+				} else
+					add_label(m, &sc->labels);
 			} else if(t2 == T_IDENT) {
-				if(tokenize(m) == ':') {
-					struct var * lbl = new_var(m->token);
-					if(!lbl) mu_throw(m, "Out of memory");
-					lbl->v.c = m->s;
-					put_var(m->labels, lbl);
-				}
-			} else if(t == T_LF)
+				if(tokenize(m) == ':')
+					add_label(m, &sc->labels);
+				else
+					tok_reset(m);
+			} else
 				tok_reset(m);
+		} else if(t == T_SELECT && p == T_KEND) {
+			if(!sel)
+				mu_throw(m, "END SELECT without SELECT CASE");
+			end_cases(m, sel);
+			sel = sel->outer;
+		} else if(t == T_SELECT) {
+			sel = begin_select(m, sc, sel);
+		} else if(t == T_CASE) {
+			if(!sel)
+				mu_throw(m, "CASE without SELECT CASE");
+			scan_case(m, sc, sel);
 		}
+		p = t;
 		ft = 0;
 	}
 
+	if(sel) {
+		m->s = sel->pos;
+		m->last = NULL;
+		mu_throw(m, "SELECT CASE without END SELECT");
+	}
+
+	/* If a string or a '\' took a newline, the lines can't be
+	 * scanned on their own by mu_reload() */
+	for(x = store; x < m->s; x++)
+		if(x[0] == '\n')
+			nl++;
+	sc->multiline = nl != lines || (end && m->s != end);
+
 	m->s = store;
-	return 1;
+	return ln;
 }
 
-/* Helpers for weak typing: */
-static int par_as_int(struct mu_par *par) {
-	if(par->type == mu_int) {
-		return par->v.i;
-	} else {
-		int i = atoi(par->v.s);
-		free(par->v.s);
-		par->type = mu_int;
-		par->v.i = i;
-		return i;
+/* Finds the SELECT CASE of the SELECT or CASE keyword at pos */
+static const struct select *find_select(struct musl *m, const char *pos) {
+	const struct mu_script *sc = m->script;
+	int lo = 0, hi = sc->nselects - 1;
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(sc->selects[mid].pos == pos)
+			return sc->selects[mid].sel;
+		else if(sc->selects[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
 	}
+	mu_throw(m, "SELECT CASE wasn't compiled");
+	return NULL;
 }
 
-static char *par_as_str(struct mu_par *par) {
-	if(par->type == mu_str) {
-		return par->v.s;
+/* Where SELECT CASE continues when the expression has the value val */
+static const char *select_case(const struct select *sel, const struct mu_par *val) {
+	const struct var *v;
+	char buf[16];
+	if(val->type == mu_str) {
+		v = find_var(&sel->strs, val->v.s);
+	} else if(sel->jump) {
+		if(val->v.i >= sel->min && val->v.i <= sel->max && sel->jump[val->v.i - sel->min])
+			return sel->jump[val->v.i - sel->min];
+		v = NULL;
 	} else {
-		char *buffer = malloc(20);
-		if(!buffer) return NULL;
-		sprintf(buffer, "%d", par->v.i);
-		par->type = mu_str;
-		par->v.s = buffer;
-		return buffer;
+		snprintf(buf, sizeof buf, "%d", val->v.i);
+		v = find_var(&sel->ints, buf);
 	}
+	if(v)
+		return v->v.c;
+	return sel->other ? sel->other : sel->end;
 }
 
-static void expect(struct musl *m, int tok, const char *what) {
-	if(tokenize(m) != tok) {
-		if(what)
-			mu_throw(m, "Expected %s", what);
-		else 
-			mu_throw(m, "Expected '%c'", tok);
+/* Stack handling.
+ * These set the error message and return 0 on failure,
+ * so that mu_gosub() can use them without mu_throw().
+ */
+static struct frame *push_gosub(struct musl *m, const char *ret) {
+	struct frame *f;
+	if(m->gosub_sp >= m->gosub_max) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "GOSUB stack overflow");
+		return NULL;
 	}
+	if(m->gosub_sp == m->gosub_size) {
+		int i, size = m->gosub_size ? m->gosub_size << 1 : STACK_SIZE;
+		struct frame *stack = realloc(m->gosub_stack, size * sizeof *stack);
+		if(!stack) {
+			snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+			return NULL;
+		}
+		for(i = m->gosub_size; i < size; i++) {
+			stack[i].locals = NULL;
+			stack[i].size = 0;
+		}
+		m->gosub_stack = stack;
+		m->gosub_size = size;
+	}
+	f = &m->gosub_stack[m->gosub_sp++];
+	f->ret = ret;
+	f->nlocals = 0;
+	f->nnamed = 0;
+	return f;
 }
 
-/*# program ::= [line]*
- *# line ::= [label ':'] stmts <LF>
- *#            | NUMBER stmts <LF>
+static const char *pop_gosub(struct musl *m) {
+	struct frame *f = &m->gosub_stack[--m->gosub_sp];
+	int i;
+	for(i = 0; i < f->nlocals; i++)
+		if(f->locals[i].val.type == mu_str)
+			free(f->locals[i].val.v.s);
+	f->nlocals = 0;
+	return f->ret;
+}
+
+/* Unwinds the GOSUB stack to depth sp */
+static void pop_frames(struct musl *m, int sp) {
+	while(m->gosub_sp > sp)
+		pop_gosub(m);
+}
+
+static struct local *new_local(struct musl *m, struct frame *f) {
+	struct local *l;
+	if(f->nlocals == f->size) {
+		int size = f->size ? f->size << 1 : STACK_SIZE;
+		l = realloc(f->locals, size * sizeof *l);
+		if(!l) mu_throw(m, "Out of memory");
+		f->locals = l;
+		f->size = size;
+	}
+	l = &f->locals[f->nlocals++];
+	l->name = NULL;
+	l->len = 0;
+	l->val.type = mu_int;
+	l->val.v.i = 0;
+	return l;
+}
+
+/* Finds a local variable in the current subroutine's frame */
+static struct mu_par *find_local(struct musl *m, const char *name) {
+	struct frame *f;
+	size_t len, j;
+	int i;
+	if(!m->gosub_sp || !(f = &m->gosub_stack[m->gosub_sp - 1])->nnamed)
+		return NULL;
+	len = strlen(name);
+	for(i = 0; i < f->nnamed; i++) {
+		struct local *l = &f->locals[i];
+		if(l->len != len)
+			continue;
+		for(j = 0; j < len && tolower(l->name[j]) == name[j]; j++);
+		if(j == len)
+			return &l->val;
+	}
+	return NULL;
+}
+
+/* Declares the identifier that was just tokenized as a local variable */
+static void add_local(struct musl *m) {
+	struct frame *f;
+	struct local *l;
+	if(!m->gosub_sp)
+		mu_throw(m, "LOCAL outside of a subroutine");
+	if(find_local(m, m->token))
+		return;
+	f = &m->gosub_stack[m->gosub_sp - 1];
+	if(f->nnamed < f->nlocals)
+		l = &f->locals[f->nnamed];
+	else
+		l = new_local(m, f);
+	l->name = m->last;
+	l->len = m->s - m->last;
+	f->nnamed++;
+}
+
+/*
+ * Argument lists
  */
-static int program(struct musl *m) {
-	int t, n = 0, ft = 1;
-	const char *s;
-	while((t=tokenize(m)) != T_END && t != T_KEND) {
-		if(ft || t == T_LF) {
-			if(!ft) t = tokenize(m);
-			if(t == T_IDENT) {
-				const char *x = m->last;
-				if(tokenize(m) != ':') {
-					m->s = x;
-				}
-			} else if(t != T_NUMBER) {
-				tok_reset(m);
-			}
-		} else if((s = stmt(tok_reset(m))) != NULL) {
-			m->s = s;
-			m->last = NULL;
+static void begin_args(struct musl *m, struct args *a) {
+	a->argv = a->buf;
+	a->argc = 0;
+	a->size = INLINE_ARGS;
+	a->typed = NULL;
+	a->prev = m->args;
+	m->args = a;
+}
 
-			/* To return to the C domain when we're in
-			 * a call to mu_gosub(): */
-			if(m->s == NULL) return n;
+/* Appends v to the list; the list takes ownership of it */
+static void add_arg(struct musl *m, struct args *a, struct mu_par v) {
+	if(a->argc == a->size) {
+		int size = a->size << 1;
+		struct mu_par *argv = malloc(size * sizeof *argv);
+		if(!argv) {
+			if(v.type == mu_str)
+				free(v.v.s);
+			mu_throw(m, "Out of memory");
 		}
-		ft = 0;
+		memcpy(argv, a->argv, a->argc * sizeof *argv);
+		if(a->argv != a->buf)
+			free(a->argv);
+		a->argv = argv;
+		a->size = size;
 	}
-	return n;
+	a->argv[a->argc++] = v;
 }
 
-/*# stmts ::= stmt [':' [<LF>+] stmts]
- *# stmt ::= [LET] ident ['[' expr ']'] '=' expr
- *#        | ident '(' fparams ')'
- *#        | GOTO label
- *#        | GOSUB label
- *#        | ON expr GOTO label [',' label]*
- *#        | ON expr GOSUB label [',' label]*
- *#        | RETURN
- *#        | IF expr THEN [<LF>+] stmts
- *#        | FOR ident = expr TO expr [STEP expr] DO [<LF>+] stmts [<LF>+] NEXT
- *#        | END
- */
-static const char *stmt(struct musl *m) {
+/* Frees the arguments and removes the list, which must be m->args */
+static void end_args(struct musl *m, struct args *a) {
+	int i;
+	assert(m->args == a);
+	for(i = 0; i < a->argc; i++)
+		if(a->argv[i].type == mu_str)
+			free(a->argv[i].v.s);
+	if(a->argv != a->buf)
+		free(a->argv);
+	free(a->typed);
+	m->args = a->prev;
+}
+
+/* Makes the list a own a name on the heap, so that mu_throw() frees
+ * it. The list is begun by the first name that it holds. */
+static void hold_name(struct musl *m, struct args *a, char *name) {
+	struct mu_par p;
+	if(m->args != a)
+		begin_args(m, a);
+	p.type = mu_str;
+	p.v.s = name;
+	add_arg(m, a, p);
+}
+
+/* Frees the names held by a, if it holds any */
+static void free_names(struct musl *m, struct args *a) {
+	if(m->args == a)
+		end_args(m, a);
+}
+
+/* Pushes a frame with the arguments in its slots.
+ * The frame takes ownership of the arguments. */
+static void push_frame(struct musl *m, const char *ret, struct args *a) {
+	int i;
+	struct frame *f = push_gosub(m, ret);
+	if(!f)
+		mu_throw(m, NULL);
+	for(i = 0; i < a->argc; i++) {
+		new_local(m, f)->val = a->argv[i];
+		a->argv[i].type = mu_int;
+	}
+}
+
+static void set_retval(struct musl *m, struct mu_par val) {
+	if(m->has_retval && m->retval.type == mu_str)
+		free(m->retval.v.s);
+	m->retval = val;
+	m->has_retval = 1;
+}
+
+static int push_for(struct musl *m, const char *pos) {
+	if(m->for_sp >= m->for_max) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "FOR stack overflow");
+		return 0;
+	}
+	if(m->for_sp == m->for_size) {
+		int size = m->for_size ? m->for_size << 1 : STACK_SIZE;
+		const char **stack = realloc(m->for_stack, size * sizeof *stack);
+		if(!stack) {
+			snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+			return 0;
+		}
+		m->for_stack = stack;
+		m->for_size = size;
+	}
+	m->for_stack[m->for_sp++] = pos;
+	return 1;
+}
+
+/* The call log of asynchronous calls.
+ * Calls are only logged in the outermost program(), since
+ * a script can not be suspended inside a nested one. */
+#define LOGGING(m)	((m)->async && (m)->active && (m)->depth == 1)
+
+static void clear_log(struct musl *m) {
+	while(m->nlog > 0)
+		if(m->log[--m->nlog].type == mu_str)
+			free(m->log[m->nlog].v.s);
+	m->log_pos = 0;
+}
+
+/* Appends a copy of v to the log. Returns 0 if out of memory */
+static int log_call(struct musl *m, struct mu_par v) {
+	if(m->nlog == m->log_size) {
+		int size = m->log_size ? m->log_size << 1 : STACK_SIZE;
+		struct mu_par *log = realloc(m->log, size * sizeof *log);
+		if(!log)
+			return 0;
+		m->log = log;
+		m->log_size = size;
+	}
+	if(v.type == mu_str && !(v.v.s = strdup(v.v.s)))
+		return 0;
+	m->log[m->nlog++] = v;
+	m->log_pos = m->nlog;
+	return 1;
+}
+
+/* If a statement is being executed again, retrieves the result
+ * of the next call from the log */
+static int replay_call(struct musl *m, struct mu_par *v) {
+	if(m->log_pos >= m->nlog)
+		return 0;
+	*v = m->log[m->log_pos++];
+	if(v->type == mu_str && !(v->v.s = strdup(v->v.s)))
+		mu_throw(m, "Out of memory");
+	return 1;
+}
+
+/* Called at the start of every statement while LOGGING() */
+static void begin_stmt(struct musl *m, const char *s) {
+	/* Unless the log is still being replayed, the
+	previous statement's calls are no longer needed */
+	if(m->log_pos < m->nlog)
+		return;
+	clear_log(m);
+	m->stmt_start = s;
+}
+
+/* Accessors for variables that may be local to a subroutine */
+static void set_int(struct musl *m, const char *name, int n) {
+	struct mu_par *lv = find_local(m, name);
+	if(lv) {
+		if(lv->type == mu_str)
+			free(lv->v.s);
+		lv->type = mu_int;
+		lv->v.i = n;
+	} else if(!mu_set_int(m, name, n))
+		mu_throw(m, "Out of memory");
+}
+
+static int get_int(struct musl *m, const char *name) {
+	struct mu_par *lv = find_local(m, name);
+	if(lv)
+		return lv->type == mu_int ? lv->v.i : atoi(lv->v.s);
+	return mu_get_int(m, name);
+}
+
+/* Helpers for weak typing: */
+static int par_as_int(struct mu_par *par) {
+	if(par->type == mu_int) {
+		return par->v.i;
+	} else {
+		int i = atoi(par->v.s);
+		free(par->v.s);
+		par->type = mu_int;
+		par->v.i = i;
+		return i;
+	}
+}
+
+static char *par_as_str(struct mu_par *par) {
+	if(par->type == mu_str) {
+		return par->v.s;
+	} else {
+		char *buffer = malloc(20);
+		if(!buffer) return NULL;
+		sprintf(buffer, "%d", par->v.i);
+		par->type = mu_str;
+		par->v.s = buffer;
+		return buffer;
+	}
+}
+
+static void expect(struct musl *m, int tok, const char *what) {
+	if(tokenize(m) != tok) {
+		if(what)
+			mu_throw(m, "Expected %s", what);
+		else 
+			mu_throw(m, "Expected '%c'", tok);
+	}
+}
+
+/* Checks whether the END that was just read is an END SELECT */
+static int end_select(struct musl *m) {
+	const char *last = m->last, *s = m->s;
+	int t = tokenize(m);
+	m->last = last;
+	m->s = s;
+	return t == T_SELECT;
+}
+
+/*# program ::= [line]*
+ *# line ::= [label ':'] stmts <LF>
+ *#            | NUMBER stmts <LF>
+ */
+static int program(struct musl *m) {
+	int t, n = 0, ft = 1;
+	const char *s;
+	m->depth++;
+	while((t=tokenize(m)) != T_END && (t != T_KEND || end_select(m))) {
+		if(ft || t == T_LF) {
+			if(!ft) t = tokenize(m);
+			if(t == T_IDENT) {
+				const char *x = m->last;
+				if(tokenize(m) != ':') {
+					m->s = x;
+				}
+			} else if(t != T_NUMBER) {
+				tok_reset(m);
+			}
+		} else {
+			if((s = stmt(tok_reset(m))) != NULL) {
+				m->s = s;
+				m->last = NULL;
+
+				/* To return to the C domain when we're in
+				 * a call to mu_gosub(): */
+				if(m->s == NULL) break;
+			}
+
+			/* Waiting for an asynchronous call: The statement
+			 * is executed again when the call completes */
+			if(m->pending && m->depth == 1) {
+				m->s = m->stmt_start;
+				m->last = NULL;
+				m->active = 1;
+				m->suspended = 1;
+				break;
+			}
+
+			/* Out of budget: Only the outermost program() can be
+			 * suspended, since the others have C code on the stack. */
+			if(m->preempt && --m->budget <= 0 && m->depth == 1 && m->s) {
+				m->suspended = 1;
+				break;
+			}
+		}
+		ft = 0;
+	}
+	m->depth--;
+	return n;
+}
+
+/*# args ::= '(' [expr [',' expr]*] ')'
+ */
+static void gosub_args(struct musl *m, struct args *a) {
+	if(tokenize(m) != '(') {
+		tok_reset(m);
+		return;
+	}
+	if(tokenize(m) == ')')
+		return;
+	tok_reset(m);
+	do {
+		add_arg(m, a, expr(m));
+	} while(tokenize(m) == ',');
+	tok_reset(m);
+	expect(m, ')', NULL);
+}
+
+/*# stmts ::= stmt [':' [<LF>+] stmts]
+ *# stmt ::= [LET] ident ['[' expr ']'] '=' expr
+ *#        | ident '(' fparams ')'
+ *#        | GOTO label
+ *#        | GOSUB label [args]
+ *#        | ON expr GOTO label [',' label]*
+ *#        | ON expr GOSUB label [',' label]*
+ *#        | RETURN [expr]
+ *#        | LOCAL ident [',' ident]*
+ *#        | IF expr THEN [<LF>+] stmts
+ *#        | FOR ident = expr TO expr [STEP expr] DO [<LF>+] stmts [<LF>+] NEXT
+ *#        | SELECT CASE expr <LF> [[<LF>+] CASE cases [<LF>+] stmts]* [<LF>+] END SELECT
+ *#        | END
+ *# cases ::= value [',' value]* | ELSE
+ */
+static const char *stmt(struct musl *m) {
 	int t, u, has_let=0, q;
-	char name[TOK_SIZE], buf[TOK_SIZE];
+	char nbuf[TOK_SIZE], ibuf[TOK_SIZE], *name, *buf;
 	struct var *v;
 	struct mu_par rhs;
+	struct args names;
 	
 start:
-	if((t = tokenize(m)) == ':') {
+	if((t = tokenize(m)) == ':')
 		goto start;
-	} else if(t == T_IDENT || t == T_LET) {
+
+	if(LOGGING(m))
+		begin_stmt(m, m->last);
+
+	if(t == T_IDENT || t == T_LET) {
 		if(t == T_LET && (has_let = 1) && (t = tokenize(m)) != T_IDENT)
 			mu_throw(m, "Identifier expected");
 
-		strcpy(buf, m->token);
+		if((buf = tok_copy(m, ibuf, sizeof ibuf)) != ibuf)
+			hold_name(m, &names, buf);
 		if(tokenize(m) == '[') {
 			has_let = 1;
 
 			rhs = expr(m);
 			par_as_str(&rhs);
-			snprintf(name, TOK_SIZE, "%s[%s]", buf, rhs.v.s);
-			free(rhs.v.s);
+			hold_name(m, &names, rhs.v.s);
+			if((name = arr_name(m, nbuf, sizeof nbuf, buf, rhs.v.s)) != nbuf)
+				hold_name(m, &names, name);
 
 			expect(m, ']', NULL);
 		} else {
-			strcpy(name, buf);
+			name = buf;
 			tok_reset(m);
 		}
 
 		if((u = tokenize(m)) == '=') {
+			struct mu_par *lv;
 			rhs = expr(m);
-			if(rhs.type == mu_str) {
-				if(m->active && !mu_set_str(m, name, rhs.v.s))
+			if(m->active && name == buf && (lv = find_local(m, name))) {
+				if(lv->type == mu_str)
+					free(lv->v.s);
+				*lv = rhs;
+			} else if(rhs.type == mu_str) {
+				if(m->active && !mu_set_str(m, name, rhs.v.s)) {
+					free(rhs.v.s);
 					mu_throw(m, "Out of memory");
+				}
 				free(rhs.v.s);
 			} else {
 				if(m->active && !mu_set_int(m, name, rhs.v.i))
@@ -580,6 +1518,7 @@ start:
 			if(rhs.type == mu_str)
 				free(rhs.v.s);
 		}
+		free_names(m, &names);
 	} else if(t == T_IF) {
 		int save = m->active;
 		const char *result;
@@ -603,27 +1542,50 @@ start:
 		if((u=tokenize(m)) != T_IDENT && u != T_NUMBER)
 			mu_throw(m, "Label expected");
 
-		if(m->active && t == T_GOSUB) {
-			if(m->gosub_sp >= MAX_GOSUB - 1)
-				mu_throw(m, "GOSUB stack overflow");
-			m->gosub_stack[m->gosub_sp++] = m->s;
+		if(!(v = find_var(&m->script->labels, m->token)))
+			mu_throw(m, "GOTO/GOSUB to undefined label '%s'", m->token);
+
+		if(t == T_GOSUB) {
+			struct args a;
+			begin_args(m, &a);
+			gosub_args(m, &a);
+			if(m->active)
+				push_frame(m, m->s, &a);
+			end_args(m, &a);
 		}
 
-		if(!(v = find_var(m->labels, m->token)))
-			mu_throw(m, "GOTO/GOSUB to undefined label '%s'", m->token);
 		if(m->active)
 			return v->v.c;
 	} else if(t == T_RETURN) {
+		int has_val = 0;
 		if(m->gosub_sp <= 0)
 			mu_throw(m, "GOSUB stack underflow");
+		if((u = tokenize(m)) != T_LF && u != ':' && u != T_END && u != T_KEND) {
+			tok_reset(m);
+			rhs = expr(m);
+			has_val = 1;
+		} else
+			tok_reset(m);
 		if(m->active) {
-			m->s = m->gosub_stack[--m->gosub_sp];
+			m->s = pop_gosub(m);
 			m->last = NULL;
 
 			/* special case when for when we're in a mu_gosub() */
-			if(m->s == NULL)
+			if(m->s == NULL) {
+				if(has_val)
+					set_retval(m, rhs);
 				return NULL;
+			}
 		}
+		if(has_val && rhs.type == mu_str)
+			free(rhs.v.s);
+	} else if(t == T_LOCAL) {
+		do {
+			expect(m, T_IDENT, "identifier");
+			if(m->active)
+				add_local(m);
+		} while(tokenize(m) == ',');
+		tok_reset(m);
 	} else if(t == T_ON) {
 		int j = 0;
 		rhs = expr(m);
@@ -636,16 +1598,15 @@ start:
 				mu_throw(m, "Label expected");
 
 			if(m->active && j++ == rhs.v.i) {
-				if(!(v = find_var(m->labels, m->token)))
+				if(!(v = find_var(&m->script->labels, m->token)))
 					mu_throw(m, "ON .. GOTO/GOSUB to undefined label '%s'", m->token);
 				if(u == T_GOSUB) {
-					if(m->gosub_sp >= MAX_GOSUB - 1)
-						mu_throw(m, "GOSUB stack overflow");
 					while(tokenize(m) == ',')
 						if((q=tokenize(m)) != T_IDENT && q != T_NUMBER)
 							mu_throw(m, "Label expected");
 					tok_reset(m);
-					m->gosub_stack[m->gosub_sp++] = m->s;
+					if(!push_gosub(m, m->s))
+						mu_throw(m, NULL);
 				}
 				return v->v.c;
 			}
@@ -654,12 +1615,12 @@ start:
 	} else if(t == T_FOR) {
 		int start;
 
-		if(m->for_sp >= MAX_FOR)
-			mu_throw(m, "FOR stack overflow");
-		m->for_stack[m->for_sp++] = m->s;
+		if(!push_for(m, m->s))
+			mu_throw(m, NULL);
 
 		expect(m, T_IDENT, "identifier");
-		strcpy(buf, m->token);
+		if((buf = tok_copy(m, ibuf, sizeof ibuf)) != ibuf)
+			hold_name(m, &names, buf);
 		expect(m, '=', NULL);
 
 		rhs = expr(m);
@@ -694,7 +1655,8 @@ start:
 				stmt(m);
 			}
 		} else
-			mu_set_int(m, buf, start);
+			set_int(m, buf, start);
+		free_names(m, &names);
 	} else if(t == T_NEXT) {
 		if(m->active) {
 			int start, stop, step, idx;
@@ -704,7 +1666,8 @@ start:
 			m->s = m->for_stack[m->for_sp - 1];
 
 			expect(m, T_IDENT, "identifier");
-			strcpy(buf, m->token);
+			if((buf = tok_copy(m, ibuf, sizeof ibuf)) != ibuf)
+				hold_name(m, &names, buf);
 			expect(m, '=', NULL);
 
 			rhs = expr(m);
@@ -728,16 +1691,46 @@ start:
 
 			expect(m, T_DO, "DO");
 
-			idx = mu_get_int(m, buf);
-			if((step > 0 && idx >= stop) || (step < 0 && idx <= stop)) {
+			idx = get_int(m, buf);
+			if(m->pending) {
+				/* An asynchronous call in the FOR: NEXT is
+				 * executed again when the call completes */
+				m->s = save;
+			} else if((step > 0 && idx >= stop) || (step < 0 && idx <= stop)) {
 				m->s = save;
 				m->for_sp--;
 			} else {
 				idx += step;
-				mu_set_int(m, buf, idx);
+				set_int(m, buf, idx);
 			}
+			free_names(m, &names);
 		}
 		return NULL;
+	} else if(t == T_SELECT) {
+		const struct select *sel = find_select(m, m->last);
+		const char *body = sel->end;
+		expect(m, T_CASE, "CASE");
+		rhs = expr(m);
+		if((u = tokenize(m)) != T_LF && u != T_END)
+			mu_throw(m, "<LF> expected after SELECT CASE");
+		if(m->active)
+			body = select_case(sel, &rhs);
+		if(rhs.type == mu_str)
+			free(rhs.v.s);
+		return body;
+	} else if(t == T_CASE) {
+		/* The body of the previous case ends here */
+		if(m->active)
+			return find_select(m, m->last)->end;
+		if(tokenize(m) != T_ELSE) {
+			tok_reset(m);
+			do {
+				case_value(m, &q);
+			} while(tokenize(m) == ',');
+			tok_reset(m);
+		}
+	} else if(t == T_KEND && end_select(m)) {
+		tokenize(m);
 	} else if(t == T_KEND || t == T_END) {
 		if(m->active)
 			tok_reset(m);
@@ -760,11 +1753,88 @@ start:
 
 /*# fparams ::= '(' [expr ',' expr ',' ...] ')'
  */
+/* Looks up the function called at pos in the script. The function
+ * is remembered, so that the call site need not look it up again. */
+static struct var *find_func(struct musl *m, const char *name, const char *pos) {
+	struct call_site *cs = &m->calls[((size_t)pos * 2654435761u >> 8) & (CALL_CACHE_SIZE - 1)];
+	struct var *v;
+	if(cs->pos == pos && cs->gen == m->call_gen)
+		return cs->fun;
+	if((v = get_func(m, name)) != NULL) {
+		cs->pos = pos;
+		cs->gen = m->call_gen;
+		cs->fun = v;
+	}
+	return v;
+}
+
+/* Makes the cached call sites stale */
+static void new_call_gen(struct musl *m) {
+	if(++m->call_gen == 0) {
+		memset(m->calls, 0, sizeof m->calls);
+		m->call_gen = 1;
+	}
+}
+
+static void check_arity(struct musl *m, const char *name, const struct func_sig *f, int argc) {
+	if(f->lenient) {
+		/* Only when it is called, with the old message */
+		if(argc < f->min && m->active)
+			mu_throw(m, "Too few parameters to function");
+		return;
+	}
+	if(argc >= f->min && (f->max < 0 || argc <= f->max))
+		return;
+	if(f->max < 0)
+		mu_throw(m, "%s() takes at least %d parameter%s", name, f->min, f->min == 1 ? "" : "s");
+	else if(f->min == f->max)
+		mu_throw(m, "%s() takes %d parameter%s", name, f->min, f->min == 1 ? "" : "s");
+	mu_throw(m, "%s() takes %d to %d parameters", name, f->min, f->max);
+}
+
+/* Calls a function with a signature, converting its arguments */
+static struct mu_par call_sig(struct musl *m, const struct func_sig *f, struct args *a) {
+	struct mu_arg buf[INLINE_ARGS], *argv = buf;
+	struct mu_par rv;
+	int i, n = (int)strlen(f->types), argc = a->argc;
+
+	/* A lenient function doesn't see its surplus arguments */
+	if(f->max >= 0 && argc > f->max)
+		argc = f->max;
+	if(argc > INLINE_ARGS)
+		argv = a->typed = mu_alloc(m, argc * sizeof *argv);
+	for(i = 0; i < argc; i++) {
+		struct mu_par *p = &a->argv[i];
+		if(f->types[i < n ? i : n - 1] == 'i') {
+			argv[i].i = p->type == mu_int ? p->v.i : atoi(p->v.s);
+			argv[i].s = NULL;
+			argv[i].len = 0;
+		} else {
+			/* The list owns the converted string */
+			if(p->type == mu_int && !par_as_str(p))
+				mu_throw(m, "Out of memory");
+			argv[i].i = 0;
+			argv[i].s = p->v.s;
+			argv[i].len = strlen(p->v.s);
+		}
+	}
+
+	rv = f->fun(m, argc, argv);
+	if(f->ret == 'i' && rv.type == mu_str)
+		par_as_int(&rv);
+	else if(f->ret == 's' && rv.type == mu_int && !par_as_str(&rv))
+		mu_throw(m, "Out of memory");
+	return rv;
+}
+
 static struct mu_par fparams(const char *name, struct musl *m) {
-	int t, i, argc = 0, e, close = 0;
-	struct mu_par argv[MAX_PARAMS], rv = {mu_int, {0}};
+	int t, close = 0;
+	struct mu_par rv = {mu_int, {0}};
+	struct args a;
 	struct var *v;
+	const char *site = m->s;
 
+	begin_args(m, &a);
 	if((t = tokenize(m)) == '(') {
 		close = 1;
 		if(tokenize(m) == ')')
@@ -778,9 +1848,7 @@ static struct mu_par fparams(const char *name, struct musl *m) {
 	}
 
 	do {
-		if(argc + 1 == MAX_PARAMS)
-			mu_throw(m, "Too many parameters in call to '%s()'. Internal limit %d reached.", name, MAX_PARAMS);
-		argv[argc++] = expr(m);
+		add_arg(m, &a, expr(m));
 	} while(tokenize(m) == ',');
 	tok_reset(m);
 	
@@ -788,33 +1856,34 @@ static struct mu_par fparams(const char *name, struct musl *m) {
 		mu_throw(m, "Expected ')'");
 call:
 	
-	v = find_var(m->funcs, name);
+	v = find_func(m, name, site);
 	if(!v || !v->v.fun)
 		mu_throw(m, "Call to undefined function %s()", name);
-
-	if(m->active) {
-		/* This whole setjmp()-longjmp()ing is to ensure that
-		 * the parameters get free()ed if mu_throw() is called
-		 * from within the function.
-		 */
-		volatile jmp_buf save_jmp;
-		memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
-		if((e = setjmp(m->on_error)) == 0) {
-			rv = v->v.fun(m, argc, argv);
-		} else {
-			memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
-			for(i = 0; i < argc; i++)
-				if(argv[i].type == mu_str)
-					free(argv[i].v.s);
-			longjmp(m->on_error, e);
+	if(v->type == mu_str)
+		check_arity(m, name, v->v.sig, a.argc);
+
+	if(LOGGING(m) && replay_call(m, &rv)) {
+		/* Already called before the script was suspended */
+	} else if(m->active) {
+		/* If the function calls mu_throw(), the arguments
+		 * are freed through m->args */
+		if(v->type == mu_str)
+			rv = call_sig(m, v->v.sig, &a);
+		else
+			rv = v->v.fun(m, a.argc, a.argv);
+
+		if(m->pending) {
+			/* The function called mu_suspend(): Parse the rest
+			 * of the statement without executing it */
+			m->active = 0;
+		} else if(LOGGING(m) && !log_call(m, rv)) {
+			if(rv.type == mu_str)
+				free(rv.v.s);
+			mu_throw(m, "Out of memory");
 		}
-		memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
 	}
 	
-	for(i = 0; i < argc; i++)
-		if(argv[i].type == mu_str)
-			free(argv[i].v.s);
-
+	end_args(m, &a);
 	return rv;
 }
 
@@ -825,9 +1894,24 @@ static struct mu_par expr(struct musl *m) {
 
 	if(tokenize(m) == T_OR) {
 		int n = par_as_int(&lhs);
+		if(m->short_circuit)
+			n = !!n;
 		do {
-			struct mu_par rhs = and_expr(m);
-			n = n | par_as_int(&rhs);
+			struct mu_par rhs;
+			if(m->short_circuit && n) {
+				/* Parse, but don't evaluate the right hand side */
+				int save = m->active;
+				m->active = 0;
+				rhs = and_expr(m);
+				m->active = save;
+				par_as_int(&rhs);
+			} else {
+				rhs = and_expr(m);
+				if(m->short_circuit)
+					n = !!par_as_int(&rhs);
+				else
+					n = n | par_as_int(&rhs);
+			}
 		} while(tokenize(m) == T_OR);
 		assert(lhs.type == mu_int);
 		lhs.v.i = n;
@@ -842,9 +1926,23 @@ static struct mu_par and_expr(struct musl *m) {
 	struct mu_par lhs = not_expr(m);
 	if(tokenize(m) == T_AND) {
 		int n = par_as_int(&lhs);
+		if(m->short_circuit)
+			n = !!n;
 		do {
-			struct mu_par rhs = not_expr(m);
-			n = n & par_as_int(&rhs);
+			struct mu_par rhs;
+			if(m->short_circuit && !n) {
+				int save = m->active;
+				m->active = 0;
+				rhs = not_expr(m);
+				m->active = save;
+				par_as_int(&rhs);
+			} else {
+				rhs = not_expr(m);
+				if(m->short_circuit)
+					n = !!par_as_int(&rhs);
+				else
+					n = n & par_as_int(&rhs);
+			}
 		} while(tokenize(m) == T_AND);
 		assert(lhs.type == mu_int);
 		lhs.v.i = n;
@@ -971,15 +2069,15 @@ static struct mu_par mul_expr(struct musl *m) {
 			int r = par_as_int(&rhs);
 			if(t == '*')
 				n *= r;
-			else if(t == '/') {
-				if(!r)
+			else if(!r) {
+				/* Expressions that aren't evaluated can't divide by zero */
+				if(m->active)
 					mu_throw(m, "Divide by zero");
+				n = 0;
+			} else if(t == '/')
 				n /= r;
-			} else {
-				if(!r)
-					mu_throw(m, "Divide by zero");
+			else
 				n %= r;
-			}
 		} while((t = tokenize(m)) == '*' || t == '/' || t  == '%');
 		assert(lhs.type == mu_int);
 		lhs.v.i = n;
@@ -1007,6 +2105,7 @@ static struct mu_par uexpr(struct musl *m) {
  *#        |  ident
  *#        |  ident '[' expr ']'
  *#        |  ident '(' [fparams] ')'
+ *#        |  GOSUB label [args]
  *#        |  number
  *#        |  string
  *#        |  '@' ident
@@ -1023,26 +2122,41 @@ static struct mu_par atom(struct musl *m) {
 		return lhs;
 	} else if(t == T_IDENT) {
 
-		char name[TOK_SIZE], buf[TOK_SIZE];
-		strcpy(buf, m->token);
+		char nbuf[TOK_SIZE], ibuf[TOK_SIZE], *name, *buf;
+		struct args names;
+		if((buf = tok_copy(m, ibuf, sizeof ibuf)) != ibuf)
+			hold_name(m, &names, buf);
 
 		if((u=tokenize(m)) == '(') {
 			tok_reset(m);
-			return fparams(buf, m);
+			ret = fparams(buf, m);
+			free_names(m, &names);
+			return ret;
 		} else if(u == '[') {
 
 			struct mu_par rhs = expr(m);
 			par_as_str(&rhs);
-			snprintf(name, TOK_SIZE, "%s[%s]", buf, rhs.v.s);
-			free(rhs.v.s);
+			hold_name(m, &names, rhs.v.s);
+			if((name = arr_name(m, nbuf, sizeof nbuf, buf, rhs.v.s)) != nbuf)
+				hold_name(m, &names, name);
 
 			expect(m, ']', NULL);
 		} else {
-			strcpy(name, buf);
+			struct mu_par *lv;
 			tok_reset(m);
+			if((lv = find_local(m, buf))) {
+				ret = *lv;
+				if(ret.type == mu_str)
+					ret.v.s = strdup(ret.v.s);
+				free_names(m, &names);
+				return ret;
+			}
+			name = buf;
 		}
 
-		v = find_var(m->vars, name);
+		v = get_var(m, name);
+		free_names(m, &names);
+
 		if(!v) {
 			if(!m->active) return ret;
 			/* Undefined variables are inited to "" */
@@ -1064,13 +2178,61 @@ static struct mu_par atom(struct musl *m) {
 		return ret;
 	} else if(t == T_STRING) {
 		ret.type = mu_str;
-		ret.v.s = strdup(m->token);
+		ret.v.s = mu_alloc(m, m->str_len + 1);
+		memcpy(ret.v.s, m->str, m->str_len);
+		ret.v.s[m->str_len] = '\0';
 		return ret;
 	} else if(t == '@') {
 		expect(m, T_IDENT, "identifier");
 		ret.type = mu_str;
 		ret.v.s = strdup(m->token);
 		return ret;
+	} else if(t == T_GOSUB) {
+		/* GOSUB in an expression runs the subroutine
+		 * like mu_gosub() and returns its RETURN value */
+		struct args a;
+		const char *save;
+		int save_sp;
+
+		if((u=tokenize(m)) != T_IDENT && u != T_NUMBER)
+			mu_throw(m, "Label expected");
+		if(!(v = find_var(&m->script->labels, m->token)))
+			mu_throw(m, "GOSUB to undefined label '%s'", m->token);
+		begin_args(m, &a);
+		gosub_args(m, &a);
+		if(!m->active || (LOGGING(m) && replay_call(m, &ret))) {
+			end_args(m, &a);
+			return ret;
+		}
+
+		save = m->s;
+		save_sp = m->gosub_sp;
+		if(m->has_retval && m->retval.type == mu_str)
+			free(m->retval.v.s);
+		m->has_retval = 0;
+		push_frame(m, NULL, &a);
+		end_args(m, &a);
+
+		m->s = v->v.c;
+		m->last = NULL;
+		program(m);
+		pop_frames(m, save_sp);
+		m->s = save;
+		m->last = NULL;
+
+		if(m->has_retval) {
+			m->has_retval = 0;
+			ret = m->retval;
+		} else {
+			ret.type = mu_str;
+			ret.v.s = strdup("");
+		}
+		if(LOGGING(m) && !log_call(m, ret)) {
+			if(ret.type == mu_str)
+				free(ret.v.s);
+			mu_throw(m, "Out of memory");
+		}
+		return ret;
 	}
 
 	mu_throw(m, "Value expected");
@@ -1078,92 +2240,330 @@ static struct mu_par atom(struct musl *m) {
 }
 
 static int add_stdfuns(struct musl *m);
+static void clear_func(struct var *v);
+
+/* The last interpreter id; see struct musl */
+static unsigned long next_id;
 
 struct musl *mu_create() {
 	struct musl *m;
 	m = malloc(sizeof *m);
 	if(!m) return NULL;
-	init_table(m->vars);
-	init_table(m->labels);
-	init_table(m->funcs);
-	m->gosub_sp = 0;
-	m->for_sp = 0;
+	if(!(m->token = malloc(TOK_SIZE))) {
+		free(m);
+		return NULL;
+	}
+	m->tok_size = TOK_SIZE;
+	init_table(&m->vars);
+	m->script = &no_script;
+	init_table(&m->funcs);
+	init_table(&m->chans);
+	m->gosub_stack = NULL;
+	m->gosub_sp = m->gosub_size = 0;
+	m->gosub_max = MAX_GOSUB;
+	m->for_stack = NULL;
+	m->for_sp = m->for_size = 0;
+	m->for_max = MAX_FOR;
+	m->has_retval = 0;
 	m->user = NULL;
+	m->budget = m->preempt = m->suspended = m->depth = 0;
+	m->own_script = NULL;
+	m->loaded = NULL;
+	m->async = m->pending = m->last_token = m->slice = 0;
+	m->stmt_start = NULL;
+	m->log = NULL;
+	m->nlog = m->log_size = m->log_pos = 0;
+	m->pool_slot = -1;
+	m->args = m->args_base = NULL;
+	memset(m->calls, 0, sizeof m->calls);
+	m->call_gen = 1;
+	m->var_epoch = 0;
+#if defined(__GNUC__)
+	m->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+#else
+	m->id = ++next_id;
+#endif
+	m->parent = NULL;
+	m->max_threads = 0;
+#ifdef WITH_THREADS
+	m->task = NULL;
+#endif
+#ifdef WITH_MMAP
+	m->frozen = NULL;
+#endif
 	m->active = 1;
+	m->short_circuit = 0;
 	m->start = NULL;
 	m->s = NULL;
 	strcpy(m->error_msg, "");
 	strcpy(m->error_text, "");
 	if(!add_stdfuns(m)) {
+		clear_table(&m->funcs, clear_func);
+		free(m->token);
 		free(m);
 		return NULL;
 	}
 	return m;
 }
 
-int mu_run(struct musl *m, const char *s) {
-	m->s = s;
-	m->start = s;
+/* Records the line where an error occured in m->error_text */
+static void error_line(struct musl *m) {
+	int i;
+	const char *l = m->s;
+	tok_reset(m);
+	if(!l) {
+		m->error_text[0] = '\0';
+		return;
+	}
+	while(l > m->start) {
+		if(l[-1] == '\n') {
+			break;
+		}
+		l--;
+	}
+	for(i = 0; i < MAX_ERROR_TEXT - 1 && l[i] != '\0' && !strchr("\r\n", l[i]); i++)
+		m->error_text[i] = l[i];
+	m->error_text[i] = '\0';
+}
+
+static int compile(struct musl *m, struct mu_script *sc) {
+	m->s = sc->text;
+	m->start = sc->text;
 	m->last = NULL;
 
+	m->args_base = m->args;
 	if(setjmp(m->on_error) != 0) {
-		int i;
-		const char *l = m->s;
-		/* Find the line where the error occured */
-		tok_reset(m);
-		while(l > s) {
-			if(l[-1] == '\n') {
-				break;
-			}
-			l--;
-		}
-		for(i = 0; i < MAX_ERROR_TEXT - 1 && l[i] != '\0' && !strchr("\r\n", l[i]); i++)
-			m->error_text[i] = l[i];
-		m->error_text[i] = '\0';
-		
+		error_line(m);
 		return 0;
 	}
 
-	scan_labels(m);
-	program(m);
-
-	/* Delete the labels, case another script is run */
-	clear_table(m->labels, NULL);
-	init_table(m->labels);
+	scan_labels(m, sc, NULL, -1);
 	return 1;
 }
 
-int mu_gosub(struct musl *m, const char *label) {
-	const char *save;
-	volatile struct var *v;
-	volatile jmp_buf save_jmp;
-	volatile int rv = 0, save_sp;
+static void free_select(struct select *sel) {
+	clear_table(&sel->strs, NULL);
+	clear_table(&sel->ints, NULL);
+	free(sel->jump);
+	free(sel);
+}
 
-	/* Find the label we're supposed to go to */
-	if(!(v = find_var(m->labels, label))) {
-		snprintf (m->error_msg, MAX_ERROR_TEXT-1, "GOSUB to undefined label");
-		return 0;
-	}
+static void init_script(struct mu_script *sc, const char *text) {
+	sc->text = text;
+	init_table(&sc->labels);
+	sc->selects = NULL;
+	sc->nselects = 0;
+	sc->selects_size = 0;
+	sc->multiline = 0;
+}
 
-	/* Setup the GOSUB stack */
-	if(m->gosub_sp >= MAX_GOSUB - 1) {
-		snprintf (m->error_msg, MAX_ERROR_TEXT-1, "GOSUB stack overflow");
-		return 0;
-	}
+static void clear_script(struct mu_script *sc) {
+	int i;
+	clear_table(&sc->labels, NULL);
+	/* Backwards, since a SELECT comes before its CASEs */
+	for(i = sc->nselects - 1; i >= 0; i--)
+		if(sc->selects[i].pos == sc->selects[i].sel->pos)
+			free_select(sc->selects[i].sel);
+	free(sc->selects);
+	sc->selects = NULL;
+	sc->nselects = 0;
+	sc->selects_size = 0;
+}
 
-	/* Set the location in the program */
-	save = m->s; /* Save current location */
-	m->s = v->v.c; /* Set the new location */
+struct mu_script *mu_compile(struct musl *m, const char *text) {
+	struct mu_script *sc = malloc(sizeof *sc);
+	if(!sc) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return NULL;
+	}
+	init_script(sc, text);
+	if(!compile(m, sc)) {
+		mu_free_script(sc);
+		return NULL;
+	}
+	return sc;
+}
+
+void mu_free_script(struct mu_script *sc) {
+	if(!sc) return;
+	clear_script(sc);
+	free(sc);
+}
+
+/* Discards the script kept by mu_load() */
+static void free_loaded(struct musl *m) {
+	if(!m->loaded) return;
+	free((char *)m->loaded->text);
+	mu_free_script(m->loaded);
+	m->loaded = NULL;
+}
+
+/* Detaches the interpreter from the script it was executing */
+static void end_script(struct musl *m) {
+	/* The frames' locals refer to the script */
+	pop_frames(m, 0);
+	m->script = &no_script;
+	m->suspended = 0;
+	m->pending = 0;
+	clear_log(m);
+	mu_free_script(m->own_script);
+	m->own_script = NULL;
+}
+
+/* Runs m->script from m->s for n statements, or until the end if n <= 0 */
+static int execute(struct musl *m, int n) {
+	m->preempt = n > 0;
+	m->budget = n;
+	m->slice = n;
+	m->suspended = 0;
+	m->depth = 0;
+	/* An error in a statement that wasn't executed leaves it cleared */
+	m->active = 1;
+
+	m->args_base = m->args;
+	if(setjmp(m->on_error) != 0) {
+		error_line(m);
+		end_script(m);
+		return 0;
+	}
+
+	program(m);
+	if(m->pending)
+		return MU_PENDING;
+	if(m->suspended)
+		return MU_SUSPENDED;
+	end_script(m);
+	return 1;
+}
+
+int mu_exec_budget(struct musl *m, const struct mu_script *sc, int n) {
+	if(m->suspended)
+		end_script(m);
+	m->script = sc;
+	m->s = sc->text;
+	m->start = sc->text;
 	m->last = NULL;
-	save_sp = m->gosub_sp;
+	new_call_gen(m);
+	return execute(m, n);
+}
+
+int mu_exec(struct musl *m, const struct mu_script *sc) {
+	return mu_exec_budget(m, sc, 0);
+}
+
+int mu_run_budget(struct musl *m, const char *text, int n) {
+	struct mu_script *sc;
+	int rv;
+	if(m->suspended)
+		end_script(m);
+	if(!(sc = mu_compile(m, text)))
+		return 0;
+	if((rv = mu_exec_budget(m, sc, n)) == MU_SUSPENDED || rv == MU_PENDING)
+		m->own_script = sc;
+	else
+		mu_free_script(sc);
+	return rv;
+}
+
+int mu_resume(struct musl *m, int n) {
+	if(!m->suspended) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Script is not suspended");
+		return 0;
+	}
+	if(m->pending) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Script is waiting for an asynchronous call");
+		return 0;
+	}
+	return execute(m, n);
+}
+
+int mu_suspend(struct musl *m) {
+	if(!m->async || m->depth != 1 || m->pending) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Asynchronous call not allowed here");
+		return 0;
+	}
+	if(++m->last_token <= 0)
+		m->last_token = 1;
+	m->pending = m->last_token;
+	return m->pending;
+}
+
+/* Logs the result of the pending call so that the script can continue */
+static int finish_call(struct musl *m, struct mu_par value) {
+	if(!log_call(m, value)) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	m->log_pos = 0;
+	m->pending = 0;
+	return 1;
+}
+
+#ifdef WITH_THREADS
+static int sched_complete(struct mu_task *t, struct mu_par value);
+#endif
+
+int mu_complete(struct musl *m, int token, struct mu_par value) {
+	if(!m->pending || token != m->pending) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "No pending asynchronous call %d", token);
+		return 0;
+	}
+#ifdef WITH_THREADS
+	if(m->task)
+		return sched_complete(m->task, value);
+#endif
+	if(!finish_call(m, value))
+		return 0;
+	return execute(m, m->slice);
+}
+
+int mu_run(struct musl *m, const char *s) {
+	struct mu_script sc;
+	int rv;
+
+	/* A script with asynchronous calls keeps its labels */
+	if(m->async)
+		return mu_run_budget(m, s, 0);
+
+	init_script(&sc, s);
+	if((rv = compile(m, &sc)) != 0)
+		rv = mu_exec(m, &sc);
+
+	/* Delete the labels, case another script is run */
+	clear_script(&sc);
+	return rv;
+}
+
+int mu_gosub(struct musl *m, const char *label) {
+	const char *save;
+	volatile struct var *v;
+	jmp_buf save_jmp;
+	struct args *volatile save_base;
+	volatile int rv = 0, save_sp, save_depth;
+
+	/* Find the label we're supposed to go to */
+	if(!(v = find_var(&m->script->labels, label))) {
+		snprintf (m->error_msg, MAX_ERROR_TEXT-1, "GOSUB to undefined label");
+		return 0;
+	}
 
 	/* Push null onto the stack; Special case to show that
 	 * the script needs to return to the C domain
 	 */
-	m->gosub_stack[m->gosub_sp++] = NULL;
+	save_sp = m->gosub_sp;
+	save_depth = m->depth;
+	if(!push_gosub(m, NULL))
+		return 0;
+
+	/* Set the location in the program */
+	save = m->s; /* Save current location */
+	m->s = v->v.c; /* Set the new location */
+	m->last = NULL;
 
 	/* Save the old error handler and set the new one */
 	memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
+	save_base = m->args_base;
+	m->args_base = m->args;
 
 	if(setjmp(m->on_error) == 0) {
 		/* Run the subroutine */
@@ -1173,560 +2573,3754 @@ int mu_gosub(struct musl *m, const char *label) {
 
 	/* Restore everything */
 	memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
+	m->args_base = save_base;
 	m->s = save;
 	m->last = NULL;
-	m->gosub_sp = save_sp;
+	m->depth = save_depth;
+	pop_frames(m, save_sp);
 
 	/* Return success */
 	return rv;
 }
 
-void mu_halt(struct musl *m) {
-	m->s = NULL;
-	m->last = NULL;
+/* Copies a record's fields into their variables for mu_gosub_batch() */
+static void bind_fields(struct musl *m, struct var **vars, const struct mu_field *fields,
+		int nfields, const char *rec) {
+	int i;
+	for(i = 0; i < nfields; i++) {
+		if(fields[i].type == mu_int) {
+			int num;
+			memcpy(&num, rec + fields[i].offset, sizeof num);
+			set_var_int(vars[i], num);
+		} else {
+			const char *s;
+			memcpy(&s, rec + fields[i].offset, sizeof s);
+			if(!set_var_str(vars[i], s ? s : ""))
+				mu_throw(m, "Out of memory");
+		}
+	}
 }
 
-/*
- * Cleanup
- */
-static void clear_var(struct var *v) {
-	if(v->type == mu_str)
-		free(v->v.s);
-}
+int mu_gosub_batch(struct musl *m, const char *label, void *records, size_t size, int n,
+		const struct mu_field *fields, int nfields, mu_batch_func done, void *data) {
+	const char *save, *start;
+	struct var *v, **vars;
+	jmp_buf save_jmp;
+	struct args *volatile save_base;
+	volatile int rv = 0, i;
+	int save_sp, save_depth;
 
-void mu_cleanup(struct musl *m) {
-	clear_table(m->vars, clear_var);
-	clear_table(m->funcs, NULL);
-	clear_table(m->labels, NULL);
-	free(m);
-}
+	if(!(v = find_var(&m->script->labels, label))) {
+		snprintf (m->error_msg, MAX_ERROR_TEXT-1, "GOSUB to undefined label");
+		return 0;
+	}
+	start = v->v.c;
 
-/*
- * Accessor functions
- */
-int mu_set_int(struct musl *m, const char *name, int num) {
-	struct var *v = find_var(m->vars, name);
+	/* Look up (or create) the variables once for the whole batch */
+	if(!(vars = malloc((nfields > 0 ? nfields : 1) * sizeof *vars))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	for(i = 0; i < nfields; i++) {
+		if(!(vars[i] = make_global(m, fields[i].name))) {
+			snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+			free(vars);
+			return 0;
+		}
+	}
 
-	if(!v) {
-		if(!(v = new_var(name))) return 0;
-		put_var(m->vars, v);
-	} else if(v->type == mu_str) {
-			free(v->v.s);
+	save = m->s;
+	save_sp = m->gosub_sp;
+	save_depth = m->depth;
+
+	/* One error handler for all the records */
+	memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
+	save_base = m->args_base;
+	m->args_base = m->args;
+
+	if(setjmp(m->on_error) == 0) {
+		for(i = 0; i < n; i++) {
+			char *rec = (char *)records + (size_t)i * size;
+			bind_fields(m, vars, fields, nfields, rec);
+			if(!push_gosub(m, NULL))
+				mu_throw(m, NULL);
+			m->s = start;
+			m->last = NULL;
+			program(m);
+			pop_frames(m, save_sp);
+			m->depth = save_depth;
+			if(done && !done(m, i, rec, data))
+				break;
+		}
+		rv = 1;
 	}
-	v->type = mu_int;
-	v->v.i = num;
-	return 1;
+
+	memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
+	m->args_base = save_base;
+	m->s = save;
+	m->last = NULL;
+	m->depth = save_depth;
+	pop_frames(m, save_sp);
+	free(vars);
+	return rv;
 }
 
-int mu_get_int(struct musl *m, const char *name) {
-	struct var *v = find_var(m->vars, name);
-	if(!v)
+int mu_load(struct musl *m, const char *text) {
+	struct mu_script *sc;
+	char *copy;
+
+	if(m->script != &no_script && !m->suspended) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "mu_load() called from a running script");
 		return 0;
-	else if(v->type == mu_str)
-		return atoi(v->v.s);
-	return v->v.i;
+	}
+	if(m->suspended)
+		end_script(m);
+	if(!(copy = strdup(text))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	if(!(sc = mu_compile(m, copy))) {
+		/* mu_error_text() still has the line, but not mu_cur_line() */
+		free(copy);
+		m->start = m->s = NULL;
+		return 0;
+	}
+	free_loaded(m);
+	m->loaded = sc;
+	return mu_exec(m, sc);
 }
 
-int mu_set_str(struct musl *m, const char *name, const char *val) {
-	struct var *v = find_var(m->vars, name);
-	if(!v) {
-		if(!(v = new_var(name))) return 0;
-		put_var(m->vars, v);
-	} else if(v->type == mu_str) {
-		free(v->v.s);
+int mu_call(struct musl *m, const char *label) {
+	const struct mu_script *save_script;
+	const char *save, *save_start;
+	struct var *v;
+	jmp_buf save_jmp;
+	struct args *volatile save_base;
+	volatile int rv = 0;
+	int save_sp, save_depth, save_active, save_pending;
+
+	if(!m->loaded) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "No script loaded");
+		return 0;
+	}
+	if(!(v = find_var(&m->loaded->labels, label))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "GOSUB to undefined label");
+		return 0;
 	}
-	v->type = mu_str;
-	v->v.s = strdup(val);
 
-	return v->v.s != NULL;
-}
+	save_script = m->script;
+	save_start = m->start;
+	save = m->s;
+	save_sp = m->gosub_sp;
+	save_depth = m->depth;
+	save_active = m->active;
+	save_pending = m->pending;
+	if(!push_gosub(m, NULL))
+		return 0;
 
-int mu_has_var(struct musl *m, const char *name) {
-	return !!find_var(m->vars, name);
-}
+	m->script = m->loaded;
+	m->start = m->loaded->text;
+	m->s = v->v.c;
+	m->last = NULL;
+	m->active = 1;
+	/* A script that is waiting for an asynchronous call keeps waiting,
+	 * but the subroutine's own calls must be executed */
+	m->pending = 0;
+	/* The subroutine runs nested, as if called through mu_gosub(), so
+	 * that it can not be suspended */
+	m->depth++;
 
-const char *mu_get_str(struct musl *m, const char *name) {
-	struct var *v = find_var(m->vars, name);
-	if(!v)
-		return NULL;
+	memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
+	save_base = m->args_base;
+	m->args_base = m->args;
 
-	if(v->type == mu_int) {
-		char *buffer = malloc(20);
-		if(!buffer) return NULL;
-		sprintf(buffer, "%d", v->v.i);
-		v->type = mu_str;
-		v->v.s = buffer;
+	if(setjmp(m->on_error) == 0) {
+		program(m);
+		rv = 1;
+	} else if(save_script == &no_script) {
+		error_line(m);
 	}
 
-	return v->v.s;
+	memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
+	m->args_base = save_base;
+	m->script = save_script;
+	/* Leave the position of an error for mu_cur_line() */
+	if(rv || save_script != &no_script) {
+		m->start = save_start;
+		m->s = save;
+	}
+	m->last = NULL;
+	m->depth = save_depth;
+	m->active = save_active;
+	m->pending = save_pending;
+	pop_frames(m, save_sp);
+	return rv;
 }
 
-void mu_set_data(struct musl *m, void *data) {
-	m->user = data;
+/* The lines from the start of a SELECT CASE to its END SELECT */
+static void select_lines(const struct mu_script *sc, const struct select *sel,
+		const char **from, const char **to) {
+	const char *a = sel->pos, *b = strchr(sel->end, '\n');
+	while(a > sc->text && a[-1] != '\n')
+		a--;
+	*from = a;
+	*to = b ? b + 1 : sel->end + strlen(sel->end);
 }
 
-void *mu_get_data(struct musl *m) {
-	return m->user;
+/* Moves pos from the text at from to the same place in the text at to */
+static const char *rebase(const char *pos, const char *from, const char *to) {
+	return to + (pos - from);
 }
 
-static int var_qcomp(const void*p,const void*q) {
-	return strcmp(*(const char**)p,*(const char**)q);
+static void rebase_select(struct select *sel, const char *from, const char *to) {
+	struct var *v;
+	unsigned int i;
+	int j;
+	sel->pos = rebase(sel->pos, from, to);
+	if(sel->other)
+		sel->other = rebase(sel->other, from, to);
+	sel->end = rebase(sel->end, from, to);
+	for(i = 0; i < sel->strs.size; i++)
+		for(v = sel->strs.b[i]; v; v = v->next)
+			v->v.c = rebase(v->v.c, from, to);
+	for(i = 0; i < sel->ints.size; i++)
+		for(v = sel->ints.b[i]; v; v = v->next)
+			v->v.c = rebase(v->v.c, from, to);
+	if(sel->jump)
+		for(j = 0; j <= sel->max - sel->min; j++)
+			if(sel->jump[j])
+				sel->jump[j] = rebase(sel->jump[j], from, to);
 }
 
-void mu_dump(struct musl *m, FILE *f) {
-	int i, n = 0, a = 16, len = 10;
-	
-	const char **keys = calloc(a, sizeof *keys);
-	for(i = 0; i < HASH_SIZE; i++) {		
-		struct var *v = m->vars[i];
-		while(v) {
-			keys[n++] = v->name;
-			if(strlen(v->name) > len) len = strlen(v->name);
-			if(n == a) {
-				a <<= 1;
-				keys = realloc(keys, a * sizeof * keys);
+/* Replaces the loaded script with copy, scanning all of it */
+static int reload_all(struct musl *m, char *copy) {
+	struct mu_script *sc;
+	if(!(sc = mu_compile(m, copy))) {
+		free(copy);
+		m->start = m->s = NULL;
+		return 0;
+	}
+	free_loaded(m);
+	m->loaded = sc;
+	new_call_gen(m);
+	return 1;
+}
+
+int mu_reload(struct musl *m, const char *text) {
+	struct mu_script *sc = m->loaded, tmp;
+	struct select_ref *refs = NULL;
+	const char *old, *a, *b, *na, *nb, *from, *to;
+	struct var *v, *o = NULL, *next, **vp;
+	size_t olen, nlen, pre, suf;
+	unsigned int j;
+	int i, i0, i1, n, ln = -1, changed;
+	char *copy;
+
+	if(m->script != &no_script && !m->suspended) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "mu_reload() called from a running script");
+		return 0;
+	}
+	if(m->suspended)
+		end_script(m);
+	if(!(copy = strdup(text))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	if(!sc || sc->multiline)
+		return reload_all(m, copy);
+
+	/* The lines that are the same at the start and end of both texts */
+	old = sc->text;
+	olen = strlen(old);
+	nlen = strlen(copy);
+	for(pre = 0; pre < olen && pre < nlen && old[pre] == copy[pre]; pre++);
+	if(pre == olen && pre == nlen) {
+		free(copy);
+		return 1;
+	}
+	while(pre > 0 && old[pre - 1] != '\n')
+		pre--;
+	for(suf = 0; suf < olen - pre && suf < nlen - pre
+		&& old[olen - suf - 1] == copy[nlen - suf - 1]; suf++);
+	while(suf > 0 && ((olen - suf > pre && old[olen - suf - 1] != '\n')
+		|| (nlen - suf > pre && copy[nlen - suf - 1] != '\n')))
+		suf--;
+	a = old + pre;
+	b = old + olen - suf;
+
+	/* A SELECT CASE that the change touches is scanned again as a whole */
+	do {
+		changed = 0;
+		for(i = 0; i < sc->nselects; i++) {
+			if(sc->selects[i].pos != sc->selects[i].sel->pos)
+				continue;
+			select_lines(sc, sc->selects[i].sel, &from, &to);
+			if(a < b ? from < b && to > a : from < a && to > a) {
+				if(from < a)
+					a = from, changed = 1;
+				if(to > b)
+					b = to, changed = 1;
+			}
+		}
+	} while(changed);
+	na = copy + (a - old);
+	nb = copy + nlen - (old + olen - b);
+
+	/* The numbered labels around the lines that are scanned */
+	for(j = 0; j < sc->labels.size; j++)
+		for(v = sc->labels.b[j]; v; v = v->next)
+			if(isdigit(v->name[0])) {
+				if(v->v.c < a && atoi(v->name) > ln)
+					ln = atoi(v->name);
+				else if(v->v.c >= b && (!o || atoi(v->name) < atoi(o->name)))
+					o = v;
 			}
-			v = v->next;
+
+	init_script(&tmp, copy);
+	m->start = copy;
+	m->s = na;
+	m->last = NULL;
+	m->args_base = m->args;
+	if(setjmp(m->on_error) != 0) {
+		error_line(m);
+		clear_script(&tmp);
+		free(copy);
+		m->start = m->s = NULL;
+		return 0;
+	}
+
+	if(na < nb) {
+		ln = scan_labels(m, &tmp, nb < copy + nlen ? nb : NULL, ln);
+		if(tmp.multiline) {
+			clear_script(&tmp);
+			return reload_all(m, copy);
 		}
 	}
-	qsort(keys, n, sizeof *keys, var_qcomp);
-	for(i = 0; i < n; i++) {
-		struct var *v = find_var(m->vars, keys[i]);
-		assert(v);
-		if(v->type == mu_int)
-			fprintf(f, "%-*s:\t%d\n", len+1, v->name, v->v.i);
-		else
-			fprintf(f, "%-*s:\t\"%s\"\n", len+1, v->name, v->v.s);
+	if(o && atoi(o->name) <= ln) {
+		m->s = rebase(o->v.c, b, nb);
+		mu_throw(m, "Label %s out of sequence", o->name);
 	}
-	
-	free(keys);
-}
 
-/*
- * External functions
- */
-int mu_add_func(struct musl *m, const char *name, mu_func fun) {
-	struct var *v = find_var(m->funcs, name);
-	if(!v) {
-		if(!(v = new_var(name))) return 0;
-		put_var(m->funcs, v);
+	for(i0 = 0; i0 < sc->nselects && sc->selects[i0].pos < a; i0++);
+	for(i1 = i0; i1 < sc->nselects && sc->selects[i1].pos < b; i1++);
+	n = i0 + tmp.nselects + sc->nselects - i1;
+	if(!reserve_table(&sc->labels, sc->labels.n + tmp.labels.n)
+		|| (n && !(refs = malloc(n * sizeof *refs))))
+		mu_throw(m, "Out of memory");
+
+	/* Nothing can fail from here on */
+	for(j = 0; j < sc->labels.size; j++)
+		for(vp = &sc->labels.b[j]; (v = *vp) != NULL;) {
+			if(v->v.c >= a && v->v.c < b) {
+				*vp = v->next;
+				sc->labels.n--;
+				free(v->name);
+				free(v);
+				continue;
+			}
+			v->v.c = v->v.c < a ? rebase(v->v.c, old, copy) : rebase(v->v.c, b, nb);
+			vp = &v->next;
+		}
+	for(j = 0; j < tmp.labels.size; j++)
+		for(v = tmp.labels.b[j]; v; v = next) {
+			next = v->next;
+			put_var(&sc->labels, v);
+		}
+	free(tmp.labels.b);
+	/* As in a full scan, the first label in the text with a name has
+	 * to be at the front of its chain */
+	for(j = 0; j < sc->labels.size; j++)
+		for(v = sc->labels.b[j]; v; v = v->next)
+			for(o = v->next; o; o = o->next)
+				if(o->hash == v->hash && o->v.c < v->v.c && !strcmp(o->name, v->name)) {
+					const char *c = o->v.c;
+					o->v.c = v->v.c;
+					v->v.c = c;
+				}
+
+	for(i = i1 - 1; i >= i0; i--)
+		if(sc->selects[i].pos == sc->selects[i].sel->pos)
+			free_select(sc->selects[i].sel);
+	for(i = 0; i < i0; i++) {
+		refs[i] = sc->selects[i];
+		if(refs[i].pos == refs[i].sel->pos)
+			rebase_select(refs[i].sel, old, copy);
+		refs[i].pos = rebase(refs[i].pos, old, copy);
 	}
-	v->v.fun = fun;
+	for(i = 0; i < tmp.nselects; i++)
+		refs[i0 + i] = tmp.selects[i];
+	for(i = i1; i < sc->nselects; i++) {
+		struct select_ref *r = &refs[i0 + tmp.nselects + i - i1];
+		*r = sc->selects[i];
+		if(r->pos == r->sel->pos)
+			rebase_select(r->sel, b, nb);
+		r->pos = rebase(r->pos, b, nb);
+	}
+	free(tmp.selects);
+	free(sc->selects);
+	sc->selects = refs;
+	sc->nselects = sc->selects_size = n;
+
+	free((char *)old);
+	sc->text = copy;
+	m->start = m->s = NULL;
+	new_call_gen(m);
 	return 1;
 }
 
-int mu_par_int(struct musl *m, int n, int argc, struct mu_par argv[]) {
-	if(n >= argc)
-		mu_throw(m, "Too few parameters to function");
-	return par_as_int(&argv[n]);
-}
-
-const char *mu_par_str(struct musl *m, int n, int argc, struct mu_par argv[]) {
-	if(n >= argc)
-		mu_throw(m, "Too few parameters to function");
-	return par_as_str(&argv[n]);
-}
 
-int mu_valid_id(const char *id) {
-	if(!isalpha(id[0]))
-		return 0;
-	while(id[0])
-		if(!isalnum(id[0]) && !strchr("_$", id[0])) 
-			return 0;
-		else
-			id++;
-	return 1;
+void mu_halt(struct musl *m) {
+	m->s = NULL;
+	m->last = NULL;
 }
 
 /*
- * Standard functions
+ * Compiled expressions
+ *
+ * mu_compile_expr() parses an expression with the same grammar as
+ * expr(), but emits code for a small stack machine instead of
+ * evaluating it, so that mu_eval() doesn't need to tokenize it again.
+ * The names of variables and functions are looked up on the first
+ * evaluation and remembered until the interpreter's variables are
+ * deleted or its functions change.
+ *
+ * The compiler tracks the type of every operand where it is known
+ * (numbers, strings, and the results of operators). Operands of the
+ * arithmetic and logical operators are converted to integers where
+ * they are produced, so that those operators work on plain integers.
+ * A variable that is used as a number is loaded with OP_VARI, which
+ * reads a string variable with atoi() rather than copying it first.
  */
 
-/*2 Functions
- *# These functions are available to {*Musl*} scripts.
- *3 Built-In Functions
- *# The Following built-in functions are available to all scripts.
- *#
- * When implementing your own functions, keep in mind that functions
- * that return strings should allocate those strings on the heap,
- * because Musl will call free() on them at a later stage.
- */
+enum {
+	OP_INT,		/* push a */
+	OP_STR,		/* push string syms[a] */
+	OP_VAR,		/* push variable syms[a] */
+	OP_VARI,	/* push variable syms[a] as an integer */
+	OP_ARR,		/* replace the key on top with element syms[a][key] */
+	OP_ARRI,	/* like OP_ARR, as an integer */
+	OP_CALL,	/* call function syms[a] with the top b values */
+	OP_TOINT,	/* convert the top to an integer */
+	/* The operands of these are integers */
+	OP_NEG, OP_NOT,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+	OP_ORJ,		/* short circuit: jump to a if the top is true */
+	OP_OR,
+	OP_ANDJ,	/* short circuit: jump to a if the top is false */
+	OP_AND,
+	OP_CMPI,	/* compare integers with comparison b */
+	/* The operands of these are strings */
+	OP_CAT,
+	OP_CMPS,	/* compare strings with comparison b */
+	/* Compare with b, by the type of the left hand side */
+	OP_CMP
+};
 
-/*@ ##INT(x$)
- *# Converts the string {{x$}} to a number. */
-static struct mu_par m_int(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {mu_par_int(m, 0, argc, argv)}};
-	return rv;
+/* Comparisons of OP_CMP* */
+enum {CMP_EQ, CMP_NE, CMP_LT, CMP_GT};
+
+/* Types of compiled operands */
+enum {TY_ANY, TY_INT, TY_STR};
+
+struct expr_op {
+	int code, a, b;
+};
+
+/* A string constant, or the name of a variable or function
+ * with the node it was found at */
+struct expr_sym {
+	char *s;
+	size_t len;
+	struct var *v;
+};
+
+struct mu_expr {
+	struct expr_op *code;
+	int ncode, acode;
+	struct expr_sym *syms;
+	int nsyms, asyms;
+
+	/* Evaluation stack; top is kept up to date so that the
+	 * values on it can be freed after an error */
+	struct mu_par *stack, *top;
+	int depth, max_depth;
+
+	/* What the symbols were looked up in; 0 if they weren't yet */
+	unsigned long id;
+	unsigned int var_epoch, call_gen;
+};
+
+static void free_expr_stack(struct mu_expr *e) {
+	struct mu_par *p;
+	for(p = e->stack; p < e->top; p++)
+		if(p->type == mu_str)
+			free(p->v.s);
+	e->top = e->stack;
 }
 
-/*@ ##STR$(x)
- *# Converts the number {{x}} to a string. */
-static struct mu_par m_str(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	rv.type = mu_str;
-	rv.v.s = strdup(mu_par_str(m, 0, argc, argv));
-	return rv;
+void mu_free_expr(struct mu_expr *e) {
+	int i;
+	if(!e) return;
+	free_expr_stack(e);
+	for(i = 0; i < e->nsyms; i++)
+		free(e->syms[i].s);
+	free(e->syms);
+	free(e->code);
+	free(e->stack);
+	free(e);
 }
 
-/*@ ##ASC(a)
- *# Returns the ASCII value of {{a}} 
- *X ASC('A') = 65 
- */
-static struct mu_par m_asc(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	const char *c = mu_par_str(m, 0, argc, argv);
-	rv.v.i = c[0];
-	return rv;
+/* Appends an instruction that changes the stack depth by delta */
+static int emit(struct musl *m, struct mu_expr *e, int code, int a, int b, int delta) {
+	if(e->ncode == e->acode) {
+		int size = e->acode ? e->acode << 1 : 16;
+		struct expr_op *ops = realloc(e->code, size * sizeof *ops);
+		if(!ops) mu_throw(m, "Out of memory");
+		e->code = ops;
+		e->acode = size;
+	}
+	e->code[e->ncode].code = code;
+	e->code[e->ncode].a = a;
+	e->code[e->ncode].b = b;
+	e->depth += delta;
+	if(e->depth > e->max_depth)
+		e->max_depth = e->depth;
+	return e->ncode++;
 }
 
-/*@ ##CHR(v)
- *# Returns the character associated with the ASCII value {{a}} 
- *X CHR(66) = 'B' 
- */
-static struct mu_par m_chr(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_str, {0}};
-	int a = mu_par_int(m, 0, argc, argv);
-	rv.v.s = strdup(" ");
-	rv.v.s[0] = a;	
-	return rv;
+static int add_sym(struct musl *m, struct mu_expr *e, const char *s, size_t len) {
+	struct expr_sym *sym;
+	if(e->nsyms == e->asyms) {
+		int size = e->asyms ? e->asyms << 1 : 8;
+		struct expr_sym *syms = realloc(e->syms, size * sizeof *syms);
+		if(!syms) mu_throw(m, "Out of memory");
+		e->syms = syms;
+		e->asyms = size;
+	}
+	sym = &e->syms[e->nsyms];
+	sym->s = mu_alloc(m, len + 1);
+	memcpy(sym->s, s, len);
+	sym->s[len] = '\0';
+	sym->len = len;
+	sym->v = NULL;
+	return e->nsyms++;
 }
 
-/*@ ##LEN(x$)
- *# Returns the length of string {{x$}} */
-static struct mu_par m_len(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {strlen(mu_par_str(m, 0, argc, argv))}};
-	return rv;
+/* Makes the operand that was just compiled, of type *ty, an integer */
+static void to_int(struct musl *m, struct mu_expr *e, int *ty) {
+	struct expr_op *op = &e->code[e->ncode - 1];
+	if(*ty == TY_INT)
+		return;
+	if(op->code == OP_VAR)
+		op->code = OP_VARI;
+	else if(op->code == OP_ARR)
+		op->code = OP_ARRI;
+	else if(op->code == OP_STR) {
+		op->code = OP_INT;
+		op->a = atoi(e->syms[op->a].s);
+	} else
+		emit(m, e, OP_TOINT, 0, 0, 0);
+	*ty = TY_INT;
 }
 
-/*@ ##LEFT$(s$, n)
- *# Returns the {{n}} leftmost characters in {{s$}}
- */
-static struct mu_par m_left(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	const char *s = mu_par_str(m, 0, argc, argv);
-	int len = mu_par_int(m, 1, argc, argv);
+/* Replaces two integer constants with their sum, difference or product */
+static int fold(struct mu_expr *e, int code) {
+	struct expr_op *a = &e->code[e->ncode - 2], *b = a + 1;
+	if(e->ncode < 2 || a->code != OP_INT || b->code != OP_INT)
+		return 0;
+	if(code == OP_ADD)
+		a->a = (int)((unsigned)a->a + (unsigned)b->a);
+	else if(code == OP_SUB)
+		a->a = (int)((unsigned)a->a - (unsigned)b->a);
+	else if(code == OP_MUL)
+		a->a = (int)((unsigned)a->a * (unsigned)b->a);
+	else
+		return 0;
+	e->ncode--;
+	e->depth--;
+	return 1;
+}
 
-	if(len < 0)
-		mu_throw(m, "Invalid parameters to LEFT$()");
+static int c_expr(struct musl *m, struct mu_expr *e);
 
-	if(len > (int)strlen(s))
-		len = strlen(s);
+static int c_atom(struct musl *m, struct mu_expr *e) {
+	int t = tokenize(m), sym, ty;
+	if(t == '(') {
+		ty = c_expr(m, e);
+		expect(m, ')', NULL);
+		return ty;
+	} else if(t == T_IDENT) {
+		sym = add_sym(m, e, m->token, strlen(m->token));
+		if((t = tokenize(m)) == '(') {
+			struct var *v;
+			int argc = 0;
+			if(tokenize(m) != ')') {
+				tok_reset(m);
+				do {
+					c_expr(m, e);
+					argc++;
+				} while(tokenize(m) == ',');
+				tok_reset(m);
+				expect(m, ')', NULL);
+			}
+			/* Check the arity now if the function is known. Its
+			 * return type isn't used, since it can be replaced. */
+			if((v = get_func(m, e->syms[sym].s)) && v->type == mu_str && v->v.fun
+					&& !v->v.sig->lenient)
+				check_arity(m, e->syms[sym].s, v->v.sig, argc);
+			emit(m, e, OP_CALL, sym, argc, 1 - argc);
+		} else if(t == '[') {
+			c_expr(m, e);
+			expect(m, ']', NULL);
+			emit(m, e, OP_ARR, sym, 0, 0);
+		} else {
+			tok_reset(m);
+			emit(m, e, OP_VAR, sym, 0, 1);
+		}
+		return TY_ANY;
+	} else if(t == T_NUMBER) {
+		emit(m, e, OP_INT, atoi(m->token), 0, 1);
+		return TY_INT;
+	} else if(t == T_STRING) {
+		emit(m, e, OP_STR, add_sym(m, e, m->str, m->str_len), 0, 1);
+		return TY_STR;
+	} else if(t == '@') {
+		expect(m, T_IDENT, "identifier");
+		emit(m, e, OP_STR, add_sym(m, e, m->token, strlen(m->token)), 0, 1);
+		return TY_STR;
+	} else if(t == T_GOSUB) {
+		mu_throw(m, "GOSUB can't be used in a compiled expression");
+	}
+	mu_throw(m, "Value expected");
+	return TY_ANY;
+}
 
-	rv.type = mu_str;
-	rv.v.s = mu_alloc(m, len + 1);
-	strncpy(rv.v.s, s, len);
-	rv.v.s[len] = '\0';
-	return rv;
+static int c_uexpr(struct musl *m, struct mu_expr *e) {
+	int t = tokenize(m), ty;
+	if(t == '-') {
+		ty = c_atom(m, e);
+		to_int(m, e, &ty);
+		if(e->code[e->ncode - 1].code == OP_INT)
+			e->code[e->ncode - 1].a = (int)-(unsigned)e->code[e->ncode - 1].a;
+		else
+			emit(m, e, OP_NEG, 0, 0, 0);
+		return TY_INT;
+	}
+	if(t != '+')
+		tok_reset(m);
+	return c_atom(m, e);
 }
 
-/*@ ##RIGHT$(s$, n)
- *# Returns the {{n}} rightmost characters in {{s$}} */
-static struct mu_par m_right(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	const char *s = mu_par_str(m, 0, argc, argv);
-	int len = mu_par_int(m, 1, argc, argv);
+static int c_mul(struct musl *m, struct mu_expr *e) {
+	int t, ty = c_uexpr(m, e), rty;
+	while((t = tokenize(m)) == '*' || t == '/' || t == '%') {
+		int code = t == '*' ? OP_MUL : t == '/' ? OP_DIV : OP_MOD;
+		to_int(m, e, &ty);
+		rty = c_uexpr(m, e);
+		to_int(m, e, &rty);
+		if(!fold(e, code))
+			emit(m, e, code, 0, 0, -1);
+	}
+	tok_reset(m);
+	return ty;
+}
 
-	if(len < 0)
-		mu_throw(m, "Invalid parameters to RIGHT$()");
+static int c_add(struct musl *m, struct mu_expr *e) {
+	int t, ty = c_mul(m, e), rty;
+	while((t = tokenize(m)) == '+' || t == '-') {
+		int code = t == '+' ? OP_ADD : OP_SUB;
+		to_int(m, e, &ty);
+		rty = c_mul(m, e);
+		to_int(m, e, &rty);
+		if(!fold(e, code))
+			emit(m, e, code, 0, 0, -1);
+	}
+	tok_reset(m);
+	return ty;
+}
 
-	if(len > (int)strlen(s))
-		len = strlen(s);
+static int c_cat(struct musl *m, struct mu_expr *e) {
+	int ty = c_add(m, e);
+	while(tokenize(m) == '&') {
+		c_add(m, e);
+		emit(m, e, OP_CAT, 0, 0, -1);
+		ty = TY_STR;
+	}
+	tok_reset(m);
+	return ty;
+}
 
-	s = s + strlen(s) - len;
+static int c_comp(struct musl *m, struct mu_expr *e) {
+	int t, ty = c_cat(m, e), rty;
+	t = tokenize(m);
+	if(t == '<') {
+		if(tokenize(m) == '>')
+			t = T_NE;
+		else
+			tok_reset(m);
+	}
+	if(t == '=' || t == '<' || t == '>' || t == T_NE) {
+		int cmp = t == '=' ? CMP_EQ : t == '<' ? CMP_LT : t == '>' ? CMP_GT : CMP_NE;
+		rty = c_cat(m, e);
+		/* The left hand side decides how they're compared */
+		if(ty == TY_INT) {
+			to_int(m, e, &rty);
+			emit(m, e, OP_CMPI, 0, cmp, -1);
+		} else if(ty == TY_STR) {
+			emit(m, e, OP_CMPS, 0, cmp, -1);
+		} else {
+			emit(m, e, OP_CMP, 0, cmp, -1);
+		}
+		return TY_INT;
+	}
+	tok_reset(m);
+	return ty;
+}
 
-	rv.type = mu_str;
-	rv.v.s = strdup(s);
-	if(!rv.v.s)
-		mu_throw(m, "Out of memory");
+static int c_not(struct musl *m, struct mu_expr *e) {
+	int ty;
+	if(tokenize(m) == T_NOT) {
+		ty = c_comp(m, e);
+		to_int(m, e, &ty);
+		emit(m, e, OP_NOT, 0, 0, 0);
+		return TY_INT;
+	}
+	tok_reset(m);
+	return c_comp(m, e);
+}
 
-	return rv;
+/* Compiles operands separated by op, with jumps past the rest of
+ * the chain for short circuit evaluation */
+static int c_chain(struct musl *m, struct mu_expr *e, int op, int jump, int code,
+		int (*operand)(struct musl *, struct mu_expr *)) {
+	int first, i, ty = operand(m, e);
+	if(tokenize(m) != op) {
+		tok_reset(m);
+		return ty;
+	}
+	to_int(m, e, &ty);
+	first = e->ncode;
+	do {
+		emit(m, e, jump, 0, 0, 0);
+		ty = operand(m, e);
+		to_int(m, e, &ty);
+		emit(m, e, code, 0, 0, -1);
+	} while(tokenize(m) == op);
+	tok_reset(m);
+	for(i = first; i < e->ncode; i++)
+		if(e->code[i].code == jump && e->code[i].a == 0)
+			e->code[i].a = e->ncode;
+	return TY_INT;
 }
 
-/*@ ##MID$(s$, n, m)
- *# Returns the all the characters in {{s$}} between {{n}} and {{m}} inclusive.\n
- *# The string is indexed from 1, that is
- *#     {{MID$("Hello World From Musl", 7, 11)}}
- *# will return {{"World"}}
- */
-static struct mu_par m_mid(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	const char *s = mu_par_str(m, 0, argc, argv);
-	int p = mu_par_int(m, 1, argc, argv) - 1;
-	int q = mu_par_int(m, 2, argc, argv);
-	int len = q - p;
+static int c_and(struct musl *m, struct mu_expr *e) {
+	return c_chain(m, e, T_AND, OP_ANDJ, OP_AND, c_not);
+}
 
-	if(q < p || p < 0)
-		mu_throw(m, "Invalid parameters to MID$()");
+static int c_expr(struct musl *m, struct mu_expr *e) {
+	return c_chain(m, e, T_OR, OP_ORJ, OP_OR, c_and);
+}
 
-	if(len > (int)strlen(s + p))
-		len = strlen(s + p);
+struct mu_expr *mu_compile_expr(struct musl *m, const char *text) {
+	struct mu_expr *volatile e;
+	const char *save, *save_start;
+	jmp_buf save_jmp;
+	struct args *volatile save_base;
+	volatile int ok = 0;
 
-	rv.type = mu_str;
-	rv.v.s = mu_alloc(m, len + 1);
-	strncpy(rv.v.s, s + p, len);
-	rv.v.s[len] = '\0';
-	return rv;
+	if(!(e = calloc(1, sizeof *e))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return NULL;
+	}
+
+	save = m->s;
+	save_start = m->start;
+	m->s = text;
+	m->start = text;
+	m->last = NULL;
+
+	memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
+	save_base = m->args_base;
+	m->args_base = m->args;
+
+	if(setjmp(m->on_error) == 0) {
+		c_expr(m, e);
+		if(tokenize(m) != T_END)
+			mu_throw(m, "Unexpected '%s' after the expression", m->token);
+		if(!(e->stack = malloc((e->max_depth + 1) * sizeof *e->stack)))
+			mu_throw(m, "Out of memory");
+		e->top = e->stack;
+		ok = 1;
+	} else {
+		error_line(m);
+	}
+
+	memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
+	m->args_base = save_base;
+	m->s = save;
+	m->start = save_start;
+	m->last = NULL;
+
+	if(!ok) {
+		mu_free_expr(e);
+		return NULL;
+	}
+	return e;
 }
 
-/*@ ##UCASE$(x$)
- *# Converts the string {{x$}} to uppercase. */
-static struct mu_par m_ucase(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	char *c;
-	rv.type = mu_str;
-	rv.v.s = strdup(mu_par_str(m, 0, argc, argv));
-	if(!rv.v.s) mu_throw(m, "Out of memory");
-	for(c=rv.v.s;*c;c++)
-		*c = toupper(*c);
-	return rv;
+static struct var *expr_var(const struct musl *m, struct expr_sym *sym) {
+	if(!sym->v)
+		sym->v = get_var(m, sym->s);
+	return sym->v;
 }
 
-/*@ ##LCASE$(x$)
- *# Converts the string {{x$}} to lowercase. */
-static struct mu_par m_lcase(struct musl *m, int argc, struct mu_par argv[]) {
+static struct mu_par expr_call(struct musl *m, struct expr_sym *sym, struct mu_par *argv, int argc) {
 	struct mu_par rv;
-	char *c;
-	rv.type = mu_str;
-	rv.v.s = strdup(mu_par_str(m, 0, argc, argv));
-	if(!rv.v.s) mu_throw(m, "Out of memory");
-	for(c=rv.v.s;*c;c++)
-		*c = tolower(*c);
+	struct args a;
+	struct var *v;
+	int i;
+
+	if(!sym->v)
+		sym->v = get_func(m, sym->s);
+	if(!(v = sym->v) || !v->v.fun)
+		mu_throw(m, "Call to undefined function %s()", sym->s);
+	if(v->type == mu_str)
+		check_arity(m, sym->s, v->v.sig, argc);
+
+	/* Move the arguments from the stack to the list */
+	begin_args(m, &a);
+	for(i = 0; i < argc; i++) {
+		struct mu_par p = argv[i];
+		argv[i].type = mu_int;
+		add_arg(m, &a, p);
+	}
+	if(v->type == mu_str)
+		rv = call_sig(m, v->v.sig, &a);
+	else
+		rv = v->v.fun(m, a.argc, a.argv);
+	end_args(m, &a);
 	return rv;
 }
 
-/*@ ##TRIM$(x$)
- *# Removes leading and trailing whitespace from string {{x$}}. */
-static struct mu_par m_trim(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv;
-	char *c;
-	const char *s = mu_par_str(m, 0, argc, argv);
+/* Pushes a copy of a variable's value, or "" if it doesn't exist */
+static void expr_value(struct musl *m, const struct var *v, struct mu_par *p) {
+	if(v && v->type == mu_int) {
+		p->type = mu_int;
+		p->v.i = v->v.i;
+	} else {
+		const char *s = v ? v->v.s : "";
+		size_t len = strlen(s);
+		p->type = mu_int;
+		p->v.s = mu_alloc(m, len + 1);
+		memcpy(p->v.s, s, len + 1);
+		p->type = mu_str;
+	}
+}
 
-	while(isspace(s[0])) s++;
+/* Gets an array element's node, consuming the key on top of the stack */
+static struct var *expr_elem(struct musl *m, const char *aname, struct mu_par *key) {
+	char nbuf[TOK_SIZE], *name;
+	struct var *v;
+	if(!par_as_str(key))
+		mu_throw(m, "Out of memory");
+	name = arr_name(m, nbuf, sizeof nbuf, aname, key->v.s);
+	free(key->v.s);
+	key->type = mu_int;
+	v = get_var(m, name);
+	if(name != nbuf)
+		free(name);
+	return v;
+}
 
-	rv.type = mu_str;
-	rv.v.s = strdup(s);
-	if(!rv.v.s) mu_throw(m, "Out of memory");
+static int compare(int cmp, int r) {
+	switch(cmp) {
+		case CMP_EQ: return !r;
+		case CMP_NE: return !!r;
+		case CMP_LT: return r < 0;
+		default: return r > 0;
+	}
+}
 
-	for(c=rv.v.s + strlen(rv.v.s) - 1;c > rv.v.s; c--)
-		if(!isspace(*c)) {
-			c[1] = '\0';
+static void run_expr(struct musl *m, struct mu_expr *e) {
+	const struct expr_op *op, *end = e->code + e->ncode;
+	struct mu_par *sp = e->stack;
+	const struct var *v;
+	int r;
+
+	for(op = e->code; op < end; op++) {
+		e->top = sp;
+		switch(op->code) {
+		case OP_INT:
+			sp->type = mu_int;
+			sp->v.i = op->a;
+			sp++;
+			break;
+		case OP_STR: {
+			const struct expr_sym *sym = &e->syms[op->a];
+			sp->type = mu_int;
+			sp->v.s = mu_alloc(m, sym->len + 1);
+			memcpy(sp->v.s, sym->s, sym->len + 1);
+			sp->type = mu_str;
+			sp++;
+		} break;
+		case OP_VAR:
+			expr_value(m, expr_var(m, &e->syms[op->a]), sp);
+			sp++;
+			break;
+		case OP_VARI:
+			v = expr_var(m, &e->syms[op->a]);
+			sp->type = mu_int;
+			sp->v.i = !v ? 0 : v->type == mu_int ? v->v.i : atoi(v->v.s);
+			sp++;
+			break;
+		case OP_ARR:
+			v = expr_elem(m, e->syms[op->a].s, &sp[-1]);
+			expr_value(m, v, &sp[-1]);
+			break;
+		case OP_ARRI:
+			v = expr_elem(m, e->syms[op->a].s, &sp[-1]);
+			sp[-1].v.i = !v ? 0 : v->type == mu_int ? v->v.i : atoi(v->v.s);
+			break;
+		case OP_CALL: {
+			struct mu_par rv = expr_call(m, &e->syms[op->a], sp - op->b, op->b);
+			sp -= op->b;
+			*sp++ = rv;
+		} break;
+		case OP_TOINT:
+			par_as_int(&sp[-1]);
+			break;
+		case OP_NEG:
+			sp[-1].v.i = -sp[-1].v.i;
+			break;
+		case OP_NOT:
+			sp[-1].v.i = !sp[-1].v.i;
+			break;
+		case OP_ADD:
+			sp--;
+			sp[-1].v.i += sp->v.i;
+			break;
+		case OP_SUB:
+			sp--;
+			sp[-1].v.i -= sp->v.i;
+			break;
+		case OP_MUL:
+			sp--;
+			sp[-1].v.i *= sp->v.i;
+			break;
+		case OP_DIV:
+		case OP_MOD:
+			if(!sp[-1].v.i)
+				mu_throw(m, "Divide by zero");
+			sp--;
+			if(op->code == OP_DIV)
+				sp[-1].v.i /= sp->v.i;
+			else
+				sp[-1].v.i %= sp->v.i;
+			break;
+		case OP_ORJ:
+			if(m->short_circuit && (sp[-1].v.i = !!sp[-1].v.i))
+				op = e->code + op->a - 1;
+			break;
+		case OP_ANDJ:
+			if(m->short_circuit && !(sp[-1].v.i = !!sp[-1].v.i))
+				op = e->code + op->a - 1;
+			break;
+		case OP_OR:
+			sp--;
+			sp[-1].v.i = m->short_circuit ? !!sp->v.i : sp[-1].v.i | sp->v.i;
+			break;
+		case OP_AND:
+			sp--;
+			sp[-1].v.i = m->short_circuit ? !!sp->v.i : sp[-1].v.i & sp->v.i;
+			break;
+		case OP_CMPI:
+			sp--;
+			r = sp[-1].v.i < sp->v.i ? -1 : sp[-1].v.i > sp->v.i;
+			sp[-1].v.i = compare(op->b, r);
+			break;
+		case OP_CAT: {
+			char *s;
+			size_t a, b;
+			if(!par_as_str(&sp[-2]) || !par_as_str(&sp[-1]))
+				mu_throw(m, "Out of memory");
+			a = strlen(sp[-2].v.s);
+			b = strlen(sp[-1].v.s);
+			s = mu_alloc(m, a + b + 1);
+			memcpy(s, sp[-2].v.s, a);
+			memcpy(s + a, sp[-1].v.s, b + 1);
+			free(sp[-2].v.s);
+			free(sp[-1].v.s);
+			sp--;
+			sp[-1].v.s = s;
+		} break;
+		case OP_CMP:
+			if(sp[-2].type != mu_str) {
+				r = par_as_int(&sp[-1]);
+				sp--;
+				r = sp[-1].v.i < r ? -1 : sp[-1].v.i > r;
+				sp[-1].v.i = compare(op->b, r);
+				break;
+			}
+			/* fall through */
+		case OP_CMPS:
+			if(!par_as_str(&sp[-1]))
+				mu_throw(m, "Out of memory");
+			r = strcmp(sp[-2].v.s, sp[-1].v.s);
+			free(sp[-2].v.s);
+			free(sp[-1].v.s);
+			sp--;
+			sp[-1].type = mu_int;
+			sp[-1].v.i = compare(op->b, r);
 			break;
 		}
-	return rv;
+	}
+	e->top = sp;
 }
 
-/*@ ##INSTR(str$, find$)
- *# Searches for {{find$}} in {{str$}} and returns the index.\n
- *# It returns 0 if {{find$}} was not found.
- */
-static struct mu_par m_instr(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	const char *str = mu_par_str(m, 0, argc, argv);
-	char *x = strstr(str, mu_par_str(m, 1, argc, argv));
-	if(x)
-		rv.v.i = x - str + 1;
+int mu_eval(struct musl *m, struct mu_expr *e, struct mu_par *result) {
+	jmp_buf save_jmp;
+	struct args *volatile save_base;
+	volatile int rv = 0, save_active;
+	int i;
+
+	if(e->id != m->id || e->var_epoch != m->var_epoch || e->call_gen != m->call_gen) {
+		/* Look the names up again */
+		for(i = 0; i < e->nsyms; i++)
+			e->syms[i].v = NULL;
+		e->id = m->id;
+		e->var_epoch = m->var_epoch;
+		e->call_gen = m->call_gen;
+	}
+
+	memcpy(&save_jmp, &m->on_error, sizeof save_jmp);
+	save_base = m->args_base;
+	m->args_base = m->args;
+	save_active = m->active;
+	m->active = 1;
+	/* Functions can't suspend a script from here */
+	m->depth++;
+
+	if(setjmp(m->on_error) == 0) {
+		run_expr(m, e);
+		*result = e->stack[0];
+		e->top = e->stack;
+		rv = 1;
+	} else {
+		free_expr_stack(e);
+	}
+
+	m->depth--;
+	m->active = save_active;
+	memcpy(&m->on_error, &save_jmp, sizeof save_jmp);
+	m->args_base = save_base;
 	return rv;
 }
 
-/*@ ##CONTAINS(str$, what$)
- *# Searches {{str$}} for any of the characters in {{what$}}.\n
- *# It returns 1 if {{str$}} contains an
- *X IF CONTAINS(str$, "aeuio") THEN PRINT "String contains vowels"
- */
-static struct mu_par m_contains(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	const char *str = mu_par_str(m, 0, argc, argv);
-	char *x = strpbrk(str, mu_par_str(m, 1, argc, argv));
-	if(x)
-		rv.v.i = 1;
-	return rv;
+int mu_set_option(struct musl *m, enum mu_option opt, int value) {
+	int old = 0;
+	switch(opt) {
+		case mu_short_circuit: old = m->short_circuit; m->short_circuit = !!value; break;
+		case mu_async_calls: old = m->async; m->async = !!value; break;
+	}
+	return old;
 }
 
-/*@ ##IFF(cond, then_val, else_val)
- *# If the condition {{cond}} is true, it returns {{then_val}},
- *# otherwise it returns {{else_val}}
- */
-static struct mu_par m_iff(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	int res = mu_par_int(m, 0, argc, argv) ? 1 : 2;
-	rv = argv[res];
-	if(rv.type == mu_str) {
-		rv.v.s = strdup(rv.v.s);
+int mu_set_limit(struct musl *m, enum mu_limit what, int n) {
+	int old = 0;
+	switch(what) {
+		case mu_gosub_limit: old = m->gosub_max; if(n > 0) m->gosub_max = n; break;
+		case mu_for_limit: old = m->for_max; if(n > 0) m->for_max = n; break;
+		case mu_thread_limit: old = m->max_threads; if(n > 0) m->max_threads = n; break;
 	}
-	return rv;
+	return old;
 }
 
-/*@ ##DATA(@list$, item1, item2, item3, ...)
- *# Populates an array named {{list$}}.\n
- *N The first parameter is a string containing the name of the array.
- *# A call
- *[
- *# DATA(@array$, "Alice", "Bob", "Carol")
- *]
- *# is equivalent to the statements:
- *[
- *# LET array$[1] = "Alice"
- *# LET array$[2] = "Bob"
- *# LET array$[3] = "Carol"
- *]
- *# {{list$["length"]}} will contain the number of items in the array.\n
- *# Subsequent calls to {{DATA()}} on the same array will append more data.\n
- *# It returns the number of items inserted into the array.
+/*
+ * Cleanup
  */
-static struct mu_par m_data(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	int i, idx;
-	char name[TOK_SIZE];
-	const char *aname;
-
+static void clear_var(struct var *v) {
+	if(v->type == mu_str)
+		free(v->v.s);
+}
+
+void mu_cleanup(struct musl *m) {
+	int i;
+	clear_table(&m->vars, clear_var);
+	clear_table(&m->funcs, clear_func);
+	clear_table(&m->chans, NULL);
+	free(m->token);
+	pop_frames(m, 0);
+	for(i = 0; i < m->gosub_size; i++)
+		free(m->gosub_stack[i].locals);
+	free(m->gosub_stack);
+	free(m->for_stack);
+	if(m->has_retval && m->retval.type == mu_str)
+		free(m->retval.v.s);
+	mu_free_script(m->own_script);
+	free_loaded(m);
+	clear_log(m);
+	free(m->log);
+	free(m);
+}
+
+void mu_reset(struct musl *m) {
+	empty_table(&m->vars, clear_var);
+	m->var_epoch++;
+	end_script(m);
+	free_loaded(m);
+	m->for_sp = 0;
+	if(m->has_retval && m->retval.type == mu_str)
+		free(m->retval.v.s);
+	m->has_retval = 0;
+	m->active = 1;
+	m->start = NULL;
+	m->s = NULL;
+	strcpy(m->error_msg, "");
+	strcpy(m->error_text, "");
+}
+
+/*
+ * Interpreter pools
+ *
+ * The free interpreters are kept on a lock-free stack (a Treiber stack).
+ * The head packs the index of the top slot plus one (0 means empty) in
+ * its low 32 bits and a counter in its high 32 bits that is bumped on
+ * every change, so that a slot that was popped and pushed again between
+ * a thread's load and its compare-and-swap can not be mistaken for the
+ * same head (the ABA problem).
+ */
+#if defined(__GNUC__)
+#  define ATOMIC_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#  define ATOMIC_READ(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#  define ATOMIC_WRITE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#  define ATOMIC_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#  define ATOMIC_CAS(p, o, n)	__atomic_compare_exchange_n(p, o, n, 1, \
+									__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+/* Without atomics a pool or channel may only be used by one thread */
+#  define ATOMIC_LOAD(p)		(*(p))
+#  define ATOMIC_READ(p)		(*(p))
+#  define ATOMIC_WRITE(p, v)	(*(p) = (v))
+#  define ATOMIC_STORE(p, v)	(*(p) = (v))
+#  define ATOMIC_CAS(p, o, n)	(*(p) == *(o) ? (*(p) = (n), 1) : (*(o) = *(p), 0))
+#endif
+
+struct mu_pool {
+	struct musl **ms;
+	int *next;	/* Next free slot below each slot, -1 at the bottom */
+	int size;
+	unsigned long long head;
+	mu_pool_init init;
+	void *data;
+};
+
+static void pool_push(struct mu_pool *p, int i) {
+	unsigned long long old = ATOMIC_LOAD(&p->head), new;
+	do {
+		ATOMIC_WRITE(&p->next[i], (int)(old & 0xFFFFFFFFu) - 1);
+		new = (((old >> 32) + 1) << 32) | (unsigned int)(i + 1);
+	} while(!ATOMIC_CAS(&p->head, &old, new));
+}
+
+static int pool_pop(struct mu_pool *p) {
+	unsigned long long old = ATOMIC_LOAD(&p->head), new;
+	int i;
+	do {
+		i = (int)(old & 0xFFFFFFFFu) - 1;
+		if(i < 0)
+			return -1;
+		new = (((old >> 32) + 1) << 32) | (unsigned int)(ATOMIC_READ(&p->next[i]) + 1);
+	} while(!ATOMIC_CAS(&p->head, &old, new));
+	return i;
+}
+
+static struct musl *pool_new(struct mu_pool *p) {
+	struct musl *m = mu_create();
+	if(m && p->init && !p->init(m, p->data)) {
+		mu_cleanup(m);
+		return NULL;
+	}
+	return m;
+}
+
+struct mu_pool *mu_pool_create(int size, mu_pool_init init, void *data) {
+	struct mu_pool *p;
+	int i;
+	if(size < 0)
+		return NULL;
+	p = malloc(sizeof *p);
+	if(!p)
+		return NULL;
+	p->ms = calloc(size + 1, sizeof *p->ms);
+	p->next = calloc(size + 1, sizeof *p->next);
+	p->size = 0;
+	p->head = 0;
+	p->init = init;
+	p->data = data;
+	if(!p->ms || !p->next) {
+		mu_pool_free(p);
+		return NULL;
+	}
+	for(i = 0; i < size; i++) {
+		if(!(p->ms[i] = pool_new(p))) {
+			mu_pool_free(p);
+			return NULL;
+		}
+		p->ms[i]->pool_slot = i;
+		p->size++;
+		pool_push(p, i);
+	}
+	return p;
+}
+
+struct musl *mu_pool_acquire(struct mu_pool *p) {
+	int i = pool_pop(p);
+	if(i >= 0)
+		return p->ms[i];
+	/* The pool is exhausted: hand out an extra interpreter
+	that is destroyed again when it is released. */
+	return pool_new(p);
+}
+
+void mu_pool_release(struct mu_pool *p, struct musl *m) {
+	if(m->pool_slot < 0) {
+		mu_cleanup(m);
+		return;
+	}
+	mu_reset(m);
+	pool_push(p, m->pool_slot);
+}
+
+void mu_pool_free(struct mu_pool *p) {
+	int i;
+	if(p->ms)
+		for(i = 0; i < p->size; i++)
+			mu_cleanup(p->ms[i]);
+	free(p->ms);
+	free(p->next);
+	free(p);
+}
+
+
+/*
+ * Channels
+ *
+ * A channel is a bounded queue that any number of threads can send
+ * to and receive from. The ring buffer itself is lock-free: Each cell
+ * has a sequence number that says whether it is free for the send at
+ * its position or holds the value for the receive at that position
+ * (Dmitry Vyukov's bounded MPMC queue). Values are moved through the
+ * channel, so strings are not copied.
+ *
+ * The lock is only used when a sender finds the channel full or a
+ * receiver finds it empty. Threads wait on the condition. Scripts that
+ * run on a mu_sched with the mu_async_calls option are parked with
+ * mu_suspend() instead, so that they don't block the worker; the thread
+ * that makes room or sends a value completes their calls.
+ */
+struct chan_cell {
+	unsigned int seq;
+	struct mu_par val;
+};
+
+#ifdef WITH_THREADS
+/* A script that is parked on a channel */
+struct chan_wait {
+	struct musl *m;
+	int token;
+	int send;
+	/* The value to send, or the value to receive at the end */
+	struct mu_par val;
+	struct chan_wait *next;
+};
+#endif
+
+struct mu_chan {
+	struct chan_cell *cells;
+	unsigned int mask;
+	unsigned int head, tail;	/* Positions of the next receive and send */
+	int closed;
+#ifdef WITH_THREADS
+	int waiting;	/* Threads and scripts that are waiting */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chan_wait *waits, **last_wait;
+#endif
+};
+
+static int chan_push(struct mu_chan *ch, struct mu_par v) {
+	unsigned int pos = ATOMIC_READ(&ch->tail);
+	struct chan_cell *c;
+	for(;;) {
+		int d;
+		c = &ch->cells[pos & ch->mask];
+		d = (int)(ATOMIC_LOAD(&c->seq) - pos);
+		if(d == 0) {
+			if(ATOMIC_CAS(&ch->tail, &pos, pos + 1))
+				break;
+		} else if(d < 0)
+			return 0;	/* Full */
+		else
+			pos = ATOMIC_READ(&ch->tail);
+	}
+	c->val = v;
+	ATOMIC_STORE(&c->seq, pos + 1);
+	return 1;
+}
+
+static int chan_pop(struct mu_chan *ch, struct mu_par *v) {
+	unsigned int pos = ATOMIC_READ(&ch->head);
+	struct chan_cell *c;
+	for(;;) {
+		int d;
+		c = &ch->cells[pos & ch->mask];
+		d = (int)(ATOMIC_LOAD(&c->seq) - (pos + 1));
+		if(d == 0) {
+			if(ATOMIC_CAS(&ch->head, &pos, pos + 1))
+				break;
+		} else if(d < 0)
+			return 0;	/* Empty */
+		else
+			pos = ATOMIC_READ(&ch->head);
+	}
+	*v = c->val;
+	ATOMIC_STORE(&c->seq, pos + ch->mask + 1);
+	return 1;
+}
+
+#ifdef WITH_THREADS
+/* Completes the parked scripts that can continue.
+ * Called with the lock held. */
+static void chan_serve(struct mu_chan *ch) {
+	struct chan_wait **wp, *w;
+	int progress;
+	do {
+		progress = 0;
+		for(wp = &ch->waits; (w = *wp) != NULL;) {
+			struct mu_par v = {mu_int, {0}};
+			int done = 1;
+			if(w->send) {
+				if(ATOMIC_READ(&ch->closed)) {
+					if(w->val.type == mu_str)
+						free(w->val.v.s);
+				} else if(chan_push(ch, w->val))
+					v.v.i = 1;
+				else
+					done = 0;
+			} else if(!chan_pop(ch, &v)) {
+				if(ATOMIC_READ(&ch->closed))
+					v = w->val;
+				else
+					done = 0;
+			} else if(w->val.type == mu_str)
+				free(w->val.v.s);
+			if(!done) {
+				wp = &w->next;
+				continue;
+			}
+			mu_complete(w->m, w->token, v);
+			if(v.type == mu_str)
+				free(v.v.s);
+			*wp = w->next;
+			free(w);
+			__atomic_sub_fetch(&ch->waiting, 1, __ATOMIC_SEQ_CST);
+			progress = 1;
+		}
+		ch->last_wait = wp;
+	} while(progress);
+}
+#endif
+
+/* Lets waiting senders and receivers retry after a value was sent or
+ * received, or the channel was closed */
+static void chan_wake(struct mu_chan *ch) {
+#ifdef WITH_THREADS
+	/* Pairs with the increment of waiting in chan_block(): Either the
+	 * waiter sees the change to the ring buffer, or this sees it waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ch->waiting, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&ch->lock);
+	chan_serve(ch);
+	pthread_cond_broadcast(&ch->cond);
+	pthread_mutex_unlock(&ch->lock);
+#endif
+}
+
+#ifdef WITH_THREADS
+/* Waits until *v could be sent, or a value was received into *v.
+ * When receiving, *v holds the value to return at the end of the
+ * channel on entry. Returns 1 if a value was sent or received, 0 if
+ * the channel is closed, MU_PENDING if the script running on m (which
+ * may be NULL) was parked instead, and -1 if it ran out of memory.
+ * A parked script owns *v. */
+static int chan_block(struct mu_chan *ch, struct musl *m, int send, struct mu_par *v) {
+	struct chan_wait *w = NULL;
+	int rv;
+
+	/* A script waits without blocking the worker if it can */
+	if(m && m->task && LOGGING(m) && !(w = malloc(sizeof *w)))
+		return -1;
+
+	pthread_mutex_lock(&ch->lock);
+	__atomic_add_fetch(&ch->waiting, 1, __ATOMIC_SEQ_CST);
+	for(;;) {
+		if(send) {
+			if(ATOMIC_READ(&ch->closed)) {
+				rv = 0;
+				break;
+			}
+			if((rv = chan_push(ch, *v)) != 0)
+				break;
+		} else {
+			int closed = ATOMIC_READ(&ch->closed);
+			struct mu_par got;
+			/* Values sent before the close are still received */
+			if((rv = chan_pop(ch, &got)) != 0) {
+				if(v->type == mu_str)
+					free(v->v.s);
+				*v = got;
+				break;
+			}
+			if(closed)
+				break;
+		}
+		if(w) {
+			w->m = m;
+			w->token = mu_suspend(m);
+			w->send = send;
+			w->val = *v;
+			w->next = NULL;
+			*ch->last_wait = w;
+			ch->last_wait = &w->next;
+			pthread_mutex_unlock(&ch->lock);
+			return MU_PENDING;
+		}
+		pthread_cond_wait(&ch->cond, &ch->lock);
+	}
+	__atomic_sub_fetch(&ch->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ch->lock);
+	free(w);
+	if(rv)
+		chan_wake(ch);
+	return rv;
+}
+#endif
+
+struct mu_chan *mu_chan_create(int size) {
+	struct mu_chan *ch;
+	unsigned int i, n = 2;	/* The sequence numbers need at least two cells */
+	if(size <= 0)
+		return NULL;
+	while(n < (unsigned int)size)
+		n <<= 1;
+	if(!(ch = malloc(sizeof *ch)))
+		return NULL;
+	if(!(ch->cells = malloc(n * sizeof *ch->cells))) {
+		free(ch);
+		return NULL;
+	}
+	for(i = 0; i < n; i++)
+		ch->cells[i].seq = i;
+	ch->mask = n - 1;
+	ch->head = ch->tail = 0;
+	ch->closed = 0;
+#ifdef WITH_THREADS
+	ch->waiting = 0;
+	ch->waits = NULL;
+	ch->last_wait = &ch->waits;
+	pthread_mutex_init(&ch->lock, NULL);
+	pthread_cond_init(&ch->cond, NULL);
+#endif
+	return ch;
+}
+
+int mu_chan_send(struct mu_chan *ch, struct mu_par v, int wait) {
+	if(ATOMIC_READ(&ch->closed))
+		return 0;
+	if(v.type == mu_str && !(v.v.s = strdup(v.v.s)))
+		return 0;
+	if(chan_push(ch, v)) {
+		chan_wake(ch);
+		return 1;
+	}
+#ifdef WITH_THREADS
+	if(wait && chan_block(ch, NULL, 1, &v) == 1)
+		return 1;
+#endif
+	if(v.type == mu_str)
+		free(v.v.s);
+	return 0;
+}
+
+int mu_chan_recv(struct mu_chan *ch, struct mu_par *v, int wait) {
+	if(chan_pop(ch, v)) {
+		chan_wake(ch);
+		return 1;
+	}
+#ifdef WITH_THREADS
+	if(wait) {
+		v->type = mu_int;
+		v->v.i = 0;
+		return chan_block(ch, NULL, 0, v) == 1;
+	}
+#endif
+	return 0;
+}
+
+void mu_chan_close(struct mu_chan *ch) {
+	ATOMIC_STORE(&ch->closed, 1);
+	chan_wake(ch);
+}
+
+void mu_chan_free(struct mu_chan *ch) {
+	struct mu_par v;
+	while(chan_pop(ch, &v))
+		if(v.type == mu_str)
+			free(v.v.s);
+#ifdef WITH_THREADS
+	pthread_mutex_destroy(&ch->lock);
+	pthread_cond_destroy(&ch->cond);
+#endif
+	free(ch->cells);
+	free(ch);
+}
+
+int mu_add_chan(struct musl *m, const char *name, struct mu_chan *ch) {
+	struct var *v = find_var(&m->chans, name);
+	if(!v) {
+		if(!(v = new_var(name))) return 0;
+		if(!put_var(&m->chans, v)) {
+			free_element(v, NULL);
+			return 0;
+		}
+	}
+	v->v.p = ch;
+	return 1;
+}
+
+static struct mu_chan *get_chan(struct musl *m, const char *fname, int argc, struct mu_par argv[]) {
+	const char *name = mu_par_str(m, 0, argc, argv);
+	const struct musl *c = m;
+	struct var *v;
+	do {
+		if((v = find_var(&c->chans, name)) != NULL)
+			return v->v.p;
+	} while((c = c->parent) != NULL);
+	mu_throw(m, "%s() on unknown channel '%s'", fname, name);
+	return NULL;
+}
+
+/*@ ##CHAN_SEND(ch$, value)
+ *# Sends {{value}} on the channel named {{ch$}}, which the
+ *# application created and registered with {{~~mu_add_chan()}}.\n
+ *# If the channel is full, it waits until a receiver makes room.\n
+ *# It returns 1, or 0 if the channel is closed.
+ */
+static struct mu_par m_chan_send(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}}, v;
+	struct mu_chan *ch = get_chan(m, "CHAN_SEND", argc, argv);
+
+	if(argc < 2)
+		mu_throw(m, "Too few parameters to function");
+	if(ATOMIC_READ(&ch->closed))
+		return rv;
+	/* Move the value into the channel */
+	v = argv[1];
+	argv[1].type = mu_int;
+	if(chan_push(ch, v)) {
+		chan_wake(ch);
+		rv.v.i = 1;
+		return rv;
+	}
+#ifdef WITH_THREADS
+	if((rv.v.i = chan_block(ch, m, 1, &v)) == MU_PENDING || rv.v.i == 1) {
+		rv.v.i = 1;
+		return rv;
+	}
+	if(rv.v.i < 0) {
+		if(v.type == mu_str)
+			free(v.v.s);
+		mu_throw(m, "Out of memory");
+	}
+	if(v.type == mu_str)
+		free(v.v.s);
+	return rv;
+#else
+	if(v.type == mu_str)
+		free(v.v.s);
+	mu_throw(m, "CHAN_SEND() on a full channel would block");
+	return rv;
+#endif
+}
+
+/*@ ##CHAN_RECV$(ch$, [eof$])
+ *# Receives the next value from the channel named {{ch$}}. If the
+ *# channel is empty, it waits until a value is sent.\n
+ *# If the channel is closed and empty it returns {{eof$}}, or an
+ *# empty string if {{eof$}} is omitted.\n
+ *# Scripts run by a {{~~mu_sched}} with the {{mu_async_calls}} option
+ *# (see {{~~mu_set_option()}}) give up their worker while they wait.
+ *# Otherwise the thread running the script waits.
+ */
+static struct mu_par m_chan_recv(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_str, {0}};
+	struct mu_chan *ch = get_chan(m, "CHAN_RECV$", argc, argv);
+	int r;
+
+	if(chan_pop(ch, &rv)) {
+		chan_wake(ch);
+		return rv;
+	}
+	/* The value at the end of the channel */
+	rv.type = mu_str;
+	if(!(rv.v.s = strdup(argc > 1 ? mu_par_str(m, 1, argc, argv) : "")))
+		mu_throw(m, "Out of memory");
+#ifdef WITH_THREADS
+	if((r = chan_block(ch, m, 0, &rv)) < 0) {
+		free(rv.v.s);
+		mu_throw(m, "Out of memory");
+	}
+	if(r == MU_PENDING) {
+		/* The waiting script owns the string now */
+		rv.type = mu_int;
+		rv.v.i = 0;
+	}
+	return rv;
+#else
+	if(!ATOMIC_READ(&ch->closed)) {
+		free(rv.v.s);
+		mu_throw(m, "CHAN_RECV$() on an empty channel would block");
+	}
+	(void)r;
+	return rv;
+#endif
+}
+
+/*@ ##CHAN_CLOSE(ch$)
+ *# Closes the channel named {{ch$}}, to tell the receivers that no
+ *# more values will be sent. The values that were already sent can
+ *# still be received.
+ */
+static struct mu_par m_chan_close(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	mu_chan_close(get_chan(m, "CHAN_CLOSE", argc, argv));
+	return rv;
+}
+
+/*
+ * Accessor functions
+ */
+
+int mu_set_int(struct musl *m, const char *name, int num) {
+	struct var *v = make_global(m, name);
+	if(!v)
+		return 0;
+	set_var_int(v, num);
+	return 1;
+}
+
+int mu_get_int(struct musl *m, const char *name) {
+	struct var *v = get_var(m, name);
+	if(!v)
+		return 0;
+	else if(v->type == mu_str)
+		return atoi(v->v.s);
+	return v->v.i;
+}
+
+int mu_set_str(struct musl *m, const char *name, const char *val) {
+	struct var *v = make_global(m, name);
+	return v && set_var_str(v, val);
+}
+
+int mu_has_var(struct musl *m, const char *name) {
+	return !!get_var(m, name);
+}
+
+const char *mu_get_str(struct musl *m, const char *name) {
+	struct var *v = find_var(&m->vars, name);
+	if(!v) {
+		/* The parent's variable or a frozen one */
+		if(!(v = get_var(m, name)))
+			return NULL;
+		if(v->type == mu_str)
+			return v->v.s;
+		/* Convert a copy, rather than the variable itself */
+		if(!mu_set_int(m, name, v->v.i))
+			return NULL;
+		v = find_var(&m->vars, name);
+	}
+	if(!v)
+		return NULL;
+
+	if(v->type == mu_int) {
+		char *buffer = malloc(20);
+		if(!buffer) return NULL;
+		sprintf(buffer, "%d", v->v.i);
+		v->type = mu_str;
+		v->v.s = buffer;
+	}
+
+	return v->v.s;
+}
+
+/* A handle is the variable's node, which the hash table never moves */
+struct mu_var *mu_var_handle(struct musl *m, const char *name) {
+#ifdef WITH_MMAP
+	/* A frozen variable gets a copy that can be modified */
+	struct var *v, *f;
+	if(!find_var(&m->vars, name) && m->frozen && (f = find_var(m->frozen, name)) != NULL) {
+		if(!(v = make_global(m, name)))
+			return NULL;
+		if(f->type == mu_str && !set_var_str(v, f->v.s))
+			return NULL;
+		else if(f->type == mu_int)
+			set_var_int(v, f->v.i);
+		return (struct mu_var *)v;
+	}
+#endif
+	return (struct mu_var *)make_global(m, name);
+}
+
+int mu_handle_set_int(struct mu_var *h, int num) {
+	set_var_int((struct var *)h, num);
+	return 1;
+}
+
+int mu_handle_set_str(struct mu_var *h, const char *val) {
+	return set_var_str((struct var *)h, val);
+}
+
+int mu_handle_get_int(const struct mu_var *h) {
+	const struct var *v = (const struct var *)h;
+	return v->type == mu_str ? atoi(v->v.s) : v->v.i;
+}
+
+const char *mu_handle_get_str(const struct mu_var *h, char *buf, size_t size) {
+	const struct var *v = (const struct var *)h;
+	if(v->type == mu_str)
+		return v->v.s;
+	snprintf(buf, size, "%d", v->v.i);
+	return buf;
+}
+
+/* Sets v to the value p. If move is set, a string in p is taken over
+ * rather than copied. */
+static int set_var_par(struct var *v, struct mu_par *p, int move) {
+	if(p->type == mu_int) {
+		set_var_int(v, p->v.i);
+	} else if(move) {
+		if(v->type == mu_str)
+			free(v->v.s);
+		v->type = mu_str;
+		v->v.s = p->v.s;
+		p->v.s = NULL;
+	} else if(!set_var_str(v, p->v.s)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Frees the strings in p[from..n-1] that mu_set_many() and mu_set_array()
+ * were given with move set, but couldn't store */
+static void free_moved(struct mu_par *p, size_t from, size_t n) {
+	for(; from < n; from++)
+		if(p[from].type == mu_str) {
+			free(p[from].v.s);
+			p[from].v.s = NULL;
+		}
+}
+
+/* Grows m->vars up front for n more variables */
+static void reserve_vars(struct musl *m, size_t n) {
+	if(n < UINT_MAX / 2 - m->vars.n)
+		reserve_table(&m->vars, m->vars.n + (unsigned int)n + 1);
+}
+
+int mu_set_many(struct musl *m, struct mu_kv *kv, size_t n, int move) {
+	struct var *v;
+	size_t i;
+	reserve_vars(m, n);
+	for(i = 0; i < n; i++) {
+		if(!(v = make_global(m, kv[i].name)) || !set_var_par(v, &kv[i].val, move)) {
+			if(move)
+				for(; i < n; i++)
+					free_moved(&kv[i].val, 0, 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+size_t mu_get_many(struct musl *m, struct mu_kv *kv, size_t n) {
+	const struct var *v;
+	size_t i, found = 0;
+	for(i = 0; i < n; i++) {
+		if((v = get_var(m, kv[i].name)) != NULL) {
+			kv[i].val.type = v->type;
+			if(v->type == mu_str)
+				kv[i].val.v.s = v->v.s;
+			else
+				kv[i].val.v.i = v->v.i;
+			found++;
+		} else {
+			kv[i].val.type = mu_int;
+			kv[i].val.v.i = 0;
+		}
+	}
+	return found;
+}
+
+int mu_set_array(struct musl *m, const char *name, struct mu_par *values, size_t n, int move) {
+	struct var *v;
+	size_t i, len = strlen(name);
+	char *buf;
+
+	if(n > INT_MAX || !(buf = malloc(len + 24))) {
+		if(move) free_moved(values, 0, n);
+		return 0;
+	}
+	reserve_vars(m, n + 1);
+	memcpy(buf, name, len);
+	for(i = 0; i < n; i++) {
+		sprintf(buf + len, "[%d]", (int)i + 1);
+		if(!(v = make_global(m, buf)) || !set_var_par(v, &values[i], move)) {
+			if(move) free_moved(values, i, n);
+			free(buf);
+			return 0;
+		}
+	}
+	strcpy(buf + len, "[length]");
+	if(!(v = make_global(m, buf))) {
+		free(buf);
+		return 0;
+	}
+	set_var_int(v, (int)n);
+	free(buf);
+	return 1;
+}
+
+void mu_set_data(struct musl *m, void *data) {
+	m->user = data;
+}
+
+void *mu_get_data(struct musl *m) {
+	return m->user;
+}
+
+static int var_qcomp(const void*p,const void*q) {
+	return strcmp((*(struct var**)p)->name,(*(struct var**)q)->name);
+}
+
+void mu_dump(struct musl *m, FILE *f) {
+	unsigned int i, n = 0, len = 10;
+	struct var *v, **vars;
+
+	if(!m->vars.n || !(vars = malloc(m->vars.n * sizeof *vars)))
+		return;
+	for(i = 0; i < m->vars.size; i++)
+		for(v = m->vars.b[i]; v; v = v->next) {
+			vars[n++] = v;
+			if(strlen(v->name) > len) len = strlen(v->name);
+		}
+	assert(n == m->vars.n);
+	qsort(vars, n, sizeof *vars, var_qcomp);
+	for(i = 0; i < n; i++) {
+		v = vars[i];
+		if(v->type == mu_int)
+			fprintf(f, "%-*s:\t%d\n", len+1, v->name, v->v.i);
+		else
+			fprintf(f, "%-*s:\t\"%s\"\n", len+1, v->name, v->v.s);
+	}
+
+	free(vars);
+}
+
+/*
+ * Saving and restoring state.
+ * The format is a 4 byte magic number and a version followed by the
+ * number of variables. Each variable is stored as a type byte, the
+ * length-prefixed name and then either the integer value or the
+ * length-prefixed string value. All integers are 32-bit little endian.
+ */
+#define STATE_MAGIC		"MuSt"
+#define STATE_VERSION	1
+
+/* Variables are (de)serialized through a local buffer rather than with
+ * a stdio call per field, which dominates the run time otherwise. */
+struct state_buf {
+	FILE *f;
+	size_t n, len;
+	unsigned char b[4096];
+};
+
+static void put_bytes(struct state_buf *sb, const void *p, size_t len) {
+	const unsigned char *c = p;
+	while(len > 0) {
+		size_t n = sizeof sb->b - sb->n;
+		if(n > len) n = len;
+		memcpy(sb->b + sb->n, c, n);
+		sb->n += n;
+		c += n;
+		len -= n;
+		if(sb->n == sizeof sb->b) {
+			fwrite(sb->b, 1, sb->n, sb->f);
+			sb->n = 0;
+		}
+	}
+}
+
+static void put_u32(struct state_buf *sb, unsigned int x) {
+	unsigned char b[4];
+	b[0] = x & 0xFF;
+	b[1] = (x >> 8) & 0xFF;
+	b[2] = (x >> 16) & 0xFF;
+	b[3] = (x >> 24) & 0xFF;
+	put_bytes(sb, b, 4);
+}
+
+static int get_bytes(struct state_buf *sb, void *p, size_t len) {
+	unsigned char *c = p;
+	while(len > 0) {
+		size_t n;
+		if(sb->n == sb->len) {
+			sb->n = 0;
+			if(!(sb->len = fread(sb->b, 1, sizeof sb->b, sb->f)))
+				return 0;
+		}
+		n = sb->len - sb->n;
+		if(n > len) n = len;
+		memcpy(c, sb->b + sb->n, n);
+		sb->n += n;
+		c += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int get_u32(struct state_buf *sb, unsigned int *x) {
+	unsigned char b[4];
+	if(!get_bytes(sb, b, 4))
+		return 0;
+	*x = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+	return 1;
+}
+
+static char *get_chars(struct state_buf *sb) {
+	unsigned int len;
+	char *s;
+	if(!get_u32(sb, &len) || len == UINT_MAX || !(s = malloc(len + 1)))
+		return NULL;
+	if(!get_bytes(sb, s, len)) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+int mu_save_state(struct musl *m, FILE *f) {
+	unsigned int i, len;
+	unsigned char type;
+	struct var *v;
+	struct state_buf *sb = malloc(sizeof *sb);
+
+	if(!sb) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	sb->f = f;
+	sb->n = 0;
+
+	put_bytes(sb, STATE_MAGIC, 4);
+	put_u32(sb, STATE_VERSION);
+	put_u32(sb, m->vars.n);
+	for(i = 0; i < m->vars.size; i++)
+		for(v = m->vars.b[i]; v; v = v->next) {
+			type = v->type;
+			put_bytes(sb, &type, 1);
+			len = strlen(v->name);
+			put_u32(sb, len);
+			put_bytes(sb, v->name, len);
+			if(v->type == mu_int)
+				put_u32(sb, (unsigned int)v->v.i);
+			else {
+				len = strlen(v->v.s);
+				put_u32(sb, len);
+				put_bytes(sb, v->v.s, len);
+			}
+		}
+	fwrite(sb->b, 1, sb->n, f);
+	free(sb);
+
+	if(ferror(f)) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Unable to write state");
+		return 0;
+	}
+	return 1;
+}
+
+static void clear_var(struct var *v);
+
+int mu_load_state(struct musl *m, FILE *f) {
+	char magic[4];
+	unsigned int version, n, i, x;
+	unsigned char type;
+	long pos, end;
+	hash_table tbl;
+	struct var *v;
+	struct state_buf *sb = malloc(sizeof *sb);
+
+	init_table(&tbl);
+	if(!sb)
+		goto nomem;
+	sb->f = f;
+	sb->n = sb->len = 0;
+
+	if(!get_bytes(sb, magic, 4) || memcmp(magic, STATE_MAGIC, 4)
+		|| !get_u32(sb, &version) || version != STATE_VERSION || !get_u32(sb, &n)) {
+		free(sb);
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Not a valid state file");
+		return 0;
+	}
+
+	/* Every variable takes at least 9 bytes (its type and two 32-bit
+	 * fields), so reject counts that can't fit in the rest of the file
+	 * before reserving room for them. */
+	if(n > INT_MAX / 9)
+		goto corrupt;
+	if((pos = ftell(f)) >= 0 && !fseek(f, 0, SEEK_END)) {
+		end = ftell(f);
+		if(fseek(f, pos, SEEK_SET))
+			goto corrupt;
+		if(end >= pos && (unsigned long)(end - pos) + (sb->len - sb->n) < (unsigned long)n * 9)
+			goto corrupt;
+	}
+
+	if(!reserve_table(&tbl, n))
+		goto nomem;
+
+	for(i = 0; i < n; i++) {
+		if(!get_bytes(sb, &type, 1) || (type != mu_int && type != mu_str))
+			goto corrupt;
+		if(!(v = malloc(sizeof *v)))
+			goto nomem;
+		v->next = NULL;
+		if(!(v->name = get_chars(sb))) {
+			free(v);
+			goto corrupt;
+		}
+		v->hash = hash(v->name);
+		v->type = type;
+		if(type == mu_int) {
+			if(!get_u32(sb, &x)) {
+				free_element(v, NULL);
+				goto corrupt;
+			}
+			v->v.i = (int)x;
+		} else if(!(v->v.s = get_chars(sb))) {
+			free_element(v, NULL);
+			goto corrupt;
+		}
+		if(find_var(&tbl, v->name)) {
+			free_element(v, clear_var);
+			goto corrupt;
+		}
+		put_var(&tbl, v);
+	}
+	free(sb);
+
+	/* Only replace the variables if the whole file was read */
+	clear_table(&m->vars, clear_var);
+	m->vars = tbl;
+	m->var_epoch++;
+	return 1;
+
+corrupt:
+	free(sb);
+	clear_table(&tbl, clear_var);
+	snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Corrupt state file");
+	return 0;
+nomem:
+	free(sb);
+	clear_table(&tbl, clear_var);
+	snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+	return 0;
+}
+
+#ifdef WITH_MMAP
+/*
+ * Frozen variables.
+ * The table is built in a shared mapping, with the same layout as a
+ * hash_table in memory, so that find_var() can search it directly.
+ * The pointers in it are absolute, so every process must map it at
+ * the address where it was built. Children forked after mu_freeze()
+ * inherit the mapping there anyway.
+ */
+#define FROZEN_MAGIC	"MUSLFRZ"
+#define FROZEN_ALIGN(n)	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct frozen_hdr {
+	char magic[8];
+	size_t size;	/* Of the whole mapping */
+	void *base;		/* The address it must be mapped at */
+	hash_table vars;
+};
+
+struct mu_frozen {
+	struct frozen_hdr *hdr;
+	int fd;
+};
+
+struct mu_frozen *mu_freeze(struct musl *m, const char *path) {
+	struct mu_frozen *f;
+	struct frozen_hdr *hdr;
+	struct var *v, *fv, **b;
+	unsigned int i, nb = HASH_SIZE;
+	size_t size, len;
+	char *p;
+	int fd;
+
+	while(nb < m->vars.n)
+		nb <<= 1;
+	size = FROZEN_ALIGN(sizeof *hdr) + nb * sizeof *b;
+	for(i = 0; i < m->vars.size; i++)
+		for(v = m->vars.b[i]; v; v = v->next) {
+			len = strlen(v->name) + 1;
+			if(v->type == mu_str)
+				len += strlen(v->v.s) + 1;
+			size += FROZEN_ALIGN(sizeof *fv) + FROZEN_ALIGN(len);
+		}
+
+	if(!(f = malloc(sizeof *f))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return NULL;
+	}
+	if(path)
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	else
+		fd = memfd_create("musl", MFD_CLOEXEC);
+	if(fd < 0 || ftruncate(fd, size) < 0
+		|| (hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Unable to create %s: %s",
+			path ? path : "frozen variables", strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		free(f);
+		return NULL;
+	}
+
+	memcpy(hdr->magic, FROZEN_MAGIC, sizeof hdr->magic);
+	hdr->size = size;
+	hdr->base = hdr;
+	b = (struct var **)((char *)hdr + FROZEN_ALIGN(sizeof *hdr));
+	p = (char *)(b + nb);
+	for(i = 0; i < m->vars.size; i++)
+		for(v = m->vars.b[i]; v; v = v->next) {
+			fv = (struct var *)p;
+			p += FROZEN_ALIGN(sizeof *fv);
+			len = strlen(v->name) + 1;
+			fv->name = memcpy(p, v->name, len);
+			fv->type = v->type;
+			if(v->type == mu_str) {
+				fv->v.s = memcpy(p + len, v->v.s, strlen(v->v.s) + 1);
+				len += strlen(v->v.s) + 1;
+			} else
+				fv->v.i = v->v.i;
+			p += FROZEN_ALIGN(len);
+			fv->hash = v->hash;
+			fv->next = b[v->hash & (nb - 1)];
+			b[v->hash & (nb - 1)] = fv;
+		}
+	hdr->vars.b = b;
+	hdr->vars.n = m->vars.n;
+	hdr->vars.size = nb;
+
+	mprotect(hdr, size, PROT_READ);
+	f->hdr = hdr;
+	f->fd = fd;
+	return f;
+}
+
+struct mu_frozen *mu_frozen_open(struct musl *m, const char *path) {
+	struct mu_frozen *f;
+	struct frozen_hdr hdr;
+	struct stat st;
+	void *addr = MAP_FAILED;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Unable to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if(pread(fd, &hdr, sizeof hdr, 0) != sizeof hdr || memcmp(hdr.magic, FROZEN_MAGIC, sizeof hdr.magic)
+		|| fstat(fd, &st) < 0 || (size_t)st.st_size != hdr.size) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "%s does not contain frozen variables", path);
+		close(fd);
+		return NULL;
+	}
+#ifdef MAP_FIXED_NOREPLACE
+	addr = mmap(hdr.base, hdr.size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+#else
+	addr = mmap(hdr.base, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+	if(addr != hdr.base) {
+		/* Older kernels treat the address as a hint */
+		if(addr != MAP_FAILED)
+			munmap(addr, hdr.size);
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Unable to map %s at %p", path, hdr.base);
+		close(fd);
+		return NULL;
+	}
+	if(!(f = malloc(sizeof *f))) {
+		munmap(addr, hdr.size);
+		close(fd);
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return NULL;
+	}
+	f->hdr = addr;
+	f->fd = fd;
+	return f;
+}
+
+void mu_attach_frozen(struct musl *m, const struct mu_frozen *f) {
+	m->frozen = f ? &f->hdr->vars : NULL;
+	m->var_epoch++;
+}
+
+void mu_frozen_close(struct mu_frozen *f) {
+	if(!f) return;
+	munmap(f->hdr, f->hdr->size);
+	close(f->fd);
+	free(f);
+}
+#endif
+
+/*
+ * External functions
+ */
+static void clear_func(struct var *v) {
+	if(v->type == mu_str)
+		free(v->v.sig);
+}
+
+/* Finds or adds the entry for a function in m->funcs */
+static struct var *func_entry(struct musl *m, const char *name) {
+	struct var *v = find_var(&m->funcs, name);
+	if(v) {
+		clear_func(v);
+		return v;
+	}
+	if(!(v = new_var(name))) return NULL;
+	if(!put_var(&m->funcs, v)) {
+		free_element(v, NULL);
+		return NULL;
+	}
+	/* Call sites may have found a function of the parent */
+	new_call_gen(m);
+	return v;
+}
+
+int mu_add_func(struct musl *m, const char *name, mu_func fun) {
+	struct var *v = func_entry(m, name);
+	if(!v) return 0;
+	v->type = mu_int;
+	v->v.fun = fun;
+	return 1;
+}
+
+/* Parses a signature like "s,i,i?->s" */
+static struct func_sig *parse_sig(const char *sig, mu_sig_func fun) {
+	struct func_sig *f = malloc(sizeof *f + strlen(sig));
+	int n = 0, optional = 0;
+	if(!f)
+		return NULL;
+	f->fun = fun;
+	f->min = 0;
+	f->max = 0;
+	f->ret = 0;
+	f->lenient = 0;
+	while(*sig == 'i' || *sig == 's') {
+		f->types[n++] = *sig++;
+		if(f->max < 0)
+			goto error;	/* Only the last type can repeat */
+		if(*sig == '*') {
+			f->max = -1;
+			sig++;
+		} else if(*sig == '?') {
+			optional = 1;
+			f->max++;
+			sig++;
+		} else if(optional)
+			goto error;
+		else {
+			f->min++;
+			f->max++;
+		}
+		if(*sig != ',')
+			break;
+		if(*++sig != 'i' && *sig != 's')
+			goto error;
+	}
+	f->types[n] = '\0';
+	if(sig[0] == '-' && sig[1] == '>' && (sig[2] == 'i' || sig[2] == 's')) {
+		f->ret = sig[2];
+		sig += 3;
+	}
+	if(*sig == '\0')
+		return f;
+error:
+	free(f);
+	return NULL;
+}
+
+int mu_add_func_sig(struct musl *m, const char *name, const char *sig, mu_sig_func fun) {
+	struct func_sig *f = parse_sig(sig, fun);
+	struct var *v;
+	if(!f)
+		return 0;
+	if(!(v = func_entry(m, name))) {
+		free(f);
+		return 0;
+	}
+	v->type = mu_str;
+	v->v.sig = f;
+	return 1;
+}
+
+int mu_par_int(struct musl *m, int n, int argc, struct mu_par argv[]) {
+	if(n >= argc)
+		mu_throw(m, "Too few parameters to function");
+	return par_as_int(&argv[n]);
+}
+
+const char *mu_par_str(struct musl *m, int n, int argc, struct mu_par argv[]) {
+	if(n >= argc)
+		mu_throw(m, "Too few parameters to function");
+	return par_as_str(&argv[n]);
+}
+
+int mu_valid_id(const char *id) {
+	if(!isalpha(id[0]))
+		return 0;
+	while(id[0])
+		if(!isalnum(id[0]) && !strchr("_$", id[0])) 
+			return 0;
+		else
+			id++;
+	return 1;
+}
+
+/*
+ * Standard functions
+ */
+
+/*2 Functions
+ *# These functions are available to {*Musl*} scripts.
+ *3 Built-In Functions
+ *# The Following built-in functions are available to all scripts.
+ *#
+ * When implementing your own functions, keep in mind that functions
+ * that return strings should allocate those strings on the heap,
+ * because Musl will call free() on them at a later stage.
+ */
+
+/*@ ##INT(x$)
+ *# Converts the string {{x$}} to a number. */
+static struct mu_par m_int(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = {mu_int, {argv[0].i}};
+	return rv;
+}
+
+/* Copies n characters of s into a new string */
+static struct mu_par new_str(struct musl *m, const char *s, size_t n) {
+	struct mu_par rv;
+	rv.type = mu_str;
+	rv.v.s = mu_alloc(m, n + 1);
+	memcpy(rv.v.s, s, n);
+	rv.v.s[n] = '\0';
+	return rv;
+}
+
+/*@ ##STR$(x)
+ *# Converts the number {{x}} to a string. */
+static struct mu_par m_str(struct musl *m, int argc, const struct mu_arg argv[]) {
+	return new_str(m, argv[0].s, argv[0].len);
+}
+
+/*@ ##ASC(a)
+ *# Returns the ASCII value of {{a}} 
+ *X ASC('A') = 65 
+ */
+static struct mu_par m_asc(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	rv.v.i = argv[0].s[0];
+	return rv;
+}
+
+/*@ ##CHR(v)
+ *# Returns the character associated with the ASCII value {{a}} 
+ *X CHR(66) = 'B' 
+ */
+static struct mu_par m_chr(struct musl *m, int argc, const struct mu_arg argv[]) {
+	char c = argv[0].i;
+	return new_str(m, &c, 1);
+}
+
+/*@ ##LEN(x$)
+ *# Returns the length of string {{x$}} */
+static struct mu_par m_len(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = {mu_int, {(int)argv[0].len}};
+	return rv;
+}
+
+/*@ ##LEFT$(s$, n)
+ *# Returns the {{n}} leftmost characters in {{s$}}
+ */
+static struct mu_par m_left(struct musl *m, int argc, const struct mu_arg argv[]) {
+	int len = argv[1].i;
+
+	if(len < 0)
+		mu_throw(m, "Invalid parameters to LEFT$()");
+
+	if(len > (int)argv[0].len)
+		len = argv[0].len;
+
+	return new_str(m, argv[0].s, len);
+}
+
+/*@ ##RIGHT$(s$, n)
+ *# Returns the {{n}} rightmost characters in {{s$}} */
+static struct mu_par m_right(struct musl *m, int argc, const struct mu_arg argv[]) {
+	int len = argv[1].i;
+
+	if(len < 0)
+		mu_throw(m, "Invalid parameters to RIGHT$()");
+
+	if(len > (int)argv[0].len)
+		len = argv[0].len;
+
+	return new_str(m, argv[0].s + argv[0].len - len, len);
+}
+
+/*@ ##MID$(s$, n, m)
+ *# Returns the all the characters in {{s$}} between {{n}} and {{m}} inclusive.\n
+ *# The string is indexed from 1, that is
+ *#     {{MID$("Hello World From Musl", 7, 11)}}
+ *# will return {{"World"}}
+ */
+static struct mu_par m_mid(struct musl *m, int argc, const struct mu_arg argv[]) {
+	int p = argv[1].i - 1;
+	int q = argv[2].i;
+	int len = q - p;
+
+	if(q < p || p < 0)
+		mu_throw(m, "Invalid parameters to MID$()");
+
+	if(p > (int)argv[0].len)
+		p = argv[0].len;
+	if(len > (int)argv[0].len - p)
+		len = argv[0].len - p;
+
+	return new_str(m, argv[0].s + p, len);
+}
+
+/*@ ##UCASE$(x$)
+ *# Converts the string {{x$}} to uppercase. */
+static struct mu_par m_ucase(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = new_str(m, argv[0].s, argv[0].len);
+	char *c;
+	for(c=rv.v.s;*c;c++)
+		*c = toupper(*c);
+	return rv;
+}
+
+/*@ ##LCASE$(x$)
+ *# Converts the string {{x$}} to lowercase. */
+static struct mu_par m_lcase(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = new_str(m, argv[0].s, argv[0].len);
+	char *c;
+	for(c=rv.v.s;*c;c++)
+		*c = tolower(*c);
+	return rv;
+}
+
+/*@ ##TRIM$(x$)
+ *# Removes leading and trailing whitespace from string {{x$}}. */
+static struct mu_par m_trim(struct musl *m, int argc, const struct mu_arg argv[]) {
+	const char *s = argv[0].s, *e = s + argv[0].len;
+
+	while(isspace(s[0])) s++;
+	while(e > s && isspace(e[-1])) e--;
+
+	return new_str(m, s, e - s);
+}
+
+/*@ ##INSTR(str$, find$)
+ *# Searches for {{find$}} in {{str$}} and returns the index.\n
+ *# It returns 0 if {{find$}} was not found.
+ */
+static struct mu_par m_instr(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	const char *x = strstr(argv[0].s, argv[1].s);
+	if(x)
+		rv.v.i = x - argv[0].s + 1;
+	return rv;
+}
+
+/*@ ##CONTAINS(str$, what$)
+ *# Searches {{str$}} for any of the characters in {{what$}}.\n
+ *# It returns 1 if {{str$}} contains an
+ *X IF CONTAINS(str$, "aeuio") THEN PRINT "String contains vowels"
+ */
+static struct mu_par m_contains(struct musl *m, int argc, const struct mu_arg argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	if(strpbrk(argv[0].s, argv[1].s))
+		rv.v.i = 1;
+	return rv;
+}
+
+/*@ ##IFF(cond, then_val, else_val)
+ *# If the condition {{cond}} is true, it returns {{then_val}},
+ *# otherwise it returns {{else_val}}
+ */
+static struct mu_par m_iff(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int res = mu_par_int(m, 0, argc, argv) ? 1 : 2;
+	rv = argv[res];
+	if(rv.type == mu_str) {
+		rv.v.s = strdup(rv.v.s);
+	}
+	return rv;
+}
+
+/*@ ##DATA(@list$, item1, item2, item3, ...)
+ *# Populates an array named {{list$}}.\n
+ *N The first parameter is a string containing the name of the array.
+ *# A call
+ *[
+ *# DATA(@array$, "Alice", "Bob", "Carol")
+ *]
+ *# is equivalent to the statements:
+ *[
+ *# LET array$[1] = "Alice"
+ *# LET array$[2] = "Bob"
+ *# LET array$[3] = "Carol"
+ *]
+ *# {{list$["length"]}} will contain the number of items in the array.\n
+ *# Subsequent calls to {{DATA()}} on the same array will append more data.\n
+ *# It returns the number of items inserted into the array.
+ */
+static struct mu_par m_data(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int i, idx;
+	char nbuf[TOK_SIZE], num[20], *name;
+	const char *aname;
+
 	if(argc < 1)
 		mu_throw(m, "DATA() must take at least one parameter");
 	aname = mu_par_str(m, 0, argc, argv);
 	if(!mu_valid_id(aname))
 		mu_throw(m, "DATA()'s first parameter must be a valid identifier");
 		
-	snprintf(name, TOK_SIZE, "%s[length]", aname);
+	name = arr_name(m, nbuf, sizeof nbuf, aname, "length");
 	idx = mu_get_int(m, name);
+	if(name != nbuf)
+		free(name);
 
 	for(i = 1; i < argc; i++) {
-		snprintf(name, TOK_SIZE, "%s[%d]", aname, ++idx);
+		sprintf(num, "%d", ++idx);
+		name = arr_name(m, nbuf, sizeof nbuf, aname, num);
 		if(!mu_set_str(m, name, mu_par_str(m, i, argc, argv)))
 			mu_throw(m, "Out of memory");
+		if(name != nbuf)
+			free(name);
+	}
+
+	name = arr_name(m, nbuf, sizeof nbuf, aname, "length");
+	if(!mu_set_int(m, name, idx))
+		mu_throw(m, "Out of memory");
+	if(name != nbuf)
+		free(name);
+
+	rv.v.i = idx;
+	return rv;
+}
+/*@ ##MAP(@mymap, key1, val1, key2, val2, ...)
+ *# Initializes {{mymap}} as an array of key-value pairs.\n
+ *# A call
+ *[
+ *# MAP(@mymap, "Alice", 111, "Bob", 222, "Carol", 333)
+ *]
+ *# is equivalent to the statements:
+ *[
+ *# LET mymap["Alice"] = 111
+ *# LET mymap["Bob"] = 222
+ *# LET mymap["Carol"] = 333
+ *]
+ */
+static struct mu_par m_map(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int i = 1;
+	char nbuf[TOK_SIZE], *name;
+	const char *aname;
+
+	if(argc < 1 || argc % 2 == 0)
+		mu_throw(m, "MAP() must take an odd number of parameters");
+	aname = mu_par_str(m, 0, argc, argv);
+	if(!mu_valid_id(aname))
+		mu_throw(m, "MAP()'s first parameter must be a valid identifier");
+		
+	while(i < argc) {
+		const char *key = mu_par_str(m, i++, argc, argv);
+		const char *val = mu_par_str(m, i++, argc, argv);
+		name = arr_name(m, nbuf, sizeof nbuf, aname, key);
+		if(!mu_set_str(m, name, val))
+			mu_throw(m, "Out of memory");
+		if(name != nbuf)
+			free(name);
+		rv.v.i++;
+	}
+	
+	return rv;
+}
+
+/*@ ##PUSH(val)
+ *# Pushes a value {{val}} onto an internal stack where it can be popped 
+ *# later through the {{~~POP()}} function.\n
+ *# It is used to simulate local variables in subroutines, although
+ *# {{LOCAL}} variables are cheaper.
+ *X PUSH(foo)
+ *N Don't access {{__stack[]}} and {{__sp}} directly.
+ */
+static struct mu_par m_push(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int sp = 1;
+	char name[TOK_SIZE];
+	
+	if(mu_has_var(m, "__sp")) {
+		sp = mu_get_int(m, "__sp") + 1;
+	}
+	snprintf(name, TOK_SIZE, "__stack[%d]", sp);
+	if(!mu_set_str(m, name, mu_par_str(m, 0, argc, argv)))
+		mu_throw(m, "Out of memory");
+	
+	mu_set_int(m, "__sp", sp);
+	
+	return rv;
+}
+
+/*@ ##POP([@val])
+ *# Pops a value from the stack that was pushed earlier through the
+ *# {{~~PUSH()}} function.
+ *X foo = POP()
+ *X POP @foo
+ */
+static struct mu_par m_pop(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_str, {0}};
+	int sp;
+	char name[TOK_SIZE];
+	
+	if(!mu_has_var(m, "__sp"))
+		mu_throw(m, "No stack pointer for POP()");
+		
+	sp = mu_get_int(m, "__sp");
+	if(sp <= 0)
+		mu_throw(m, "Stack underflow in POP()");
+	
+	snprintf(name, TOK_SIZE, "__stack[%d]", sp);
+	rv.v.s = strdup(mu_get_str(m, name));
+	
+	if(argc > 0) {
+		const char * name = mu_par_str(m, 0, argc, argv);
+		mu_set_str(m, name, rv.v.s);
+	}
+	
+	mu_set_int(m, "__sp", sp - 1);
+	
+	return rv;
+}
+
+/*@ ##ABORT([msg$])
+ *# Aborts the current program by throwing an error with the specified message.
+ */
+static struct mu_par m_abort(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	if(argc > 0) {
+		char *msg = (char*)mu_par_str(m, 0, argc, argv);	
+		mu_throw(m, "%s", msg);
+	} else {
+		mu_throw(m, "program aborted");
+	}
+	return rv;
+}
+
+/*@ ##PARMAP(@arr, label$, [@result])
+ *# Calls the subroutine at {{label$}} for each element of the array
+ *# {{arr}}, with the element's value and index as parameters, and
+ *# stores the values that it {{RETURN}}s in {{result}} (or back in
+ *# {{arr}} if {{result}} is omitted). {{arr}} must be indexed from 1 to
+ *# {{arr["length"]}}, as created by {{~~DATA()}}. For example:
+ *[
+ *# DATA(@list, 1, 2, 3)
+ *# PARMAP(@list, "square", @squares)
+ *# ...
+ *# square: LOCAL value, index
+ *# RETURN value * value
+ *]
+ *# The calls are divided between several threads (one per CPU by default;
+ *# see {{~~mu_set_limit()}}) if the interpreter was compiled with
+ *# {{WITH_THREADS}}. Each thread runs the subroutine in its own
+ *# context: It can read the global variables, but the global
+ *# variables that it assigns are private to the call and are discarded
+ *# when it returns, so the calls can not affect each other.
+ *# The results are stored in the order of the indexes. If calls fail,
+ *# the error of the one with the lowest index is reported.\n
+ *# External functions called by the subroutine may run on different
+ *# threads at the same time.\n
+ *# It returns the number of elements.
+ */
+struct parmap {
+	struct musl *m;	/* The interpreter that called PARMAP() */
+	const char *label;
+	struct mu_par *vals;	/* The elements, replaced by the results */
+	int n, next, stop;
+	int err_idx;	/* Lowest index that failed, or n */
+	char error_msg[MAX_ERROR_TEXT];
+#ifdef WITH_THREADS
+	pthread_mutex_t lock;	/* Protects err_idx and error_msg */
+#endif
+};
+
+/* Context for a PARMAP() thread */
+static struct musl *parmap_context(struct musl *m) {
+	struct musl *w = mu_create();
+	if(!w)
+		return NULL;
+	/* The functions are those of the parent, which may have replaced
+	 * the standard ones. */
+	clear_table(&w->funcs, clear_func);
+	w->parent = m;
+	w->script = m->script;
+	w->start = m->start;
+	w->user = m->user;
+	w->short_circuit = m->short_circuit;
+	w->gosub_max = m->gosub_max;
+	w->for_max = m->for_max;
+	w->max_threads = 1;	/* Nested PARMAP()s run on the same thread */
+	return w;
+}
+
+/* Calls the subroutine for element i in context w */
+static int parmap_call(struct parmap *p, struct musl *w, int i) {
+	struct args a;
+	struct mu_par value, index = {mu_int, {0}};
+
+	w->args_base = w->args;
+	if(setjmp(w->on_error) != 0) {
+		error_line(w);
+		pop_frames(w, 0);
+		w->for_sp = 0;
+		return 0;
+	}
+
+	/* Discard the previous call's global variables */
+	empty_table(&w->vars, clear_var);
+	w->var_epoch++;
+	w->for_sp = 0;
+	w->has_retval = 0;
+	w->active = 1;
+	w->depth = 0;
+
+	begin_args(w, &a);
+	value = p->vals[i];
+	p->vals[i].type = mu_int;	/* The frame owns the value now */
+	add_arg(w, &a, value);
+	index.v.i = i + 1;
+	add_arg(w, &a, index);
+	push_frame(w, NULL, &a);
+	end_args(w, &a);
+
+	w->s = p->label;
+	w->last = NULL;
+	program(w);
+	pop_frames(w, 0);
+
+	if(w->has_retval) {
+		p->vals[i] = w->retval;
+		w->has_retval = 0;
+	} else {
+		p->vals[i].type = mu_str;
+		if(!(p->vals[i].v.s = strdup(""))) {
+			snprintf(w->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Takes elements until they are all done or a call failed */
+static void parmap_worker(struct parmap *p, struct musl *w) {
+	int i;
+	while(!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)
+			&& (i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n) {
+		if(!parmap_call(p, w, i)) {
+			__atomic_store_n(&p->stop, 1, __ATOMIC_RELAXED);
+			/* Elements are taken in order, so the
+			 * ones before i will all be finished */
+#ifdef WITH_THREADS
+			pthread_mutex_lock(&p->lock);
+#endif
+			if(i < p->err_idx) {
+				p->err_idx = i;
+				strcpy(p->error_msg, w->error_msg);
+			}
+#ifdef WITH_THREADS
+			pthread_mutex_unlock(&p->lock);
+#endif
+			return;
+		}
+	}
+}
+
+#ifdef WITH_THREADS
+struct parmap_thread {
+	struct parmap *p;
+	struct musl *w;
+	pthread_t th;
+};
+
+static void *parmap_thread(void *arg) {
+	struct parmap_thread *t = arg;
+	parmap_worker(t->p, t->w);
+	return NULL;
+}
+
+static int parmap_threads(struct musl *m, int n) {
+	int t = m->max_threads;
+	if(t <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		t = cpus > 0 ? (int)cpus : 1;
+	}
+	return t < n ? t : n;
+}
+#endif
+
+/* Runs the calls on the calling thread and up to nt - 1 more threads */
+static int parmap_run(struct parmap *p, int nt) {
+	struct musl *w;
+#ifdef WITH_THREADS
+	struct parmap_thread *ts = NULL;
+	int i, started = 0;
+
+	if(nt > 1 && (ts = calloc(nt - 1, sizeof *ts)) != NULL) {
+		for(; started < nt - 1; started++) {
+			ts[started].p = p;
+			if(!(ts[started].w = parmap_context(p->m)))
+				break;
+			if(pthread_create(&ts[started].th, NULL, parmap_thread, &ts[started]) != 0) {
+				mu_cleanup(ts[started].w);
+				break;
+			}
+		}
+	}
+#endif
+	if((w = parmap_context(p->m)) != NULL) {
+		parmap_worker(p, w);
+		mu_cleanup(w);
+	}
+#ifdef WITH_THREADS
+	for(i = 0; i < started; i++) {
+		pthread_join(ts[i].th, NULL);
+		mu_cleanup(ts[i].w);
+	}
+	free(ts);
+	if(!w && !started)
+		return 0;
+#else
+	if(!w)
+		return 0;
+#endif
+	return 1;
+}
+
+static struct mu_par m_parmap(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	struct parmap p;
+	struct var *v;
+	const char *aname, *rname;
+	char nbuf[TOK_SIZE], num[20], *name;
+	int i, nt = 1, ok;
+
+	aname = mu_par_str(m, 0, argc, argv);
+	if(!mu_valid_id(aname))
+		mu_throw(m, "PARMAP()'s first parameter must be a valid identifier");
+	if(!(v = find_var(&m->script->labels, mu_par_str(m, 1, argc, argv))))
+		mu_throw(m, "PARMAP() to undefined label '%s'", mu_par_str(m, 1, argc, argv));
+	rname = argc > 2 ? mu_par_str(m, 2, argc, argv) : aname;
+	if(!mu_valid_id(rname))
+		mu_throw(m, "PARMAP()'s third parameter must be a valid identifier");
+
+	p.m = m;
+	p.label = v->v.c;
+	p.next = p.stop = 0;
+	name = arr_name(m, nbuf, sizeof nbuf, aname, "length");
+	p.n = mu_get_int(m, name);
+	if(name != nbuf)
+		free(name);
+	if(p.n < 0)
+		p.n = 0;
+	p.err_idx = p.n;
+
+	/* Collect the elements, so that the threads don't look them up */
+	if(!(p.vals = calloc(p.n + 1, sizeof *p.vals)))
+		mu_throw(m, "Out of memory");
+	for(i = 0; i < p.n; i++) {
+		sprintf(num, "%d", i + 1);
+		name = arr_name(m, nbuf, sizeof nbuf, aname, num);
+		v = get_var(m, name);
+		if(name != nbuf)
+			free(name);
+		if(v && v->type == mu_int) {
+			p.vals[i].type = mu_int;
+			p.vals[i].v.i = v->v.i;
+		} else {
+			p.vals[i].type = mu_str;
+			if(!(p.vals[i].v.s = strdup(v ? v->v.s : "")))
+				break;
+		}
+	}
+	ok = i == p.n;
+
+#ifdef WITH_THREADS
+	nt = parmap_threads(m, p.n);
+	pthread_mutex_init(&p.lock, NULL);
+#endif
+	if(ok && !parmap_run(&p, nt))
+		ok = 0;
+#ifdef WITH_THREADS
+	pthread_mutex_destroy(&p.lock);
+#endif
+
+	/* Store the results in index order */
+	for(i = 0; ok && p.err_idx == p.n && i < p.n; i++) {
+		sprintf(num, "%d", i + 1);
+		name = arr_name(m, nbuf, sizeof nbuf, rname, num);
+		if(p.vals[i].type == mu_int)
+			ok = mu_set_int(m, name, p.vals[i].v.i);
+		else
+			ok = mu_set_str(m, name, p.vals[i].v.s);
+		if(name != nbuf)
+			free(name);
+	}
+	for(i = 0; i < p.n; i++)
+		if(p.vals[i].type == mu_str)
+			free(p.vals[i].v.s);
+	free(p.vals);
+
+	if(!ok)
+		mu_throw(m, "Out of memory");
+	if(p.err_idx < p.n)
+		mu_throw(m, "%s (in PARMAP() element %d)", p.error_msg, p.err_idx + 1);
+
+	if(rname != aname) {
+		name = arr_name(m, nbuf, sizeof nbuf, rname, "length");
+		ok = mu_set_int(m, name, p.n);
+		if(name != nbuf)
+			free(name);
+		if(!ok)
+			mu_throw(m, "Out of memory");
+	}
+	rv.v.i = p.n;
+	return rv;
+}
+
+/*
+ * Array aggregates
+ *
+ * The elements of an array are looked up once in C and the values
+ * are then processed in plain C arrays, instead of the script looping
+ * over the elements itself. Large arrays are looked up on several
+ * threads; the variables are not modified while that happens.
+ */
+
+/* Arrays with at least this many elements are looked up on several threads */
+#define ARR_THREAD_MIN	10000
+
+struct arr_scan {
+	const struct musl *m;
+	const char *aname;
+	struct var **elems;
+	int from, to;
+	char *buf;	/* Room for "aname[index]" */
+#ifdef WITH_THREADS
+	pthread_t th;
+#endif
+};
+
+static void *arr_lookup(void *arg) {
+	struct arr_scan *a = arg;
+	int i;
+	for(i = a->from; i < a->to; i++) {
+		sprintf(a->buf, "%s[%d]", a->aname, i + 1);
+		a->elems[i] = get_var(a->m, a->buf);
+	}
+	return NULL;
+}
+
+/* Looks up the elements arr[1] to arr[length] of the array named by
+ * argv[0]. Elements that don't exist are NULL. */
+static struct var **arr_elements(struct musl *m, const char *fname, int argc, struct mu_par argv[], int *n) {
+	struct arr_scan *a;
+	struct var **elems;
+	const char *aname;
+	char nbuf[TOK_SIZE], *name;
+	int i, nt = 1, ok = 1;
+
+	aname = mu_par_str(m, 0, argc, argv);
+	if(!mu_valid_id(aname))
+		mu_throw(m, "%s()'s first parameter must be a valid identifier", fname);
+	name = arr_name(m, nbuf, sizeof nbuf, aname, "length");
+	*n = mu_get_int(m, name);
+	if(name != nbuf)
+		free(name);
+	if(*n < 0)
+		*n = 0;
+
+#ifdef WITH_THREADS
+	if(*n >= ARR_THREAD_MIN)
+		nt = parmap_threads(m, *n / (ARR_THREAD_MIN / 2));
+#endif
+	elems = mu_alloc(m, (*n + 1) * sizeof *elems);
+	if(!(a = calloc(nt, sizeof *a))) {
+		free(elems);
+		mu_throw(m, "Out of memory");
+	}
+	for(i = 0; i < nt; i++) {
+		a[i].m = m;
+		a[i].aname = aname;
+		a[i].elems = elems;
+		a[i].from = (int)((long long)*n * i / nt);
+		a[i].to = (int)((long long)*n * (i + 1) / nt);
+		if(!(a[i].buf = malloc(strlen(aname) + 24)))
+			ok = 0;
+	}
+	if(ok) {
+#ifdef WITH_THREADS
+		int started;
+		for(started = 1; started < nt; started++)
+			if(pthread_create(&a[started].th, NULL, arr_lookup, &a[started]) != 0)
+				break;
+		arr_lookup(&a[0]);
+		/* Any parts whose thread couldn't be started are done here */
+		for(i = started; i < nt; i++)
+			arr_lookup(&a[i]);
+		for(i = 1; i < started; i++)
+			pthread_join(a[i].th, NULL);
+#else
+		arr_lookup(&a[0]);
+#endif
+	}
+	for(i = 0; i < nt; i++)
+		free(a[i].buf);
+	free(a);
+	if(!ok) {
+		free(elems);
+		mu_throw(m, "Out of memory");
 	}
+	return elems;
+}
 
-	snprintf(name, TOK_SIZE, "%s[length]", aname);
-	if(!mu_set_int(m, name, idx))
+/* Gets the values of an array as integers */
+static int *arr_ints(struct musl *m, const char *fname, int argc, struct mu_par argv[], int *n) {
+	struct var **elems = arr_elements(m, fname, argc, argv, n);
+	int i, *vals = malloc((*n + 1) * sizeof *vals);
+	if(vals) {
+		for(i = 0; i < *n; i++) {
+			const struct var *v = elems[i];
+			vals[i] = !v ? 0 : v->type == mu_int ? v->v.i : atoi(v->v.s);
+		}
+	}
+	free(elems);
+	if(!vals)
 		mu_throw(m, "Out of memory");
+	return vals;
+}
 
-	rv.v.i = idx;
-	return rv;
+/* These loops are kept simple so that the compiler can vectorize them */
+static int sum_ints(const int *vals, int n) {
+	unsigned int sum = 0;	/* Overflow wraps around */
+	int i;
+	for(i = 0; i < n; i++)
+		sum += (unsigned int)vals[i];
+	return (int)sum;
 }
-/*@ ##MAP(@mymap, key1, val1, key2, val2, ...)
- *# Initializes {{mymap}} as an array of key-value pairs.\n
- *# A call
- *[
- *# MAP(@mymap, "Alice", 111, "Bob", 222, "Carol", 333)
- *]
- *# is equivalent to the statements:
- *[
- *# LET mymap["Alice"] = 111
- *# LET mymap["Bob"] = 222
- *# LET mymap["Carol"] = 333
- *]
+
+static int min_ints(const int *vals, int n) {
+	int i, r = vals[0];
+	for(i = 1; i < n; i++)
+		r = vals[i] < r ? vals[i] : r;
+	return r;
+}
+
+static int max_ints(const int *vals, int n) {
+	int i, r = vals[0];
+	for(i = 1; i < n; i++)
+		r = vals[i] > r ? vals[i] : r;
+	return r;
+}
+
+/*@ ##SUM(@arr)
+ *# Returns the sum of the elements {{arr[1]}} to {{arr[arr["length"]]}}
+ *# of an array created by {{~~DATA()}}.\n
+ *# Elements are converted to integers, and missing elements count as 0.
+ *X total = SUM(@prices)
  */
-static struct mu_par m_map(struct musl *m, int argc, struct mu_par argv[]) {
+static struct mu_par m_sum(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {0}};
-	int i = 1;
-	char name[TOK_SIZE];
-	const char *aname;
+	int n, *vals = arr_ints(m, "SUM", argc, argv, &n);
+	rv.v.i = sum_ints(vals, n);
+	free(vals);
+	return rv;
+}
 
-	if(argc < 1 || argc % 2 == 0)
-		mu_throw(m, "MAP() must take an odd number of parameters");
-	aname = mu_par_str(m, 0, argc, argv);
-	if(!mu_valid_id(aname))
-		mu_throw(m, "MAP()'s first parameter must be a valid identifier");
-		
-	while(i < argc) {
-		const char *key = mu_par_str(m, i++, argc, argv);
-		const char *val = mu_par_str(m, i++, argc, argv);
-		snprintf(name, TOK_SIZE, "%s[%s]", aname, key);
-		if(!mu_set_str(m, name, val))
-			mu_throw(m, "Out of memory");
-		rv.v.i++;
-	}
-	
+/*@ ##MINV(@arr)
+ *# Returns the smallest of the elements of the array {{arr}}, compared
+ *# as integers. It is an error if the array is empty.
+ */
+static struct mu_par m_minv(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int n, *vals = arr_ints(m, "MINV", argc, argv, &n);
+	if(n > 0)
+		rv.v.i = min_ints(vals, n);
+	free(vals);
+	if(n == 0)
+		mu_throw(m, "MINV() of an empty array");
 	return rv;
 }
 
-/*@ ##PUSH(val)
- *# Pushes a value {{val}} onto an internal stack where it can be popped 
- *# later through the {{~~POP()}} function.\n
- *# It is used to simulate local variables in subroutines.
- *X PUSH(foo)
- *N Don't access {{__stack[]}} and {{__sp}} directly.
+/*@ ##MAXV(@arr)
+ *# Returns the largest of the elements of the array {{arr}}, compared
+ *# as integers. It is an error if the array is empty.
  */
-static struct mu_par m_push(struct musl *m, int argc, struct mu_par argv[]) {
+static struct mu_par m_maxv(struct musl *m, int argc, struct mu_par argv[]) {
 	struct mu_par rv = {mu_int, {0}};
-	int sp = 1;
-	char name[TOK_SIZE];
-	
-	if(mu_has_var(m, "__sp")) {
-		sp = mu_get_int(m, "__sp") + 1;
-	}
-	snprintf(name, TOK_SIZE, "__stack[%d]", sp);
-	if(!mu_set_str(m, name, mu_par_str(m, 0, argc, argv)))
-		mu_throw(m, "Out of memory");
-	
-	mu_set_int(m, "__sp", sp);
-	
+	int n, *vals = arr_ints(m, "MAXV", argc, argv, &n);
+	if(n > 0)
+		rv.v.i = max_ints(vals, n);
+	free(vals);
+	if(n == 0)
+		mu_throw(m, "MAXV() of an empty array");
 	return rv;
 }
 
-/*@ ##POP([@val])
- *# Pops a value from the stack that was pushed earlier through the
- *# {{~~PUSH()}} function.
- *X foo = POP()
- *X POP @foo
+/*@ ##COUNTIF(@arr, op$, value)
+ *# Returns the number of elements {{e}} of the array {{arr}} for
+ *# which {{e op$ value}} is true. {{op$}} is one of
+ *# {{"="}}, {{"<>"}}, {{"<"}}, {{">"}}, {{"<="}} or {{">="}}.\n
+ *# If {{value}} is a number the elements are converted to integers
+ *# and compared as numbers (the elements that {{~~DATA()}} stores are
+ *# strings), otherwise they are compared as strings.
+ *X PRINT COUNTIF(@scores, ">=", 50), " passed"
  */
-static struct mu_par m_pop(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_str, {0}};
-	int sp;
-	char name[TOK_SIZE];
-	
-	if(!mu_has_var(m, "__sp"))
-		mu_throw(m, "No stack pointer for POP()");
-		
-	sp = mu_get_int(m, "__sp");
-	if(sp <= 0)
-		mu_throw(m, "Stack underflow in POP()");
-	
-	snprintf(name, TOK_SIZE, "__stack[%d]", sp);
-	rv.v.s = strdup(mu_get_str(m, name));
-	
-	if(argc > 0) {
-		const char * name = mu_par_str(m, 0, argc, argv);
-		mu_set_str(m, name, rv.v.s);
+static struct mu_par m_countif(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	struct var **elems;
+	const char *op = mu_par_str(m, 1, argc, argv), *val;
+	char num[20];
+	int i, n, r, x, ival, lt, eq, gt, numeric;
+
+	if(!strcmp(op, "=")) {
+		lt = 0; eq = 1; gt = 0;
+	} else if(!strcmp(op, "<>")) {
+		lt = 1; eq = 0; gt = 1;
+	} else if(!strcmp(op, "<")) {
+		lt = 1; eq = 0; gt = 0;
+	} else if(!strcmp(op, ">")) {
+		lt = 0; eq = 0; gt = 1;
+	} else if(!strcmp(op, "<=")) {
+		lt = 1; eq = 1; gt = 0;
+	} else if(!strcmp(op, ">=")) {
+		lt = 0; eq = 1; gt = 1;
+	} else
+		mu_throw(m, "COUNTIF() with unknown operator '%s'", op);
+	numeric = argc > 2 && argv[2].type == mu_int;
+	ival = numeric ? argv[2].v.i : 0;
+	val = mu_par_str(m, 2, argc, argv);
+
+	elems = arr_elements(m, "COUNTIF", argc, argv, &n);
+	for(i = 0; i < n; i++) {
+		const struct var *v = elems[i];
+		if(numeric) {
+			x = !v ? 0 : v->type == mu_int ? v->v.i : atoi(v->v.s);
+			r = (x > ival) - (x < ival);
+		} else if(v && v->type == mu_int) {
+			sprintf(num, "%d", v->v.i);
+			r = strcmp(num, val);
+		} else
+			r = strcmp(v ? v->v.s : "", val);
+		if(r < 0 ? lt : r > 0 ? gt : eq)
+			rv.v.i++;
 	}
-	
-	mu_set_int(m, "__sp", sp - 1);
-	
+	free(elems);
 	return rv;
 }
 
-/*@ ##ABORT([msg$])
- *# Aborts the current program by throwing an error with the specified message.
+/*@ ##JOIN$(@arr, [sep$])
+ *# Returns the elements of the array {{arr}} concatenated, with
+ *# {{sep$}} (if given) between them.
+ *X PRINT JOIN$(@names, ", ")
  */
-static struct mu_par m_abort(struct musl *m, int argc, struct mu_par argv[]) {
-	struct mu_par rv = {mu_int, {0}};
-	if(argc > 0) {
-		char *msg = (char*)mu_par_str(m, 0, argc, argv);	
-		mu_throw(m, "%s", msg);
-	} else {
-		mu_throw(m, "program aborted");
+static struct mu_par m_join(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_str, {0}};
+	struct var **elems;
+	const char *sep = argc > 1 ? mu_par_str(m, 1, argc, argv) : "";
+	char num[20], *p;
+	size_t len = 0, slen = strlen(sep);
+	int i, n;
+
+	elems = arr_elements(m, "JOIN$", argc, argv, &n);
+	for(i = 0; i < n; i++) {
+		const struct var *v = elems[i];
+		if(v && v->type == mu_int)
+			len += sprintf(num, "%d", v->v.i);
+		else if(v)
+			len += strlen(v->v.s);
+		if(i > 0)
+			len += slen;
+	}
+	if(!(rv.v.s = malloc(len + 1))) {
+		free(elems);
+		mu_throw(m, "Out of memory");
+	}
+	for(i = 0, p = rv.v.s; i < n; i++) {
+		const struct var *v = elems[i];
+		if(i > 0) {
+			memcpy(p, sep, slen);
+			p += slen;
+		}
+		if(v && v->type == mu_int)
+			p += sprintf(p, "%d", v->v.i);
+		else if(v) {
+			len = strlen(v->v.s);
+			memcpy(p, v->v.s, len);
+			p += len;
+		}
 	}
+	*p = '\0';
+	free(elems);
 	return rv;
 }
 
+/* Adds a built-in function with a signature. Unlike other functions
+ * with signatures, it ignores surplus arguments and only reports
+ * missing ones when it is called, as the built-ins always did */
+static int add_builtin(struct musl *m, const char *name, const char *sig, mu_sig_func fun) {
+	if(!mu_add_func_sig(m, name, sig, fun))
+		return 0;
+	find_var(&m->funcs, name)->v.sig->lenient = 1;
+	return 1;
+}
+
 /* Adds the standard functions to the interpreter */
 static int add_stdfuns(struct musl *m) {
-	return !(!mu_add_func(m, "int", m_int) ||
-		!mu_add_func(m, "str$", m_str) ||
-		!mu_add_func(m, "asc", m_asc) ||
-		!mu_add_func(m, "chr", m_chr) ||
-		!mu_add_func(m, "len", m_len) ||
-		!mu_add_func(m, "left$", m_left) ||
-		!mu_add_func(m, "right$", m_right)||
-		!mu_add_func(m, "mid$", m_mid)||
-		!mu_add_func(m, "ucase$", m_ucase)||
-		!mu_add_func(m, "lcase$", m_lcase)||
-		!mu_add_func(m, "trim$", m_trim)||
-		!mu_add_func(m, "instr", m_instr)||
-		!mu_add_func(m, "contains", m_contains)||
+	return !(!add_builtin(m, "int", "i->i", m_int) ||
+		!add_builtin(m, "str$", "s->s", m_str) ||
+		!add_builtin(m, "asc", "s->i", m_asc) ||
+		!add_builtin(m, "chr", "i->s", m_chr) ||
+		!add_builtin(m, "len", "s->i", m_len) ||
+		!add_builtin(m, "left$", "s,i->s", m_left) ||
+		!add_builtin(m, "right$", "s,i->s", m_right)||
+		!add_builtin(m, "mid$", "s,i,i->s", m_mid)||
+		!add_builtin(m, "ucase$", "s->s", m_ucase)||
+		!add_builtin(m, "lcase$", "s->s", m_lcase)||
+		!add_builtin(m, "trim$", "s->s", m_trim)||
+		!add_builtin(m, "instr", "s,s->i", m_instr)||
+		!add_builtin(m, "contains", "s,s->i", m_contains)||
 		!mu_add_func(m, "iff", m_iff)||
 		!mu_add_func(m, "data", m_data)||
 		!mu_add_func(m, "map", m_map)||
 		!mu_add_func(m, "push", m_push)||
 		!mu_add_func(m, "pop", m_pop) ||
-		!mu_add_func(m, "abort", m_abort)
+		!mu_add_func(m, "abort", m_abort) ||
+		!mu_add_func(m, "parmap", m_parmap) ||
+		!mu_add_func(m, "sum", m_sum) ||
+		!mu_add_func(m, "minv", m_minv) ||
+		!mu_add_func(m, "maxv", m_maxv) ||
+		!mu_add_func(m, "countif", m_countif) ||
+		!mu_add_func(m, "join$", m_join) ||
+		!mu_add_func(m, "chan_send", m_chan_send) ||
+		!mu_add_func(m, "chan_recv$", m_chan_recv) ||
+		!mu_add_func(m, "chan_close", m_chan_close)
 		);
 }
+
+#ifdef WITH_THREADS
+/*
+ * Scheduler
+ *
+ * Each worker thread has its own run queue. A worker takes tasks from
+ * the front of its own queue, and when it is empty it steals from the
+ * back of the other workers' queues. Tasks that called SLEEP() are kept
+ * in a heap ordered by their wake-up time that is shared by the workers.
+ *
+ * Every queue and the heap have room for all the live tasks (reserved
+ * in mu_sched_spawn()), so a task can always be requeued.
+ */
+struct mu_task {
+	struct mu_sched *s;
+	struct musl *m;
+	const struct mu_script *sc;
+	int started;
+	long long wake;	/* Wake-up time in ms, or 0 */
+	mu_sched_done done;
+	void *data;
+
+	/* An asynchronous call may complete on another thread before
+	 * the worker has parked the task, so the result is kept here
+	 * until the task runs again. */
+	int state;
+	struct mu_par result;
+};
+
+#define TASK_RUNNING	0
+#define TASK_PARKED		1	/* Waiting for mu_complete() */
+#define TASK_COMPLETED	2	/* mu_complete() was called */
+
+struct run_queue {
+	pthread_mutex_t lock;
+	struct mu_task **q;	/* Ring buffer */
+	int head, n, size;
+};
+
+struct worker {
+	struct mu_sched *s;
+	int id;
+};
+
+struct mu_sched {
+	struct run_queue *queues;
+	int nworkers, slice;
+	unsigned int next;	/* Queue for the next spawned task */
+	int live;	/* Tasks that have not finished */
+	int idle;	/* Workers waiting for the condition */
+
+	/* Protects the heap and the condition */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mu_task **heap;
+	int nheap, heap_size;
+	long long next_wake;	/* Wake-up time of heap[0] */
+};
+
+#define NEVER	0x7FFFFFFFFFFFFFFFLL
+
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int rq_reserve(struct run_queue *rq, int n) {
+	struct mu_task **q;
+	int i;
+	if(n <= rq->size)
+		return 1;
+	if(n < rq->size * 2)
+		n = rq->size * 2;
+	if(n < STACK_SIZE)
+		n = STACK_SIZE;
+	if(!(q = malloc(n * sizeof *q)))
+		return 0;
+	for(i = 0; i < rq->n; i++)
+		q[i] = rq->q[(rq->head + i) % rq->size];
+	free(rq->q);
+	rq->q = q;
+	rq->head = 0;
+	rq->size = n;
+	return 1;
+}
+
+/* Wakes a waiting worker, if there is one */
+static void sched_notify(struct mu_sched *s) {
+	if(__atomic_load_n(&s->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void rq_push(struct run_queue *rq, struct mu_task *t) {
+	pthread_mutex_lock(&rq->lock);
+	rq->q[(rq->head + rq->n) % rq->size] = t;
+	__atomic_store_n(&rq->n, rq->n + 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&rq->lock);
+}
+
+/* Takes a task from the front of the queue, or the back if steal is set */
+static struct mu_task *rq_pop(struct run_queue *rq, int steal) {
+	struct mu_task *t = NULL;
+	if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+		return NULL;
+	pthread_mutex_lock(&rq->lock);
+	if(rq->n > 0) {
+		if(steal)
+			t = rq->q[(rq->head + rq->n - 1) % rq->size];
+		else {
+			t = rq->q[rq->head];
+			rq->head = (rq->head + 1) % rq->size;
+		}
+		__atomic_store_n(&rq->n, rq->n - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&rq->lock);
+	return t;
+}
+
+static struct mu_task *steal(struct mu_sched *s, int id) {
+	struct mu_task *t;
+	int i;
+	for(i = 1; i < s->nworkers; i++)
+		if((t = rq_pop(&s->queues[(id + i) % s->nworkers], 1)) != NULL)
+			return t;
+	return NULL;
+}
+
+static int has_work(struct mu_sched *s) {
+	int i;
+	for(i = 0; i < s->nworkers; i++)
+		if(__atomic_load_n(&s->queues[i].n, __ATOMIC_SEQ_CST) > 0)
+			return 1;
+	return 0;
+}
+
+/* The heap functions must be called with s->lock held */
+static void heap_push(struct mu_sched *s, struct mu_task *t) {
+	int i = s->nheap++, p;
+	while(i > 0 && s->heap[p = (i - 1) / 2]->wake > t->wake) {
+		s->heap[i] = s->heap[p];
+		i = p;
+	}
+	s->heap[i] = t;
+	__atomic_store_n(&s->next_wake, s->heap[0]->wake, __ATOMIC_RELAXED);
+}
+
+static struct mu_task *heap_pop(struct mu_sched *s) {
+	struct mu_task *top = s->heap[0], *t = s->heap[--s->nheap];
+	int i = 0, c;
+	while((c = 2 * i + 1) < s->nheap) {
+		if(c + 1 < s->nheap && s->heap[c + 1]->wake < s->heap[c]->wake)
+			c++;
+		if(t->wake <= s->heap[c]->wake)
+			break;
+		s->heap[i] = s->heap[c];
+		i = c;
+	}
+	s->heap[i] = t;
+	__atomic_store_n(&s->next_wake, s->nheap ? s->heap[0]->wake : NEVER, __ATOMIC_RELAXED);
+	return top;
+}
+
+/* Moves the tasks whose SLEEP() has expired to the run queue rq */
+static void wake_sleepers(struct mu_sched *s, struct run_queue *rq) {
+	long long now;
+	int n = 0;
+	if(__atomic_load_n(&s->next_wake, __ATOMIC_RELAXED) > (now = now_ms()))
+		return;
+	pthread_mutex_lock(&s->lock);
+	while(s->nheap > 0 && s->heap[0]->wake <= now) {
+		struct mu_task *t = heap_pop(s);
+		t->wake = 0;
+		rq_push(rq, t);
+		n++;
+	}
+	if(n > 1 && s->idle > 0)
+		pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Returns 0 when all the tasks are done */
+static int wait_for_work(struct mu_sched *s) {
+	int rv;
+	pthread_mutex_lock(&s->lock);
+	__atomic_add_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&s->live, __ATOMIC_SEQ_CST) > 0 && !has_work(s)) {
+		if(s->nheap > 0) {
+			struct timespec ts;
+			long long wake = s->heap[0]->wake;
+			if(wake <= now_ms())
+				break;
+			ts.tv_sec = wake / 1000;
+			ts.tv_nsec = (wake % 1000) * 1000000;
+			pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+		} else
+			pthread_cond_wait(&s->cond, &s->lock);
+	}
+	__atomic_sub_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+	rv = __atomic_load_n(&s->live, __ATOMIC_SEQ_CST) > 0;
+	pthread_mutex_unlock(&s->lock);
+	return rv;
+}
+
+/* Adds a task to one of the queues */
+static void sched_push(struct mu_sched *s, struct mu_task *t) {
+	int i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED) % s->nworkers;
+	rq_push(&s->queues[i], t);
+	sched_notify(s);
+}
+
+static void run_task(struct mu_sched *s, struct run_queue *rq, struct mu_task *t) {
+	struct musl *m = t->m;
+	int rv;
+
+	if(__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == TASK_COMPLETED) {
+		t->state = TASK_RUNNING;
+		rv = finish_call(m, t->result);
+		if(t->result.type == mu_str)
+			free(t->result.v.s);
+		rv = rv ? mu_resume(m, s->slice) : 0;
+	} else if(t->started)
+		rv = mu_resume(m, s->slice);
+	else {
+		t->started = 1;
+		rv = mu_exec_budget(m, t->sc, s->slice);
+	}
+
+	if(rv == MU_SUSPENDED) {
+		if(t->wake > now_ms()) {
+			pthread_mutex_lock(&s->lock);
+			heap_push(s, t);
+			if(s->idle > 0)
+				pthread_cond_signal(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+		} else {
+			t->wake = 0;
+			rq_push(rq, t);
+			sched_notify(s);
+		}
+		return;
+	} else if(rv == MU_PENDING) {
+		if(__atomic_exchange_n(&t->state, TASK_PARKED, __ATOMIC_ACQ_REL) == TASK_COMPLETED) {
+			t->state = TASK_COMPLETED;
+			rq_push(rq, t);
+		}
+		return;
+	}
+
+	m->task = NULL;
+	if(t->done)
+		t->done(m, rv, t->data);
+	free(t);
+	if(__atomic_sub_fetch(&s->live, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void *worker(void *arg) {
+	struct worker *w = arg;
+	struct mu_sched *s = w->s;
+	struct run_queue *rq = &s->queues[w->id];
+	struct mu_task *t;
+
+	for(;;) {
+		wake_sleepers(s, rq);
+		if(!(t = rq_pop(rq, 0)) && !(t = steal(s, w->id))) {
+			if(!wait_for_work(s))
+				break;
+			continue;
+		}
+		run_task(s, rq, t);
+	}
+	return NULL;
+}
+
+struct mu_sched *mu_sched_create(int nworkers, int slice) {
+	struct mu_sched *s;
+	pthread_condattr_t attr;
+	int i;
+
+	if(nworkers < 1)
+		nworkers = 1;
+	if(!(s = malloc(sizeof *s)))
+		return NULL;
+	if(!(s->queues = calloc(nworkers, sizeof *s->queues))) {
+		free(s);
+		return NULL;
+	}
+	for(i = 0; i < nworkers; i++)
+		pthread_mutex_init(&s->queues[i].lock, NULL);
+	s->nworkers = nworkers;
+	s->slice = slice > 0 ? slice : SCHED_SLICE;
+	s->next = 0;
+	s->live = 0;
+	s->idle = 0;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	s->heap = NULL;
+	s->nheap = s->heap_size = 0;
+	s->next_wake = NEVER;
+	return s;
+}
+
+static void yield(struct musl *m) {
+	/* Use up the budget so that the script is
+	suspended at the end of the statement */
+	m->preempt = 1;
+	m->budget = 0;
+}
+
+/*@ ##SLEEP(ms)
+ *# Suspends the script for {{ms}} milliseconds.\n
+ *# The worker thread runs other scripts in the meantime.\n
+ *# {{SLEEP()}} and {{YIELD()}} are only available to scripts
+ *# run through a {{~~mu_sched}}. Inside a subroutine called
+ *# from an expression the script is suspended once the
+ *# subroutine returns.
+ */
+static struct mu_par m_sleep(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int ms = mu_par_int(m, 0, argc, argv);
+	if(m->task) {
+		m->task->wake = now_ms() + (ms > 0 ? ms : 0);
+		yield(m);
+	}
+	return rv;
+}
+
+/*@ ##YIELD()
+ *# Lets the worker thread run other scripts before this one continues.
+ */
+static struct mu_par m_yield(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	if(m->task)
+		yield(m);
+	return rv;
+}
+
+static int grow_heap(struct mu_sched *s, int n) {
+	struct mu_task **h;
+	if(n <= s->heap_size)
+		return 1;
+	if(n < s->heap_size * 2)
+		n = s->heap_size * 2;
+	if(!(h = realloc(s->heap, n * sizeof *h)))
+		return 0;
+	s->heap = h;
+	s->heap_size = n;
+	return 1;
+}
+
+int mu_sched_spawn(struct mu_sched *s, struct musl *m, const struct mu_script *sc,
+		mu_sched_done done, void *data) {
+	struct mu_task *t;
+	int i, n, ok;
+
+	if(m->task) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Interpreter is already scheduled");
+		return 0;
+	}
+	if(!mu_add_func(m, "sleep", m_sleep) || !mu_add_func(m, "yield", m_yield)
+			|| !(t = malloc(sizeof *t))) {
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	t->s = s;
+	t->m = m;
+	t->sc = sc;
+	t->started = 0;
+	t->wake = 0;
+	t->done = done;
+	t->data = data;
+	t->state = TASK_RUNNING;
+
+	n = __atomic_add_fetch(&s->live, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&s->lock);
+	ok = grow_heap(s, n);
+	pthread_mutex_unlock(&s->lock);
+	for(i = 0; ok && i < s->nworkers; i++) {
+		pthread_mutex_lock(&s->queues[i].lock);
+		ok = rq_reserve(&s->queues[i], n);
+		pthread_mutex_unlock(&s->queues[i].lock);
+	}
+	if(!ok) {
+		__atomic_sub_fetch(&s->live, 1, __ATOMIC_SEQ_CST);
+		free(t);
+		snprintf(m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+
+	m->task = t;
+	sched_push(s, t);
+	return 1;
+}
+
+static int sched_complete(struct mu_task *t, struct mu_par value) {
+	if(value.type == mu_str && !(value.v.s = strdup(value.v.s))) {
+		snprintf(t->m->error_msg, MAX_ERROR_TEXT-1, "Out of memory");
+		return 0;
+	}
+	t->result = value;
+	if(__atomic_exchange_n(&t->state, TASK_COMPLETED, __ATOMIC_ACQ_REL) == TASK_PARKED)
+		sched_push(t->s, t);
+	return MU_SUSPENDED;
+}
+
+int mu_sched_run(struct mu_sched *s) {
+	struct worker *w;
+	pthread_t *th;
+	int i, n;
+
+	w = malloc(s->nworkers * sizeof *w);
+	th = malloc(s->nworkers * sizeof *th);
+	if(!w || !th) {
+		free(w);
+		free(th);
+		return 0;
+	}
+	for(i = 0; i < s->nworkers; i++) {
+		w[i].s = s;
+		w[i].id = i;
+	}
+
+	/* The calling thread is worker 0. If a thread can not be
+	created, its queue is emptied by the others stealing from it */
+	for(n = 1; n < s->nworkers; n++)
+		if(pthread_create(&th[n], NULL, worker, &w[n]) != 0)
+			break;
+	worker(&w[0]);
+	for(i = 1; i < n; i++)
+		pthread_join(th[i], NULL);
+
+	free(w);
+	free(th);
+	return 1;
+}
+
+void mu_sched_free(struct mu_sched *s) {
+	struct mu_task *t;
+	int i;
+	for(i = 0; i < s->nworkers; i++) {
+		while((t = rq_pop(&s->queues[i], 0)) != NULL) {
+			t->m->task = NULL;
+			free(t);
+		}
+		pthread_mutex_destroy(&s->queues[i].lock);
+		free(s->queues[i].q);
+	}
+	while(s->nheap > 0) {
+		t = heap_pop(s);
+		t->m->task = NULL;
+		free(t);
+	}
+	free(s->queues);
+	free(s->heap);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+#endif
@@ -38,6 +38,27 @@ extern "C"
 {
 #endif
 	
+/*3 Threads
+ *# The interpreter uses no global state that can be modified (apart
+ *# from a counter that {{~~mu_create()}} updates atomically), so
+ *# different interpreters can be used on different threads at the
+ *# same time without locking. A single interpreter must only be used
+ *# by one thread at a time.\n
+ *# To run the same script on several threads:
+ *{
+ ** Compile it once with {{~~mu_compile()}}. The resulting
+ *# {{~~mu_script}} is read-only and can be shared by all the threads.
+ ** Give each thread its own interpreter from {{~~mu_create()}}, with
+ *# its own variables, stacks and registered functions.
+ ** Run the script on each thread with {{~~mu_exec()}}.
+ *}
+ *# A {{~~mu_pool}} can hand out the interpreters and reuse them.
+ *# The built-in functions are reentrant. External functions that
+ *# are registered on interpreters used by different threads must be
+ *# reentrant too; use {{~~mu_set_data()}} rather than global
+ *# variables for their state.
+ */
+
 /*@ struct ##musl
  *# The {*Musl*} structure that contains the state of the interpreter.\n
  *# It is created with {{~~mu_create()}}.\n
@@ -65,6 +86,17 @@ struct musl *mu_create();
  */
 void mu_cleanup(struct musl *m);
 
+/*@ void ##mu_reset(struct musl *m)
+ *# Returns an interpreter to the state it was in before it ran
+ *# any scripts: Its variables are deleted and its stacks and
+ *# error messages are cleared.\n
+ *# The registered functions, options, limits and user data
+ *# are kept, and so is the memory that was allocated for the
+ *# variables and stacks, so that the interpreter can be reused
+ *# more cheaply than creating a new one.
+ */
+void mu_reset(struct musl *m);
+
 /*@ int ##mu_run(struct musl *m, const char *script)
  *# Runs a script through an interpreter structure.\n
  *# Returns 0 if the script contains errors, in which
@@ -74,6 +106,185 @@ void mu_cleanup(struct musl *m);
  *# the error occured.
  */
 int mu_run(struct musl *m, const char *script);
+
+/*@ struct ##mu_script
+ *# A script that has been prepared for execution with {{~~mu_compile()}}.\n
+ *# A {{mu_script}} is never modified after it has been compiled, so it
+ *# can be executed many times, by many interpreters, without being
+ *# scanned again. See {/Threads/} below.
+ */
+struct mu_script;
+
+/*@ struct mu_script *##mu_compile(struct musl *m, const char *script)
+ *# Scans a script's labels so that it can be executed through {{~~mu_exec()}}.\n
+ *# The interpreter {{m}} is only used to report errors.\n
+ *# The {{script}} text is not copied, so it must remain valid until
+ *# the {{mu_script}} is destroyed with {{~~mu_free_script()}}.\n
+ *# It returns {{NULL}} if the script contains errors, in which case
+ *# {{~~mu_error_msg()}} and {{~~mu_error_text()}} describe the error.
+ */
+struct mu_script *mu_compile(struct musl *m, const char *script);
+
+/*@ int ##mu_exec(struct musl *m, const struct mu_script *sc)
+ *# Executes a compiled script on an interpreter.\n
+ *# {{mu_run(m, script)}} is equivalent to compiling {{script}},
+ *# executing it and then freeing it.\n
+ *# Returns 0 if the script contains errors, like {{~~mu_run()}}.
+ */
+int mu_exec(struct musl *m, const struct mu_script *sc);
+
+/*@ ##MU_SUSPENDED
+ *# Returned by {{~~mu_run_budget()}}, {{~~mu_exec_budget()}} and
+ *# {{~~mu_resume()}} when a script used up its statement budget
+ *# before it finished.
+ */
+#define MU_SUSPENDED 2
+
+/*@ int ##mu_exec_budget(struct musl *m, const struct mu_script *sc, int n)
+ *# Like {{~~mu_exec()}}, but executes at most {{n}} statements
+ *# (or all of them if {{n <= 0}}).\n
+ *# If the budget runs out before the script ends, the interpreter
+ *# saves its position, GOSUB stack and FOR stack and returns
+ *# {{~~MU_SUSPENDED}}. Call {{~~mu_resume()}} to continue the script.
+ *# This allows a single thread to share its time fairly between
+ *# many interpreters, and stops infinite loops from blocking it.\n
+ *# Statements in subroutines that are called through {{GOSUB}} in an
+ *# expression or through {{~~mu_gosub()}} are counted, but the script
+ *# is only suspended once they return.\n
+ *# Otherwise it returns 1 when the script ends or 0 on an error.\n
+ *# {{sc}} must remain valid while the script is suspended.
+ *# Running another script on the interpreter, or resetting it with
+ *# {{~~mu_reset()}}, abandons the suspended script.
+ */
+int mu_exec_budget(struct musl *m, const struct mu_script *sc, int n);
+
+/*@ int ##mu_run_budget(struct musl *m, const char *script, int n)
+ *# Like {{~~mu_exec_budget()}} for a script that has not been compiled.\n
+ *# The {{script}} text must remain valid while it is suspended.
+ */
+int mu_run_budget(struct musl *m, const char *script, int n);
+
+/*@ int ##mu_resume(struct musl *m, int n)
+ *# Continues a suspended script for at most {{n}} more statements.\n
+ *# Returns {{~~MU_SUSPENDED}}, 1 or 0 like {{~~mu_exec_budget()}}.
+ *# It is an error to call it if no script is suspended.
+ */
+int mu_resume(struct musl *m, int n);
+
+/*@ ##MU_PENDING
+ *# Returned by {{~~mu_run()}}, {{~~mu_exec()}} and the other functions
+ *# that execute scripts when the script is waiting for an asynchronous
+ *# call to complete. See {{~~mu_suspend()}}.
+ */
+#define MU_PENDING 3
+
+/*@ void ##mu_free_script(struct mu_script *sc)
+ *# Destroys a script compiled with {{~~mu_compile()}}.\n
+ *# No interpreter may still be executing it.
+ */
+void mu_free_script(struct mu_script *sc);
+
+/*@ struct ##mu_pool
+ *# A pool of interpreters that have been created and initialized
+ *# in advance, for applications (like servers) that run a script
+ *# for every request.\n
+ *# Interpreters are taken from the pool with {{~~mu_pool_acquire()}}
+ *# and returned to it with {{~~mu_pool_release()}}. Both functions
+ *# are lock-free, so a pool can be shared by all threads.\n
+ *# Compile the script once with {{~~mu_compile()}} and run it on the
+ *# acquired interpreters with {{~~mu_exec()}}.
+ */
+struct mu_pool;
+
+/*@ typedef int (*##mu_pool_init)(struct musl *m, void *data)
+ *# Callback used by a {{~~mu_pool}} to initialize each new interpreter,
+ *# for example to register its external functions with {{~~mu_add_func()}}.\n
+ *# {{data}} is the pointer that was passed to {{~~mu_pool_create()}}.\n
+ *# It should return 0 on failure.
+ */
+typedef int (*mu_pool_init)(struct musl *m, void *data);
+
+/*@ struct mu_pool *##mu_pool_create(int size, mu_pool_init init, void *data)
+ *# Creates a pool of {{size}} interpreters, calling {{init}}
+ *# (if it is not {{NULL}}) on each one.\n
+ *# It returns {{NULL}} if a {{malloc()}} or {{init}} failed.
+ */
+struct mu_pool *mu_pool_create(int size, mu_pool_init init, void *data);
+
+/*@ struct musl *##mu_pool_acquire(struct mu_pool *p)
+ *# Takes an interpreter from a pool.\n
+ *# If all the pool's interpreters are in use, a new one is
+ *# created and initialized, which is destroyed again when it
+ *# is released.\n
+ *# It returns {{NULL}} if a {{malloc()}} or the init callback failed.
+ */
+struct musl *mu_pool_acquire(struct mu_pool *p);
+
+/*@ void ##mu_pool_release(struct mu_pool *p, struct musl *m)
+ *# Returns an interpreter obtained from {{~~mu_pool_acquire()}} to
+ *# the pool, after resetting it with {{~~mu_reset()}}.
+ */
+void mu_pool_release(struct mu_pool *p, struct musl *m);
+
+/*@ void ##mu_pool_free(struct mu_pool *p)
+ *# Destroys a pool and its interpreters.\n
+ *# All the interpreters must have been released first.
+ */
+void mu_pool_free(struct mu_pool *p);
+
+#ifdef WITH_THREADS
+/*@ struct ##mu_sched
+ *# A scheduler that runs many scripts on a fixed number of
+ *# worker threads. It is only available if {*Musl*} is compiled
+ *# with {{WITH_THREADS}} defined (and linked with {{-lpthread}}).\n
+ *# Each script gets a slice of statements at a time (see
+ *# {{~~mu_exec_budget()}}), so long running scripts share the
+ *# workers fairly. Scripts can call the built-in functions
+ *# {{SLEEP(ms)}} and {{YIELD()}} to give up the worker without
+ *# blocking it. Each worker has its own queue of scripts, and
+ *# steals from the others when its queue is empty.\n
+ *# Run {{make bench}} to build a benchmark.
+ */
+struct mu_sched;
+
+/*@ typedef void (*##mu_sched_done)(struct musl *m, int result, void *data)
+ *# Called on a worker thread when a scheduled script ends.
+ *# {{result}} is 1 if the script ended normally and 0 on an error.\n
+ *# The callback may reuse or destroy the interpreter {{m}}.
+ */
+typedef void (*mu_sched_done)(struct musl *m, int result, void *data);
+
+/*@ struct mu_sched *##mu_sched_create(int nworkers, int slice)
+ *# Creates a scheduler with {{nworkers}} worker threads that runs
+ *# each script for {{slice}} statements at a time (or a default if
+ *# {{slice <= 0}}).\n
+ *# It returns {{NULL}} if a {{malloc()}} failed.
+ */
+struct mu_sched *mu_sched_create(int nworkers, int slice);
+
+/*@ int ##mu_sched_spawn(struct mu_sched *s, struct musl *m, const struct mu_script *sc, mu_sched_done done, void *data)
+ *# Schedules the compiled script {{sc}} to run on interpreter {{m}}.
+ *# {{done}} (if not {{NULL}}) is called with {{data}} when it ends.\n
+ *# It registers {{SLEEP()}} and {{YIELD()}} with {{m}}.\n
+ *# Scripts can be spawned before {{~~mu_sched_run()}}, or by the
+ *# scheduled scripts and {{done}} callbacks while it runs.\n
+ *# It returns 0 if {{m}} is already scheduled or if a {{malloc()}} failed.
+ */
+int mu_sched_spawn(struct mu_sched *s, struct musl *m, const struct mu_script *sc,
+		mu_sched_done done, void *data);
+
+/*@ int ##mu_sched_run(struct mu_sched *s)
+ *# Runs the scheduled scripts until they have all ended.
+ *# The calling thread is used as one of the workers.\n
+ *# It returns 0 if a {{malloc()}} failed.
+ */
+int mu_sched_run(struct mu_sched *s);
+
+/*@ void ##mu_sched_free(struct mu_sched *s)
+ *# Destroys a scheduler. The interpreters are not destroyed.
+ */
+void mu_sched_free(struct mu_sched *s);
+#endif
  
 /*@ int ##mu_gosub(struct musl *m, const char *label)
  *# Executes a subroutine in a script from an external 
@@ -81,14 +292,54 @@ int mu_run(struct musl *m, const char *script);
  *# The purpose of this function is to allow some
  *# sort of callback mechanism (musl calls C calls musl).\n
  *# Note that it must only be called from some external
- *# function (see {{~~mu_func}}), since only {{~~mu_run()}} knows
- *# about the labels of subroutines.\n
+ *# function (see {{~~mu_func}}), since only {{~~mu_run()}} and
+ *# {{~~mu_exec()}} know about the labels of subroutines.\n
  *# It returns 1 on success and 0 on failure, in which
  *# case the external function should clean up and then
  *# call {{~~mu_throw()}} to terminate the script.
  */
 int mu_gosub(struct musl *m, const char *label);
 
+/*@ int ##mu_load(struct musl *m, const char *script)
+ *# Runs {{script}} like {{~~mu_run()}}, but keeps it and its labels
+ *# afterwards so that its subroutines can be called with
+ *# {{~~mu_call()}}. This allows a script to be used as a library of
+ *# event handlers, with the code before its first {{END}} doing the
+ *# initialization.\n
+ *# The interpreter keeps its own copy of {{script}}. Loading another
+ *# script replaces it, and {{~~mu_reset()}} discards it.\n
+ *# Returns 0 if the script contains errors. A script with syntax
+ *# errors in its labels is not kept, but one that fails while it runs
+ *# is kept, so that its subroutines can still be called.
+ */
+int mu_load(struct musl *m, const char *script);
+
+/*@ int ##mu_call(struct musl *m, const char *label)
+ *# Executes the subroutine at {{label}} in the script that was loaded
+ *# with {{~~mu_load()}}, as if it was called through {{GOSUB}}.\n
+ *# Unlike {{~~mu_gosub()}}, it can be called by the host at any time,
+ *# even while the script waits for an asynchronous call, and the
+ *# script isn't scanned again for each call.\n
+ *# It returns 1 on success and 0 on failure, in which case
+ *# {{~~mu_error_msg()}} describes the error.
+ */
+int mu_call(struct musl *m, const char *label);
+
+/*@ int ##mu_reload(struct musl *m, const char *script)
+ *# Replaces the script that was loaded with {{~~mu_load()}} with a new
+ *# version of it, for example after it has been edited, so that
+ *# {{~~mu_call()}} calls the new subroutines.\n
+ *# Unlike {{~~mu_load()}}, the script is not run, and the variables
+ *# are kept. Only the lines that differ from the previous version are
+ *# scanned for labels, so reloading a large script after a small edit
+ *# is quick. (A script with strings or statements that span lines is
+ *# scanned as a whole.) If no script was loaded, {{script}} is scanned
+ *# and kept without being run.\n
+ *# Returns 0 if the new version contains errors, in which case the
+ *# previous version is kept.
+ */
+int mu_reload(struct musl *m, const char *script);
+
 /*@ void ##mu_halt(struct musl *m)
  *# Stops the interpreter.\n
  *# If you call this from an external function,
@@ -97,6 +348,49 @@ int mu_gosub(struct musl *m, const char *label);
  */
 void mu_halt(struct musl *m);
 
+/*@ enum ##mu_option {mu_short_circuit, mu_async_calls}
+ *# Options that can be set through {{~~mu_set_option()}}:
+ *{
+ ** {{mu_short_circuit}} - Evaluate {{AND}} and {{OR}} lazily (default off).
+ *# With this option on, the right hand side of {{a AND b}} is not evaluated
+ *# if {{a}} is zero and the right hand side of {{a OR b}} is not evaluated if
+ *# {{a}} is nonzero. External functions on the skipped side are not called.
+ *# {{AND}} and {{OR}} then act as logical operators that return 1 or 0,
+ *# rather than as bitwise operators, so {{2 AND 1}} is 1 instead of 0.
+ *# Conditions built from comparisons and {{NOT}} behave the same either way.
+ ** {{mu_async_calls}} - Allow external functions to make asynchronous calls
+ *# through {{~~mu_suspend()}} (default off). The interpreter then keeps the
+ *# results of the calls made by each statement until the next statement.
+ *}
+ */
+enum mu_option {mu_short_circuit, mu_async_calls};
+
+/*@ int ##mu_set_option(struct musl *m, enum mu_option opt, int value)
+ *# Switches the option {{opt}} of the interpreter on (nonzero {{value}}) or off.\n
+ *# It returns the previous value of the option.
+ */
+int mu_set_option(struct musl *m, enum mu_option opt, int value);
+
+/*@ enum ##mu_limit {mu_gosub_limit, mu_for_limit, mu_thread_limit}
+ *# Limits that can be configured through {{~~mu_set_limit()}}:
+ *{
+ ** {{mu_gosub_limit}} - the maximum depth of nested {{GOSUB}}s (default 1000).
+ ** {{mu_for_limit}} - the maximum depth of nested {{FOR}} loops (default 100).
+ ** {{mu_thread_limit}} - the maximum number of threads used by {{PARMAP()}}
+ *# (default one per CPU; {{~~mu_set_limit()}} returns 0 for the default).
+ *}
+ */
+enum mu_limit {mu_gosub_limit, mu_for_limit, mu_thread_limit};
+
+/*@ int ##mu_set_limit(struct musl *m, enum mu_limit what, int n)
+ *# Sets the limit {{what}} of the interpreter to {{n}}.\n
+ *# The stacks only grow as deep as a script needs them,
+ *# so a high limit costs nothing if it isn't used.\n
+ *# If {{n}} is 0 or less the limit is not changed.\n
+ *# It returns the previous value of the limit.
+ */
+int mu_set_limit(struct musl *m, enum mu_limit what, int n);
+
 /*@ enum ##mu_ptype {mu_int, mu_str}
  *# Type of function parameter/return value.
  *# See {{~~mu_par}}'s {{type}} field. 
@@ -140,6 +434,108 @@ typedef struct mu_par (*mu_func)(struct musl *m, int argc, struct mu_par argv[])
  */
 int mu_add_func(struct musl *m, const char *name, mu_func fun);
 
+/*@ struct ##mu_arg
+ *# An argument of a function added with {{~~mu_add_func_sig()}},
+ *# already converted to the type in the function's signature.
+ *[
+ *# struct mu_arg {
+ *#   int i;
+ *#   const char *s;
+ *#   size_t len;
+ *# }
+ *]
+ *{
+ ** {{i}} is the value of an {{i}} (integer) parameter.
+ ** {{s}} is the value of an {{s}} (string) parameter, and {{len}}
+ *# its length. The string belongs to the interpreter and is only valid
+ *# until the function returns.
+ *}
+ */
+struct mu_arg {
+	int i;
+	const char *s;
+	size_t len;
+};
+
+/*@ typedef struct mu_par (*##mu_sig_func)(struct musl *m, int argc, const struct mu_arg argv[])
+ *# Prototype for external functions that are added through
+ *# {{~~mu_add_func_sig()}}. {{argc}} has already been checked against
+ *# the signature. Strings that it returns must be allocated on the heap,
+ *# like those returned by a {{~~mu_func}}.
+ */
+typedef struct mu_par (*mu_sig_func)(struct musl *m, int argc, const struct mu_arg argv[]);
+
+/*@ int ##mu_add_func_sig(struct musl *m, const char *name, const char *sig, mu_sig_func fun)
+ *# Adds a function {{fun}} named {{name}} with the signature {{sig}}
+ *# to the interpreter. Existing functions are replaced.\n
+ *# The signature lists the types of the parameters, separated by commas,
+ *# and optionally the type of the return value after {{->}}. The types
+ *# are {{i}} for integers and {{s}} for strings. A {{?}} after a type
+ *# marks an optional parameter (all the parameters after it must be
+ *# optional too), and a {{*}} after the last type means that it can
+ *# be repeated any number of times. For example:
+ *[
+ *# mu_add_func_sig(m, "mid$", "s,i,i->s", m_mid);
+ *# mu_add_func_sig(m, "max", "i,i*->i", m_max);
+ *]
+ *# The interpreter converts the arguments before calling {{fun}},
+ *# and the return value after it returns, and reports calls with
+ *# the wrong number of arguments as errors, even in statements that
+ *# are not executed. (The built-in functions, like {{LEN()}}, ignore
+ *# surplus arguments and only report missing ones when they are called,
+ *# so that old scripts keep working.)\n
+ *# Returns 0 if {{sig}} is invalid or on failure.
+ */
+int mu_add_func_sig(struct musl *m, const char *name, const char *sig, mu_sig_func fun);
+
+/*@ struct ##mu_field
+ *# Describes a field of the records passed to {{~~mu_gosub_batch()}}.
+ *[
+ *# struct mu_field {
+ *#   const char *name;
+ *#   enum mu_ptype type;
+ *#   size_t offset;
+ *# }
+ *]
+ *{
+ ** {{name}} is the script variable that the field is copied into.
+ ** {{type}} is {{mu_int}} if the field is an {{int}}, or {{mu_str}}
+ *# if it is a {{const char *}} ({{NULL}} is treated as {{""}}).
+ ** {{offset}} is the position of the field in the record,
+ *# usually from {{offsetof()}}.
+ *}
+ */
+struct mu_field {
+	const char *name;
+	enum mu_ptype type;
+	size_t offset;
+};
+
+/*@ typedef int (*##mu_batch_func)(struct musl *m, int i, void *record, void *data)
+ *# Called by {{~~mu_gosub_batch()}} after the subroutine returned for
+ *# record number {{i}}, to collect its results with {{~~mu_get_int()}}
+ *# and {{~~mu_get_str()}}. It returns 0 to stop the batch.
+ */
+typedef int (*mu_batch_func)(struct musl *m, int i, void *record, void *data);
+
+/*@ int ##mu_gosub_batch(struct musl *m, const char *label, void *records, size_t size, int n, const struct mu_field *fields, int nfields, mu_batch_func done, void *data)
+ *# Executes the subroutine at {{label}} once for each of the {{n}}
+ *# records in the array {{records}}, where each record is {{size}}
+ *# bytes long.\n
+ *# Before each call, the {{nfields}} {{fields}} of the record are
+ *# copied into their variables. Afterwards {{done}} (if it is not
+ *# {{NULL}}) is called with {{data}}.\n
+ *# It does the same as calling {{~~mu_set_int()}}, {{~~mu_set_str()}}
+ *# and {{~~mu_gosub()}} for every record, but it looks up the label and
+ *# the variables only once, so it is much cheaper for many small
+ *# records.\n
+ *# Like {{~~mu_gosub()}}, it must only be called from an external
+ *# function. It returns 1 on success and 0 if the subroutine failed,
+ *# in which case the batch stops at the record that failed.
+ */
+int mu_gosub_batch(struct musl *m, const char *label, void *records, size_t size, int n,
+		const struct mu_field *fields, int nfields, mu_batch_func done, void *data);
+
 /*@ void ##mu_throw(struct musl *m, const char *msg, ...)
  *# Reports errors that happen in external functions.
  *N Only call it from within external functions.
@@ -148,6 +544,102 @@ int mu_add_func(struct musl *m, const char *name, mu_func fun);
  */
 void mu_throw(struct musl *m, const char *msg, ...);
 
+/*@ int ##mu_suspend(struct musl *m)
+ *# Called from an external function to turn the call into an asynchronous
+ *# call: The function starts an operation (like I/O) that completes later,
+ *# and returns immediately. Its return value is ignored.\n
+ *# The script is then suspended, and the function that executed it returns
+ *# {{~~MU_PENDING}}. When the operation completes, the application calls
+ *# {{~~mu_complete()}} with the token returned by {{mu_suspend()}} and the
+ *# result of the call, and the script continues as if the function had
+ *# returned that result.\n
+ *# This way a single thread can run many scripts that wait for I/O.\n
+ *# The {{mu_async_calls}} option must be set (see {{~~mu_set_option()}}).
+ *# The script is resumed by executing the statement that made the call
+ *# again. The other function calls in that statement that were made before
+ *# the script was suspended are not repeated: They return the same
+ *# results as before.\n
+ *# It returns 0 if the call can not be suspended, in which case
+ *# the function should complete it normally or call {{~~mu_throw()}}.
+ *# This is the case if the option is not set, or if the function
+ *# is called from a subroutine that was called through {{GOSUB}}
+ *# in an expression or through {{~~mu_gosub()}}.
+ */
+int mu_suspend(struct musl *m);
+
+/*@ int ##mu_complete(struct musl *m, int token, struct mu_par value)
+ *# Completes the asynchronous call identified by {{token}} (see
+ *# {{~~mu_suspend()}}) with the result {{value}}, and continues
+ *# the script. String values are copied.\n
+ *# If the script was executed with a budget it continues with the
+ *# same budget. It returns 1, 0, {{~~MU_SUSPENDED}} or {{~~MU_PENDING}}
+ *# like {{~~mu_exec_budget()}}, or 0 if {{token}} is not pending.\n
+ *# If the interpreter is run by a {{~~mu_sched}}, the script is
+ *# handed back to the scheduler instead, and it returns
+ *# {{~~MU_SUSPENDED}}. In that case it may be called from any thread.
+ */
+int mu_complete(struct musl *m, int token, struct mu_par value);
+
+/*@ struct ##mu_chan
+ *# A channel: A bounded queue of values that scripts and the application
+ *# can send to and receive from on any number of threads, for example to
+ *# connect scripts into a pipeline. Scripts use it through the built-in
+ *# functions {{~~CHAN_SEND()}}, {{~~CHAN_RECV$()}} and {{~~CHAN_CLOSE()}}
+ *# once it is registered with {{~~mu_add_chan()}}.\n
+ *# Sending and receiving are lock-free unless the channel is full
+ *# or empty. Without {{WITH_THREADS}} a channel can only be used by
+ *# one thread, and sending to a full channel or receiving from an
+ *# empty one is an error in a script.
+ */
+struct mu_chan;
+
+/*@ struct mu_chan *##mu_chan_create(int size)
+ *# Creates a channel that holds up to {{size}} values (rounded
+ *# up to a power of two, and at least 2).\n
+ *# It returns {{NULL}} if {{size <= 0}} or if a {{malloc()}} failed.
+ */
+struct mu_chan *mu_chan_create(int size);
+
+/*@ int ##mu_chan_send(struct mu_chan *ch, struct mu_par v, int wait)
+ *# Sends {{v}} on the channel {{ch}}. Strings are copied.\n
+ *# If the channel is full it waits for room if {{wait}} is set
+ *# (and {{WITH_THREADS}} is defined).\n
+ *# It returns 1 if the value was sent, and 0 if the channel is
+ *# closed or full, or if a {{malloc()}} failed.
+ */
+int mu_chan_send(struct mu_chan *ch, struct mu_par v, int wait);
+
+/*@ int ##mu_chan_recv(struct mu_chan *ch, struct mu_par *v, int wait)
+ *# Receives a value from the channel {{ch}} into {{v}}. If {{v}} is
+ *# a string, the caller must {{free()}} it.\n
+ *# If the channel is empty it waits for a value if {{wait}} is set
+ *# (and {{WITH_THREADS}} is defined).\n
+ *# It returns 1 if a value was received, and 0 if the channel is empty.
+ */
+int mu_chan_recv(struct mu_chan *ch, struct mu_par *v, int wait);
+
+/*@ void ##mu_chan_close(struct mu_chan *ch)
+ *# Closes the channel {{ch}}: Values can no longer be sent, and
+ *# receivers that wait on the empty channel return.
+ */
+void mu_chan_close(struct mu_chan *ch);
+
+/*@ void ##mu_chan_free(struct mu_chan *ch)
+ *# Destroys the channel {{ch}} and the values still in it.\n
+ *# Nothing may be using the channel anymore, and the interpreters
+ *# that it was registered with may not run scripts that use it.
+ */
+void mu_chan_free(struct mu_chan *ch);
+
+/*@ int ##mu_add_chan(struct musl *m, const char *name, struct mu_chan *ch)
+ *# Registers the channel {{ch}} with the interpreter {{m}} under
+ *# {{name}}, so that its scripts can refer to it by that name.
+ *# A channel can be registered with any number of interpreters.\n
+ *# The channel is not destroyed with the interpreter.\n
+ *# It returns 0 if a {{malloc()}} failed.
+ */
+int mu_add_chan(struct musl *m, const char *name, struct mu_chan *ch);
+
 /*@ const char *##mu_error_msg(struct musl *m)
  *# Retrieves a text description of errors that occured.
  */
@@ -210,6 +702,130 @@ const char *mu_get_str(struct musl *m, const char *name);
  */
 int mu_has_var(struct musl *m, const char *name);
 
+/*@ struct ##mu_var
+ *# A handle to a variable, from {{~~mu_var_handle()}}.
+ */
+struct mu_var;
+
+/*@ struct mu_var *##mu_var_handle(struct musl *m, const char *name)
+ *# Returns a handle to the variable {{name}}, creating it with the
+ *# value 0 if it doesn't exist yet. The {{mu_handle_*()}} functions use
+ *# the handle to read and write the variable without looking up its
+ *# name every time.\n
+ *# Handles remain valid while the interpreter gains variables, until
+ *# {{~~mu_reset()}}, {{~~mu_load_state()}} or {{~~mu_cleanup()}}
+ *# is called.\n
+ *# Returns {{NULL}} on failure.
+ */
+struct mu_var *mu_var_handle(struct musl *m, const char *name);
+
+/*@ int ##mu_handle_set_int(struct mu_var *h, int num)
+ *# Sets the variable of the handle {{h}} to the number {{num}}.\n
+ *# Returns 0 on failure.
+ */
+int mu_handle_set_int(struct mu_var *h, int num);
+
+/*@ int ##mu_handle_set_str(struct mu_var *h, const char *val)
+ *# Sets the variable of the handle {{h}} to a copy of the string {{val}}.\n
+ *# Returns 0 on failure.
+ */
+int mu_handle_set_str(struct mu_var *h, const char *val);
+
+/*@ int ##mu_handle_get_int(const struct mu_var *h)
+ *# Gets the value of the variable of the handle {{h}} as a number.
+ */
+int mu_handle_get_int(const struct mu_var *h);
+
+/*@ const char *##mu_handle_get_str(const struct mu_var *h, char *buf, size_t size)
+ *# Gets the value of the variable of the handle {{h}} as a string.\n
+ *# Unlike {{~~mu_get_str()}}, it doesn't convert a numeric variable to
+ *# a string. Instead it formats the number into {{buf}}, which is
+ *# {{size}} bytes long, and returns {{buf}}. 16 bytes are enough for any
+ *# number.\n
+ *# A string value belongs to the interpreter and is valid until
+ *# the variable changes.
+ */
+const char *mu_handle_get_str(const struct mu_var *h, char *buf, size_t size);
+
+/*@ struct ##mu_expr
+ *# An expression compiled by {{~~mu_compile_expr()}}.
+ */
+struct mu_expr;
+
+/*@ struct mu_expr *##mu_compile_expr(struct musl *m, const char *text)
+ *# Compiles the expression {{text}}, like {{price > 100 AND region$ = "EU"}},
+ *# so that {{~~mu_eval()}} can evaluate it many times without parsing it
+ *# again. The expression can use variables, arrays and the functions
+ *# registered on {{m}}, but not {{GOSUB}}.\n
+ *# Returns {{NULL}} if the expression contains errors, in which case
+ *# {{~~mu_error_msg()}} describes the error. The expression is destroyed
+ *# with {{~~mu_free_expr()}}.
+ */
+struct mu_expr *mu_compile_expr(struct musl *m, const char *text);
+
+/*@ int ##mu_eval(struct musl *m, struct mu_expr *e, struct mu_par *result)
+ *# Evaluates the compiled expression {{e}} with the current global
+ *# variables of {{m}}, and stores its value in {{result}}. If the value
+ *# is a string, the caller must {{free()}} it.\n
+ *# The variables and functions are looked up on the first evaluation and
+ *# remembered after that. An expression can be evaluated on another
+ *# interpreter than the one it was compiled on, but they are then looked
+ *# up again. It must not be evaluated by two threads at the same time.\n
+ *# Returns 0 on failure, for example if it divides by zero.
+ */
+int mu_eval(struct musl *m, struct mu_expr *e, struct mu_par *result);
+
+/*@ void ##mu_free_expr(struct mu_expr *e)
+ *# Destroys an expression compiled by {{~~mu_compile_expr()}}.
+ */
+void mu_free_expr(struct mu_expr *e);
+
+/*@ struct ##mu_kv
+ *# A variable's name and value, for {{~~mu_set_many()}} and
+ *# {{~~mu_get_many()}}.
+ *[
+ *# struct mu_kv {
+ *#   const char *name;
+ *#   struct mu_par val;
+ *# }
+ *]
+ */
+struct mu_kv {
+	const char *name;
+	struct mu_par val;
+};
+
+/*@ int ##mu_set_many(struct musl *m, struct mu_kv *kv, size_t n, int move)
+ *# Sets the {{n}} variables in {{kv}} to their values.\n
+ *# It makes room in the interpreter's variable table for all of them
+ *# at once, rather than growing it step by step.\n
+ *# If {{move}} is 0 the strings are copied. Otherwise the interpreter
+ *# takes over the strings, which must have been allocated with
+ *# {{malloc()}}, and sets their pointers in {{kv}} to {{NULL}}. It
+ *# takes them even if it fails, and frees the ones it couldn't store.\n
+ *# Returns 0 on failure.
+ */
+int mu_set_many(struct musl *m, struct mu_kv *kv, size_t n, int move);
+
+/*@ size_t ##mu_get_many(struct musl *m, struct mu_kv *kv, size_t n)
+ *# Gets the values of the {{n}} variables named in {{kv}}, without
+ *# converting them: {{val.type}} says whether each one is a number or a
+ *# string. Variables that don't exist are returned as the number 0.\n
+ *# The strings belong to the interpreter and must not be freed or
+ *# modified. They are valid until the variables change.\n
+ *# Returns the number of variables that exist.
+ */
+size_t mu_get_many(struct musl *m, struct mu_kv *kv, size_t n);
+
+/*@ int ##mu_set_array(struct musl *m, const char *name, struct mu_par *values, size_t n, int move)
+ *# Sets the elements {{name[1]}} to {{name[n]}} of an array to the
+ *# {{n}} {{values}}, and {{name["length"]}} to {{n}}, like the
+ *# {{DATA()}} function does for a new array.\n
+ *# {{move}} works as it does for {{~~mu_set_many()}}.\n
+ *# Returns 0 on failure.
+ */
+int mu_set_array(struct musl *m, const char *name, struct mu_par *values, size_t n, int move);
+
 /*@ void ##mu_set_data(struct musl *m, void *data)
  *# Stores arbitrary user data in the musl structure
  *# that can later be retrieved with {{~~mu_get_data()}}
@@ -228,6 +844,80 @@ void *mu_get_data(struct musl *m);
  */
 void mu_dump(struct musl *m, FILE *f);
 
+/*@ int ##mu_save_state(struct musl *m, FILE *f)
+ *# Writes a snapshot of all the interpreter's variables, including
+ *# arrays and the {{~~PUSH()}}/{{~~POP()}} stack, to the file {{f}}.\n
+ *# The snapshot uses a compact binary format that preserves the type
+ *# of each variable. {{f}} should be opened in binary mode.\n
+ *# Returns 0 on failure.
+ */
+int mu_save_state(struct musl *m, FILE *f);
+
+/*@ int ##mu_load_state(struct musl *m, FILE *f)
+ *# Replaces the interpreter's variables with a snapshot previously
+ *# written with {{~~mu_save_state()}}.\n
+ *# Returns 0 if the file could not be read, in which case
+ *# {{~~mu_error_msg()}} describes the problem and the existing
+ *# variables are left untouched.
+ */
+int mu_load_state(struct musl *m, FILE *f);
+
+#ifdef WITH_MMAP
+/*@ struct ##mu_frozen
+ *# A read-only copy of an interpreter's variables in a shared memory
+ *# mapping, so that processes that need the same large tables don't
+ *# each keep their own copy. It is only available if {*Musl*} is
+ *# compiled with {{WITH_MMAP}} defined, on Linux.\n
+ *# Interpreters that it is attached to with {{~~mu_attach_frozen()}}
+ *# find the frozen variables when they don't have variables with the
+ *# same names. Assigning to a frozen variable creates a variable of the
+ *# interpreter's own that hides it. Functions that list an
+ *# interpreter's variables, like {{~~mu_dump()}} and
+ *# {{~~mu_save_state()}}, don't list the frozen ones.\n
+ *# The mapping holds absolute pointers, so it must be mapped at the
+ *# same address in every process. Processes forked after
+ *# {{~~mu_freeze()}} inherit it at that address.
+ */
+struct mu_frozen;
+
+/*@ struct mu_frozen *##mu_freeze(struct musl *m, const char *path)
+ *# Copies the global variables of {{m}} into a new frozen table.\n
+ *# If {{path}} is {{NULL}} the table is in anonymous shared memory,
+ *# which processes forked afterwards share. Otherwise it is written to
+ *# the file {{path}}, which other processes can open with
+ *# {{~~mu_frozen_open()}}.\n
+ *# For example, a server can load its tables into an interpreter,
+ *# freeze it, destroy that interpreter and then fork its workers.\n
+ *# It returns {{NULL}} on failure, in which case
+ *# {{~~mu_error_msg()}} describes the error.
+ */
+struct mu_frozen *mu_freeze(struct musl *m, const char *path);
+
+/*@ struct mu_frozen *##mu_frozen_open(struct musl *m, const char *path)
+ *# Maps a file written by {{~~mu_freeze()}} read-only. The pages are
+ *# shared with the other processes that have it mapped.\n
+ *# The interpreter {{m}} is only used to report errors. It returns
+ *# {{NULL}} on failure, which includes the case where the address the
+ *# table must be mapped at is already in use in this process.
+ */
+struct mu_frozen *mu_frozen_open(struct musl *m, const char *path);
+
+/*@ void ##mu_attach_frozen(struct musl *m, const struct mu_frozen *f)
+ *# Makes the variables in {{f}} visible to the interpreter {{m}}, or
+ *# detaches it if {{f}} is {{NULL}}. An interpreter can have one
+ *# frozen table attached at a time, and {{~~mu_reset()}} keeps it.\n
+ *# The frozen table is never modified, so interpreters on different
+ *# threads can share it.
+ */
+void mu_attach_frozen(struct musl *m, const struct mu_frozen *f);
+
+/*@ void ##mu_frozen_close(struct mu_frozen *f)
+ *# Unmaps a frozen table. It must be detached from all the
+ *# interpreters in this process first.
+ */
+void mu_frozen_close(struct mu_frozen *f);
+#endif
+
 /*@ int ##mu_valid_id(const char *id)
  *# Returns 1 if {{id}} is a valid Musl identifier,
  *# otherwise it returns 0.
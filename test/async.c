@@ -0,0 +1,246 @@
+/*
+ * Tests asynchronous calls: A script that is suspended in the middle
+ * of an expression continues where it left off, without calling the
+ * functions before the suspension again, both when the application
+ * completes the calls and when the script runs on a mu_sched, where
+ * a call can also complete before the worker has parked the script.
+ *
+ * Build it with `make async`. To look for data races, build
+ * it with `make async CC="gcc -fsanitize=thread"`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "musl.h"
+
+#define LOOPS	200
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+/* The number of times F() was called with each argument */
+static int calls[10];
+/* The token of the last call to ASYNC(), and the number of calls */
+static int token, asyncs;
+
+/* F(n) returns n * 10 */
+static struct mu_par f(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int n = mu_par_int(m, 0, argc, argv);
+	if(n >= 0 && n < 10)
+		__atomic_add_fetch(&calls[n], 1, __ATOMIC_RELAXED);
+	rv.v.i = n * 10;
+	return rv;
+}
+
+/* ASYNC() and ASYNC$() suspend the script, or return -1 if they can't */
+static struct mu_par async(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {-1}};
+	asyncs++;
+	token = mu_suspend(m);
+	return rv;
+}
+
+static struct musl *new_interp(void) {
+	struct musl *m = mu_create();
+	mu_add_func(m, "f", f);
+	mu_add_func(m, "async", async);
+	mu_add_func(m, "async$", async);
+	mu_set_option(m, mu_async_calls, 1);
+	return m;
+}
+
+static struct mu_par int_par(int i) {
+	struct mu_par p = {mu_int, {0}};
+	p.v.i = i;
+	return p;
+}
+
+/* The application completes the calls */
+static void test_complete(void) {
+	struct musl *m = new_interp();
+	struct mu_par v = {mu_str, {0}};
+	char buf[10];
+	int rv;
+
+	memset(calls, 0, sizeof calls);
+	check("suspended mid-expression", mu_run(m, "x = F(1) + ASYNC() + F(2)\n"), MU_PENDING);
+	check("F(1) before the suspension", calls[1], 1);
+	check("F(2) not yet", calls[2], 0);
+	check("mu_resume() while waiting", mu_resume(m, 0), 0);
+	check("mu_complete() with the wrong token", mu_complete(m, token + 1, int_par(5)), 0);
+	check("mu_complete()", mu_complete(m, token, int_par(5)), 1);
+	check("x after the call completed", mu_get_int(m, "x"), 35);
+	check("F(1) is not called again", calls[1], 1);
+	check("F(2) once", calls[2], 1);
+	check("mu_complete() after the script ended", mu_complete(m, token, int_par(5)), 0);
+
+	/* The second suspension replays the first call's logged result */
+	memset(calls, 0, sizeof calls);
+	asyncs = 0;
+	rv = mu_run(m, "y = ASYNC() * 100 + F(3) + ASYNC()\nz = y + 1\n");
+	check("first call", rv, MU_PENDING);
+	check("second call", mu_complete(m, token, int_par(4)), MU_PENDING);
+	check("F(3) between the calls", calls[3], 1);
+	check("last call", mu_complete(m, token, int_par(2)), 1);
+	check("y after two calls", mu_get_int(m, "y"), 432);
+	check("z after the statement", mu_get_int(m, "z"), 433);
+	check("F(3) is replayed", calls[3], 1);
+	check("ASYNC() calls", asyncs, 2);
+
+	/* Strings are copied */
+	check("string call", mu_run(m, "s$ = \"<\" & ASYNC$() & \">\"\n"), MU_PENDING);
+	strcpy(buf, "value");
+	v.v.s = buf;
+	mu_complete(m, token, v);
+	strcpy(buf, "changed");
+	check_str("string result", mu_get_str(m, "s$"), "<value>");
+
+	/* Calls in a loop */
+	rv = mu_run(m, "t = 0\nFOR i = 1 TO 5 DO\n  t = t + ASYNC() * i\nNEXT\n");
+	while(rv == MU_PENDING)
+		rv = mu_complete(m, token, int_par(mu_get_int(m, "i")));
+	check("calls in a FOR loop", rv, 1);
+	check("loop total", mu_get_int(m, "t"), 55);
+
+	/* Calls from a GOSUB in an expression can't be suspended */
+	rv = mu_run(m, "g = GOSUB sub\nEND\nsub:\nRETURN ASYNC()\n");
+	check("GOSUB in an expression", rv, 1);
+	check("ASYNC() from the GOSUB", mu_get_int(m, "g"), -1);
+
+	/* Without the option the call isn't suspended either */
+	mu_set_option(m, mu_async_calls, 0);
+	check("without mu_async_calls", mu_run(m, "n = ASYNC()\n"), 1);
+	check("ASYNC() without mu_async_calls", mu_get_int(m, "n"), -1);
+	mu_cleanup(m);
+}
+
+/*
+ * On a scheduler, NOW() completes its call before it returns, so before
+ * the worker parks the script, and LATER() hands the call to another
+ * thread that completes it.
+ */
+static struct musl *later_m;
+static int later_token, later_value, stop;
+static pthread_mutex_t later_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mu_par now(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {-1}};
+	int t = mu_suspend(m);
+	if(t)
+		mu_complete(m, t, int_par(mu_par_int(m, 0, argc, argv)));
+	return rv;
+}
+
+static struct mu_par later(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {-1}};
+	int t = mu_suspend(m);
+	if(t) {
+		pthread_mutex_lock(&later_lock);
+		later_m = m;
+		later_value = mu_par_int(m, 0, argc, argv);
+		later_token = t;
+		pthread_mutex_unlock(&later_lock);
+	}
+	return rv;
+}
+
+static void *completer(void *arg) {
+	for(;;) {
+		struct musl *m = NULL;
+		int t = 0, v = 0;
+		pthread_mutex_lock(&later_lock);
+		if(later_token) {
+			m = later_m;
+			t = later_token;
+			v = later_value;
+			later_token = 0;
+		} else if(stop) {
+			pthread_mutex_unlock(&later_lock);
+			break;
+		}
+		pthread_mutex_unlock(&later_lock);
+		if(t)
+			mu_complete(m, t, int_par(v));
+		else
+			usleep(100);
+	}
+	return NULL;
+}
+
+static int sched_result = -1;
+
+static void sched_done(struct musl *m, int result, void *data) {
+	if(!result)
+		printf("FAIL scheduled script: %s\n", mu_error_msg(m));
+	sched_result = result;
+}
+
+static void test_sched(void) {
+	struct musl *m = new_interp();
+	struct mu_script *sc;
+	struct mu_sched *s;
+	pthread_t th;
+	int expected = 0, i;
+
+	mu_add_func(m, "now", now);
+	mu_add_func(m, "later", later);
+	if(!(sc = mu_compile(m, "t = 0\n"
+			"FOR i = 1 TO n DO\n"
+			"  t = t + F(1) + NOW(i) + F(2) + LATER(i) * 1000 + F(3)\n"
+			"NEXT\n"))) {
+		printf("FAIL mu_compile: %s\n", mu_error_msg(m));
+		failed++;
+		mu_cleanup(m);
+		return;
+	}
+	memset(calls, 0, sizeof calls);
+	mu_set_int(m, "n", LOOPS);
+	s = mu_sched_create(2, 0);
+	mu_sched_spawn(s, m, sc, sched_done, NULL);
+	pthread_create(&th, NULL, completer, NULL);
+	mu_sched_run(s);
+	pthread_mutex_lock(&later_lock);
+	stop = 1;
+	pthread_mutex_unlock(&later_lock);
+	pthread_join(th, NULL);
+
+	for(i = 1; i <= LOOPS; i++)
+		expected += 60 + i * 1001;
+	check("scheduled script", sched_result, 1);
+	check("total of the scheduled script", mu_get_int(m, "t"), expected);
+	check("F(1) once per statement", calls[1], LOOPS);
+	check("F(2) once per statement", calls[2], LOOPS);
+	check("F(3) once per statement", calls[3], LOOPS);
+
+	mu_sched_free(s);
+	mu_free_script(sc);
+	mu_cleanup(m);
+}
+
+int main() {
+	test_complete();
+	test_sched();
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ * Tests mu_load() and mu_call(): The labels of a loaded script stay
+ * resident, so that the host can call its subroutines after it ran,
+ * after other scripts ran on the same interpreter, from an external
+ * function in a running script, and while the script waits for an
+ * asynchronous call, until mu_reset() discards it.
+ *
+ * Build it with `make call`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "musl.h"
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static const char *library =
+	"count = 0\n"
+	"greeting$ = \"hello\"\n"
+	"END\n"
+	"on_event:\n"
+	"count = count + 1\n"
+	"RETURN\n"
+	"twice:\n"
+	"GOSUB on_event\n"
+	"GOSUB on_event\n"
+	"RETURN\n"
+	"pick:\n"
+	"SELECT CASE count\n"
+	"CASE 1\n"
+	"  picked$ = \"one\"\n"
+	"CASE ELSE\n"
+	"  picked$ = \"many\"\n"
+	"END SELECT\n"
+	"RETURN\n"
+	"broken:\n"
+	"x = 1 / 0\n"
+	"RETURN\n";
+
+/* HANDLE(label$) calls a subroutine of the loaded script */
+static struct mu_par handle(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	if(!mu_call(m, mu_par_str(m, 0, argc, argv)))
+		mu_throw(m, "%s", mu_error_msg(m));
+	rv.v.i = mu_get_int(m, "count");
+	return rv;
+}
+
+static int token;
+
+/* WAIT() makes an asynchronous call */
+static struct mu_par wait_call(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	token = mu_suspend(m);
+	return rv;
+}
+
+int main() {
+	struct musl *m = mu_create();
+	struct mu_par v = {mu_int, {5}};
+
+	check("mu_call() before mu_load()", mu_call(m, "on_event"), 0);
+	check_str("its error", mu_error_msg(m), "No script loaded");
+
+	/* The initialization runs, and the labels stay */
+	check("mu_load()", mu_load(m, library), 1);
+	check_str("initialization", mu_get_str(m, "greeting$"), "hello");
+	check("mu_call()", mu_call(m, "on_event"), 1);
+	check("mu_call() again", mu_call(m, "on_event"), 1);
+	check("count", mu_get_int(m, "count"), 2);
+	check("GOSUB in a called subroutine", mu_call(m, "twice"), 1);
+	check("count after GOSUBs", mu_get_int(m, "count"), 4);
+	mu_call(m, "pick");
+	check_str("SELECT CASE in a called subroutine", mu_get_str(m, "picked$"), "many");
+	check("unknown label", mu_call(m, "nowhere"), 0);
+	check("error in a subroutine", mu_call(m, "broken"), 0);
+	check("mu_call() after an error", mu_call(m, "on_event"), 1);
+
+	/* Other scripts don't replace the loaded one */
+	check("mu_run()", mu_run(m, "count = 0\nlocal_label:\ncount = count + 10\n"), 1);
+	check("mu_call() after mu_run()", mu_call(m, "on_event"), 1);
+	check("count after mu_run()", mu_get_int(m, "count"), 11);
+	check("mu_run()'s labels are not kept", mu_call(m, "local_label"), 0);
+
+	/* A running script calls the loaded one through an external function */
+	mu_add_func(m, "handle", handle);
+	check("mu_call() from a running script",
+		mu_run(m, "n = HANDLE(\"on_event\")\nGOSUB sub\nEND\nsub:\nn = HANDLE(\"twice\")\nRETURN\n"), 1);
+	check("count after nested calls", mu_get_int(m, "n"), 14);
+	check("error in a nested call", mu_run(m, "HANDLE(\"broken\")\n"), 0);
+	check("mu_call() after a nested error", mu_call(m, "on_event"), 1);
+
+	/* The host can call it while a script waits */
+	mu_add_func(m, "wait", wait_call);
+	mu_set_option(m, mu_async_calls, 1);
+	check("script waits", mu_run(m, "w = WAIT() + count\n"), MU_PENDING);
+	check("mu_call() while a script waits", mu_call(m, "on_event"), 1);
+	check("the script continues", mu_complete(m, token, v), 1);
+	check("after the wait", mu_get_int(m, "w"), 5 + mu_get_int(m, "count"));
+	check("mu_call() after the wait", mu_call(m, "on_event"), 1);
+
+	/* Loading another script replaces it, and mu_reset() discards it */
+	check("mu_load() another script", mu_load(m, "END\nother:\ncount = -1\nRETURN\n"), 1);
+	check("the old labels are gone", mu_call(m, "on_event"), 0);
+	check("the new labels", mu_call(m, "other"), 1);
+	check("a script with errors in its labels is not kept",
+		mu_load(m, "END\nbad:\nSELECT CASE count\nRETURN\n"), 0);
+	check("mu_call() keeps the previous one", mu_call(m, "other"), 1);
+	mu_reset(m);
+	check("mu_call() after mu_reset()", mu_call(m, "other"), 0);
+	check_str("its error", mu_error_msg(m), "No script loaded");
+
+	mu_cleanup(m);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
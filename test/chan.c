@@ -0,0 +1,260 @@
+/*
+ * Tests channels: Sending to a full channel and receiving from an
+ * empty one, with and without waiting, closing a channel, and a
+ * pipeline of scripts on threads and on a mu_sched that pass values
+ * through channels that are too small to hold them all.
+ *
+ * Build it with `make chan`. To look for data races, build
+ * it with `make chan CC="gcc -fsanitize=thread"`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "musl.h"
+
+#define NVALUES		10000
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static struct mu_par int_par(int i) {
+	struct mu_par p = {mu_int, {0}};
+	p.v.i = i;
+	return p;
+}
+
+/* Sending and receiving without waiting */
+static void test_nowait(void) {
+	struct mu_chan *ch = mu_chan_create(3);
+	struct mu_par v = {mu_str, {0}};
+	char buf[10];
+	int i, sum = 0;
+
+	/* A size of 3 is rounded up to 4 */
+	for(i = 1; i <= 4; i++)
+		if(!mu_chan_send(ch, int_par(i), 0))
+			printf("FAIL mu_chan_send(%d)\n", i), failed++;
+	check("send to a full channel", mu_chan_send(ch, int_par(5), 0), 0);
+	for(i = 1; i <= 4; i++) {
+		mu_chan_recv(ch, &v, 0);
+		sum = sum * 10 + v.v.i;
+	}
+	check("values in order", sum, 1234);
+	check("receive from an empty channel", mu_chan_recv(ch, &v, 0), 0);
+
+	strcpy(buf, "copied");
+	v.type = mu_str;
+	v.v.s = buf;
+	mu_chan_send(ch, v, 0);
+	strcpy(buf, "changed");
+	if(mu_chan_recv(ch, &v, 0) && v.type == mu_str) {
+		check_str("strings are copied", v.v.s, "copied");
+		free(v.v.s);
+	} else
+		check("strings are copied", 0, 1);
+
+	/* What was sent before the close can still be received */
+	mu_chan_send(ch, int_par(7), 0);
+	mu_chan_close(ch);
+	check("send to a closed channel", mu_chan_send(ch, int_par(8), 0), 0);
+	check("receive from a closed channel", mu_chan_recv(ch, &v, 1) && v.v.i == 7, 1);
+	check("closed and empty", mu_chan_recv(ch, &v, 1), 0);
+	mu_chan_free(ch);
+}
+
+/* A thread that sends or receives and waits */
+struct waiter {
+	pthread_t th;
+	struct mu_chan *ch;
+	int send;
+	struct mu_par v;
+	int rv, done;
+};
+
+static void *wait_op(void *arg) {
+	struct waiter *w = arg;
+	if(w->send)
+		w->rv = mu_chan_send(w->ch, w->v, 1);
+	else
+		w->rv = mu_chan_recv(w->ch, &w->v, 1);
+	__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Starts a waiter and checks that it waits */
+static void start_waiter(struct waiter *w, struct mu_chan *ch, int send, int value, const char *what) {
+	char msg[80];
+	w->ch = ch;
+	w->send = send;
+	w->v = int_par(value);
+	w->done = 0;
+	pthread_create(&w->th, NULL, wait_op, w);
+	usleep(50000);
+	sprintf(msg, "%s waits", what);
+	check(msg, __atomic_load_n(&w->done, __ATOMIC_ACQUIRE), 0);
+}
+
+/* Threads that wait on a full or empty channel */
+static void test_wait(void) {
+	struct mu_chan *ch = mu_chan_create(2);
+	struct mu_par v;
+	struct waiter w;
+
+	start_waiter(&w, ch, 0, 0, "receive from an empty channel");
+	mu_chan_send(ch, int_par(42), 0);
+	pthread_join(w.th, NULL);
+	check("a send wakes the receiver", w.rv && w.v.v.i == 42, 1);
+
+	mu_chan_send(ch, int_par(1), 0);
+	mu_chan_send(ch, int_par(2), 0);
+	start_waiter(&w, ch, 1, 3, "send to a full channel");
+	mu_chan_recv(ch, &v, 0);
+	pthread_join(w.th, NULL);
+	check("a receive wakes the sender", w.rv, 1);
+	mu_chan_recv(ch, &v, 0);
+	check("after the sender woke", v.v.i, 2);
+	mu_chan_recv(ch, &v, 0);
+	check("the sender's value", v.v.i, 3);
+
+	mu_chan_send(ch, int_par(1), 0);
+	mu_chan_send(ch, int_par(2), 0);
+	start_waiter(&w, ch, 1, 3, "send to a full channel");
+	mu_chan_close(ch);
+	pthread_join(w.th, NULL);
+	check("closing wakes the sender", w.rv, 0);
+	mu_chan_free(ch);
+
+	ch = mu_chan_create(2);
+	start_waiter(&w, ch, 0, 0, "receive from an empty channel");
+	mu_chan_close(ch);
+	pthread_join(w.th, NULL);
+	check("closing wakes the receiver", w.rv, 0);
+	mu_chan_free(ch);
+}
+
+/* Each stage of the pipeline multiplies the values it receives
+ * by mul and adds add, until its input is closed */
+static const char *stage_text =
+	"next_value:\n"
+	"x$ = CHAN_RECV$(\"in\", \"end\")\n"
+	"IF x$ = \"end\" THEN GOTO finished\n"
+	"CHAN_SEND(\"out\", INT(x$) * mul + add)\n"
+	"GOTO next_value\n"
+	"finished:\n"
+	"CHAN_CLOSE(\"out\")\n";
+
+static struct mu_chan *chans[3];
+static struct mu_script *stage;
+
+static struct musl *new_stage(struct mu_chan *in, struct mu_chan *out, int mul, int add) {
+	struct musl *m = mu_create();
+	mu_add_chan(m, "in", in);
+	mu_add_chan(m, "out", out);
+	mu_set_int(m, "mul", mul);
+	mu_set_int(m, "add", add);
+	return m;
+}
+
+static void *produce(void *arg) {
+	int i;
+	for(i = 1; i <= NVALUES; i++)
+		mu_chan_send(chans[0], int_par(i), 1);
+	mu_chan_close(chans[0]);
+	return NULL;
+}
+
+/* The first stage runs on its own thread, which waits on the channels */
+static void *run_stage(void *arg) {
+	struct musl *m = arg;
+	if(!mu_exec(m, stage)) {
+		printf("FAIL stage on a thread: %s\n", mu_error_msg(m));
+		__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void stage_done(struct musl *m, int result, void *data) {
+	if(!result) {
+		printf("FAIL scheduled stage: %s\n", mu_error_msg(m));
+		__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* The second stage runs on a scheduler, where it gives up its
+ * worker while it waits */
+static void *run_sched(void *arg) {
+	mu_sched_run(arg);
+	return NULL;
+}
+
+/* Producer -> x2 on a thread -> +1 on a mu_sched -> consumer */
+static void test_pipeline(void) {
+	struct musl *m1, *m2;
+	struct mu_sched *s;
+	struct mu_par v;
+	pthread_t producer, stage1, sched;
+	int i, n = 0, in_order = 1;
+
+	for(i = 0; i < 3; i++)
+		chans[i] = mu_chan_create(2);
+	m1 = new_stage(chans[0], chans[1], 2, 0);
+	if(!(stage = mu_compile(m1, stage_text))) {
+		printf("FAIL mu_compile: %s\n", mu_error_msg(m1));
+		failed++;
+		return;
+	}
+	m2 = new_stage(chans[1], chans[2], 1, 1);
+	mu_set_option(m2, mu_async_calls, 1);
+	s = mu_sched_create(2, 0);
+	mu_sched_spawn(s, m2, stage, stage_done, NULL);
+
+	pthread_create(&sched, NULL, run_sched, s);
+	pthread_create(&stage1, NULL, run_stage, m1);
+	pthread_create(&producer, NULL, produce, NULL);
+
+	while(mu_chan_recv(chans[2], &v, 1)) {
+		n++;
+		if(v.type != mu_int || v.v.i != 2 * n + 1)
+			in_order = 0;
+	}
+	check("values through the pipeline", n, NVALUES);
+	check("values through the pipeline in order", in_order, 1);
+
+	pthread_join(producer, NULL);
+	pthread_join(stage1, NULL);
+	pthread_join(sched, NULL);
+	mu_sched_free(s);
+	mu_free_script(stage);
+	mu_cleanup(m1);
+	mu_cleanup(m2);
+	for(i = 0; i < 3; i++)
+		mu_chan_free(chans[i]);
+}
+
+int main() {
+	test_nowait();
+	test_wait();
+	test_pipeline();
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
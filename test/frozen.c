@@ -0,0 +1,161 @@
+/*
+ * Tests frozen variables: An interpreter that is attached to a
+ * frozen table reads its variables, and private variables with
+ * the same names hide them without changing the table, also from
+ * compiled expressions that looked up the frozen variables.
+ *
+ * Build it with `make frozen`; it needs musl.c compiled
+ * with WITH_MMAP defined.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "musl.h"
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void run(struct musl *m, const char *script) {
+	if(!mu_run(m, script)) {
+		printf("FAIL mu_run: %s\n", mu_error_msg(m));
+		failed++;
+	}
+}
+
+static int eval(struct musl *m, struct mu_expr *e) {
+	struct mu_par rv;
+	if(!mu_eval(m, e, &rv)) {
+		printf("FAIL mu_eval: %s\n", mu_error_msg(m));
+		failed++;
+		return 0;
+	}
+	return rv.type == mu_int ? rv.v.i : 0;
+}
+
+/* Hides the frozen x through the new variable of a field */
+static struct mu_par batch(struct musl *m, int argc, struct mu_par argv[]) {
+	static const struct mu_field fields[] = {{"x", mu_int, 0}};
+	int records[] = {40};
+	struct mu_par rv = {mu_int, {0}};
+	if(!mu_gosub_batch(m, "sub", records, sizeof *records, 1, fields, 1, NULL, NULL))
+		mu_throw(m, "%s", mu_error_msg(m));
+	return rv;
+}
+
+/* Looking up frozen variables, and hiding them with private ones */
+static void test_lookup(struct mu_frozen *f) {
+	struct musl *m = mu_create(), *other = mu_create();
+	char buf[20];
+
+	mu_attach_frozen(m, f);
+	mu_attach_frozen(other, f);
+
+	check("frozen int", mu_get_int(m, "x"), 1);
+	check_str("frozen string", mu_get_str(m, "s$"), "hello");
+	check("mu_has_var()", mu_has_var(m, "arr[3]"), 1);
+	run(m, "y = x + SUM(@arr)\nt$ = s$ & \"!\"\n");
+	check("script reads frozen variables", mu_get_int(m, "y"), 61);
+	check_str("script reads a frozen string", mu_get_str(m, "t$"), "hello!");
+
+	run(m, "x = 5\narr[2] = 0\n");
+	check("assignment hides a frozen variable", mu_get_int(m, "x"), 5);
+	check("assignment hides a frozen element", mu_get_int(m, "arr[2]"), 0);
+	mu_handle_set_str(mu_var_handle(m, "s$"), "bye");
+	check_str("mu_var_handle() gives a private copy", mu_get_str(m, "s$"), "bye");
+
+	check("other interpreter's x", mu_get_int(other, "x"), 1);
+	check("other interpreter's arr[2]", mu_get_int(other, "arr[2]"), 20);
+	check_str("other interpreter's s$", mu_get_str(other, "s$"), "hello");
+	check_str("frozen handle", mu_handle_get_str(mu_var_handle(other, "s$"), buf, sizeof buf), "hello");
+
+	mu_reset(m);
+	check("mu_reset() uncovers the frozen variable", mu_get_int(m, "x"), 1);
+	mu_attach_frozen(m, NULL);
+	check("detached", mu_has_var(m, "x"), 0);
+
+	mu_attach_frozen(other, NULL);
+	mu_cleanup(other);
+	mu_cleanup(m);
+}
+
+/* A compiled expression sees the private variable that hides a frozen
+ * one, however the private variable is created */
+static void test_hidden(struct mu_frozen *f) {
+	struct musl *m = mu_create();
+	struct mu_kv kv = {"x", {mu_int, {30}}};
+	struct mu_expr *e;
+
+	mu_add_func(m, "batch", batch);
+	mu_attach_frozen(m, f);
+	if(!(e = mu_compile_expr(m, "x + 1"))) {
+		printf("FAIL mu_compile_expr: %s\n", mu_error_msg(m));
+		failed++;
+		mu_cleanup(m);
+		return;
+	}
+
+	check("expression reads a frozen variable", eval(m, e), 2);
+	mu_set_int(m, "x", 10);
+	check("hidden by mu_set_int()", eval(m, e), 11);
+
+	mu_reset(m);
+	check("mu_reset()", eval(m, e), 2);
+	run(m, "x = 20\n");
+	check("hidden by an assignment", eval(m, e), 21);
+
+	mu_reset(m);
+	check("mu_reset()", eval(m, e), 2);
+	mu_set_many(m, &kv, 1, 0);
+	check("hidden by mu_set_many()", eval(m, e), 31);
+
+	mu_reset(m);
+	check("mu_reset()", eval(m, e), 2);
+	run(m, "BATCH()\nEND\nsub: RETURN\n");
+	check("hidden by mu_gosub_batch()", eval(m, e), 41);
+
+	mu_reset(m);
+	check("mu_reset()", eval(m, e), 2);
+	mu_handle_set_int(mu_var_handle(m, "x"), 50);
+	check("hidden by mu_var_handle()", eval(m, e), 51);
+
+	mu_free_expr(e);
+	mu_attach_frozen(m, NULL);
+	mu_cleanup(m);
+}
+
+int main() {
+	struct musl *m = mu_create();
+	struct mu_frozen *f;
+
+	run(m, "x = 1\ns$ = \"hello\"\nDATA(@arr, 10, 20, 30)\n");
+	if(!(f = mu_freeze(m, NULL))) {
+		printf("mu_freeze: %s\n", mu_error_msg(m));
+		return EXIT_FAILURE;
+	}
+	mu_cleanup(m);
+
+	test_lookup(f);
+	test_hidden(f);
+
+	mu_frozen_close(f);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
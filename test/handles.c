@@ -0,0 +1,72 @@
+/*
+ * Tests variable handles: A new handle's variable has the value 0,
+ * and a handle stays valid while the variable table grows.
+ *
+ * Build it with `make handles`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "musl.h"
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+int main() {
+	struct musl *m = mu_create();
+	struct mu_var *h, *s;
+	char name[32], buf[16];
+	int i;
+
+	/* New variables start out as the number 0 */
+	h = mu_var_handle(m, "h");
+	check("new handle", mu_handle_get_int(h), 0);
+	check_str("new handle as a string", mu_handle_get_str(h, buf, sizeof buf), "0");
+	s = mu_var_handle(m, "s$");
+	check("mu_handle_set_str() on a new variable", mu_handle_set_str(s, "first"), 1);
+	check("mu_set_str() on a new variable", mu_set_str(m, "t$", "second"), 1);
+	check_str("new string variable", mu_get_str(m, "t$"), "second");
+
+	/* Grow the table through many doublings */
+	mu_handle_set_int(h, 42);
+	for(i = 0; i < 100000; i++) {
+		sprintf(name, "v%d", i);
+		if(!mu_set_int(m, name, i)) {
+			printf("FAIL mu_set_int(%s)\n", name);
+			return EXIT_FAILURE;
+		}
+	}
+	check("handle after growth", mu_handle_get_int(h), 42);
+	check_str("string handle after growth", mu_handle_get_str(s, buf, sizeof buf), "first");
+	check("same handle after growth", mu_var_handle(m, "h") == h, 1);
+
+	/* The handle and the script see the same variable */
+	mu_handle_set_int(h, 7);
+	if(!mu_run(m, "h = h * 6\ns$ = s$ & \"!\"\n"))
+		printf("FAIL mu_run: %s\n", mu_error_msg(m));
+	check("script changes the handle's variable", mu_handle_get_int(h), 42);
+	check_str("script changes a string handle", mu_handle_get_str(s, buf, sizeof buf), "first!");
+	check("other variables", mu_get_int(m, "v99999"), 99999);
+
+	mu_cleanup(m);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+/*
+ * Tests mu_reload(): After each edit of a loaded script, the
+ * subroutines of the reloaded script must behave exactly like those
+ * of the edited script loaded from scratch, whether the edit is
+ * before, inside or after the labels and SELECT CASE blocks, and
+ * when strings that span lines make it scan the whole script.
+ *
+ * Build it with `make reload`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "musl.h"
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static const char *base =
+	"r = 0\n"
+	"END\n"
+	"first:\n"
+	"r = 1\n"
+	"RETURN\n"
+	"pick:\n"
+	"SELECT CASE k\n"
+	"CASE 1\n"
+	"  r = 10\n"
+	"CASE 2, 4\n"
+	"  r = 20\n"
+	"CASE ELSE\n"
+	"  r = GOSUB last\n"
+	"END SELECT\n"
+	"RETURN\n"
+	"names:\n"
+	"SELECT CASE k$\n"
+	"CASE \"a\"\n"
+	"  r = 100\n"
+	"CASE \"b\"\n"
+	"  GOSUB first\n"
+	"END SELECT\n"
+	"RETURN\n"
+	"100 r = 5\n"
+	"110 RETURN\n"
+	"last:\n"
+	"RETURN 9\n";
+
+/* Each edit replaces the text from with to */
+static const struct edit {
+	const char *what, *from, *to;
+} edits[] = {
+	{"a line before the labels", "r = 0\n", "r = 0\nq = 1\n"},
+	{"the first label", "first:\n", "first: r = 3\n"},
+	{"a subroutine's body", "r = 1\n", "r = 2\nr = r + 3\n"},
+	{"a case value", "CASE 1\n", "CASE 3\n"},
+	{"a case body", "  r = 20\n", "  r = 21\n  r = r * 2\n"},
+	{"a line before a SELECT CASE", "pick:\n", "pick:\nk = k + 1\n"},
+	{"a line after a SELECT CASE", "END SELECT\nRETURN\nnames", "END SELECT\nr = r + 1\nRETURN\nnames"},
+	{"an END SELECT", "  r = GOSUB last\nEND SELECT\n", "  r = GOSUB last\n  r = r + 1\nEND SELECT\n"},
+	{"a deleted SELECT CASE", "names:\nSELECT CASE k$\nCASE \"a\"\n  r = 100\nCASE \"b\"\n  GOSUB first\nEND SELECT\n", "names:\n"},
+	{"a numbered line", "110 RETURN\n", "105 r = r + 1\n110 RETURN\n"},
+	{"a renamed label", "last:\n", "final:\n"},
+	{"a label after the others", "RETURN 9\n", "RETURN 9\nadded:\nr = 77\nRETURN\n"},
+	{"a duplicate label", "RETURN 9\n", "RETURN 9\nfirst:\nr = -1\nRETURN\n"},
+	{"a string that spans lines", "r = 0\n", "r = 0\ns$ = \"a\nb\"\n"},
+	{"another string that spans lines", "110 RETURN\n", "110 RETURN\nt$ = \"c\nd\"\n"},
+};
+
+#define NEDITS	(int)(sizeof edits / sizeof *edits)
+
+static const char *labels[] = {"first", "pick", "names", "100", "last", "final", "added"};
+
+#define NLABELS	(int)(sizeof labels / sizeof *labels)
+
+/* Applies edit e to text; the result must be freed */
+static char *apply(const char *text, const struct edit *e) {
+	const char *p = strstr(text, e->from);
+	char *s;
+	if(!p) {
+		printf("FAIL can't apply %s\n", e->what);
+		exit(EXIT_FAILURE);
+	}
+	s = malloc(strlen(text) - strlen(e->from) + strlen(e->to) + 1);
+	sprintf(s, "%.*s%s%s", (int)(p - text), text, e->to, p + strlen(e->from));
+	return s;
+}
+
+/* Compares the subroutines of the reloaded script in m with those of
+ * the same script loaded from scratch */
+static void compare(const char *what, struct musl *m, const char *text) {
+	static const char *keys[] = {"", "a", "b", "c"};
+	struct musl *ref = mu_create();
+	int i, k, same = 1;
+
+	mu_load(ref, text);
+	for(i = 0; i < NLABELS; i++)
+		for(k = 0; k < 5; k++) {
+			int rv, rref;
+			mu_set_int(m, "k", k);
+			mu_set_int(ref, "k", k);
+			mu_set_str(m, "k$", keys[k % 4]);
+			mu_set_str(ref, "k$", keys[k % 4]);
+			mu_set_int(m, "r", -99);
+			mu_set_int(ref, "r", -99);
+			rv = mu_call(m, labels[i]);
+			rref = mu_call(ref, labels[i]);
+			if(rv != rref || mu_get_int(m, "r") != mu_get_int(ref, "r")) {
+				printf("     %s(k = %d): %d, r = %d; expected %d, r = %d\n", labels[i], k,
+					rv, mu_get_int(m, "r"), rref, mu_get_int(ref, "r"));
+				same = 0;
+			}
+		}
+	check(what, same, 1);
+	mu_cleanup(ref);
+}
+
+int main() {
+	struct musl *m = mu_create(), *chain = mu_create();
+	char *text, *prev, msg[120];
+	int i;
+
+	/* Each edit on its own, and all of them one after the other */
+	mu_load(chain, base);
+	prev = strdup(base);
+	for(i = 0; i < NEDITS; i++) {
+		mu_load(m, base);
+		text = apply(base, &edits[i]);
+		sprintf(msg, "reload %s", edits[i].what);
+		check(msg, mu_reload(m, text), 1);
+		compare(edits[i].what, m, text);
+		free(text);
+
+		text = apply(prev, &edits[i]);
+		sprintf(msg, "reload %s after the others", edits[i].what);
+		check(msg, mu_reload(chain, text), 1);
+		sprintf(msg, "%s after the others", edits[i].what);
+		compare(msg, chain, text);
+		free(prev);
+		prev = text;
+	}
+
+	/* The script is not run, and the variables are kept */
+	mu_set_int(m, "r", 42);
+	mu_reload(m, prev);
+	check("variables are kept", mu_get_int(m, "r"), 42);
+	check("the script is not run", mu_has_var(m, "q"), 0);
+
+	/* A version with errors is rejected and the old one kept */
+	mu_load(m, base);
+	text = apply(base, &(struct edit){"", "END SELECT\nRETURN\nnames", "RETURN\nnames"});
+	check("reload with an unterminated SELECT CASE", mu_reload(m, text), 0);
+	compare("the previous version is kept", m, base);
+	free(text);
+	check("reload without changes", mu_reload(m, base), 1);
+	compare("the same version", m, base);
+
+	/* Reloading without a loaded script keeps it without running it */
+	mu_reset(m);
+	check("reload without a loaded script", mu_reload(m, base), 1);
+	check("the script is not run", mu_has_var(m, "r"), 0);
+	compare("the script is kept", m, base);
+
+	free(prev);
+	mu_cleanup(chain);
+	mu_cleanup(m);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * Tests mu_save_state() and mu_load_state(): A snapshot restores
+ * the numbers, strings, arrays and PUSH()/POP() stack of an
+ * interpreter with their types, and a snapshot that is cut short
+ * or damaged is rejected without changing the existing variables.
+ *
+ * Build it with `make state`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "musl.h"
+
+static int failed;
+
+static void check(const char *what, int value, int expected) {
+	if(value != expected) {
+		printf("FAIL %s: %d, expected %d\n", what, value, expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void check_str(const char *what, const char *value, const char *expected) {
+	if(!value || strcmp(value, expected)) {
+		printf("FAIL %s: \"%s\", expected \"%s\"\n", what, value ? value : "(null)", expected);
+		failed++;
+	} else
+		printf("ok   %s\n", what);
+}
+
+static void run(struct musl *m, const char *script) {
+	if(!mu_run(m, script)) {
+		printf("FAIL mu_run: %s\n", mu_error_msg(m));
+		failed++;
+	}
+}
+
+/* Loads len bytes of buf into m */
+static int load(struct musl *m, const char *buf, size_t len) {
+	FILE *f = tmpfile();
+	int rv;
+	if(!f) {
+		printf("FAIL tmpfile()\n");
+		exit(EXIT_FAILURE);
+	}
+	fwrite(buf, 1, len, f);
+	rewind(f);
+	rv = mu_load_state(m, f);
+	fclose(f);
+	return rv;
+}
+
+/* Variables that a failed load must leave alone */
+static struct musl *untouched(void) {
+	struct musl *m = mu_create();
+	run(m, "keep = 7\nkeep$ = \"yes\"\nPUSH(5)\n");
+	return m;
+}
+
+static int is_untouched(struct musl *m) {
+	const char *s = mu_get_str(m, "keep$");
+	if(mu_get_int(m, "keep") != 7 || !s || strcmp(s, "yes") || mu_has_var(m, "x"))
+		return 0;
+	run(m, "top = POP()\nPUSH(top)\n");
+	return mu_get_int(m, "top") == 5;
+}
+
+int main() {
+	struct musl *m = mu_create(), *m2;
+	char name[120], *buf;
+	FILE *f;
+	long size, i;
+	int rejected = 1;
+
+	run(m, "x = 42\nneg = -2147483647 - 1\n"
+		"s$ = \"hello world\"\nempty$ = \"\"\nnum$ = \"12\"\n"
+		"DATA(@a, 1, 2, 3)\nDATA(@names, \"Alice\", \"Bob\")\n"
+		"PUSH(1)\nPUSH(\"two\")\n");
+	memset(name, 'v', sizeof name - 1);
+	name[sizeof name - 1] = '\0';
+	mu_set_int(m, name, 99);
+
+	if(!(f = tmpfile()) || !mu_save_state(m, f)) {
+		printf("FAIL mu_save_state: %s\n", mu_error_msg(m));
+		return EXIT_FAILURE;
+	}
+	size = ftell(f);
+	buf = malloc(size);
+	rewind(f);
+	if(fread(buf, 1, size, f) != (size_t)size) {
+		printf("FAIL reading the snapshot back\n");
+		return EXIT_FAILURE;
+	}
+	fclose(f);
+	mu_cleanup(m);
+
+	/* The round trip */
+	m2 = mu_create();
+	mu_set_int(m2, "junk", 1);
+	check("mu_load_state()", load(m2, buf, size), 1);
+	check("the old variables are replaced", mu_has_var(m2, "junk"), 0);
+	check("int", mu_get_int(m2, "x"), 42);
+	check("negative int", mu_get_int(m2, "neg"), -2147483647 - 1);
+	check_str("string", mu_get_str(m2, "s$"), "hello world");
+	check_str("empty string", mu_get_str(m2, "empty$"), "");
+	check("long name", mu_get_int(m2, name), 99);
+	check("int array", mu_get_int(m2, "a[3]"), 3);
+	check("array length", mu_get_int(m2, "a[length]"), 3);
+	check_str("string array", mu_get_str(m2, "names[2]"), "Bob");
+	run(m2, "t$ = num$ & 3\np$ = POP()\nq = POP()\n");
+	check_str("a string stays a string", mu_get_str(m2, "t$"), "123");
+	check_str("the stack's top", mu_get_str(m2, "p$"), "two");
+	check("the stack's bottom", mu_get_int(m2, "q"), 1);
+	mu_cleanup(m2);
+
+	/* Every truncated snapshot is rejected */
+	for(i = 0; i < size; i++) {
+		m2 = untouched();
+		if(load(m2, buf, i) || !*mu_error_msg(m2) || !is_untouched(m2)) {
+			printf("     snapshot of %ld bytes\n", i);
+			rejected = 0;
+		}
+		mu_cleanup(m2);
+	}
+	check("truncated snapshots leave the variables untouched", rejected, 1);
+
+	/* A damaged header, and a count that can't fit in the file */
+	m2 = untouched();
+	buf[0] ^= 1;
+	check("bad magic number", load(m2, buf, size), 0);
+	check("bad magic number leaves the variables untouched", is_untouched(m2), 1);
+	buf[0] ^= 1;
+	memset(buf + 8, 0x7f, 4);
+	check("huge count", load(m2, buf, size), 0);
+	check("huge count leaves the variables untouched", is_untouched(m2), 1);
+	mu_cleanup(m2);
+
+	free(buf);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
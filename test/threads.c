@@ -0,0 +1,236 @@
+/*
+ * Tests the threading model: Several threads run one shared
+ * mu_script at the same time, each on its own interpreter, and
+ * share a mu_pool of interpreters.
+ *
+ * Build it with `make threads`. To look for data races, build
+ * it with `make threads CC="gcc -fsanitize=thread"`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "musl.h"
+
+#define NTHREADS	8
+#define RUNS		500
+#define POOL_SIZE	4
+#define POOL_RUNS	5000
+
+static struct mu_script *script;
+static int failed;
+
+/* Sums the squares with a subroutine, a SELECT CASE, strings and an
+ * external function that keeps its state in the interpreter's data */
+static const char *text =
+	"total = 0\n"
+	"s$ = \"\"\n"
+	"FOR i = 1 TO n DO\n"
+	"  total = total + GOSUB square(i)\n"
+	"  SELECT CASE i % 3\n"
+	"  CASE 0\n"
+	"    s$ = s$ & \"a\"\n"
+	"  CASE ELSE\n"
+	"    s$ = s$ & \"b\"\n"
+	"  END SELECT\n"
+	"  COUNT()\n"
+	"NEXT\n"
+	"END\n"
+	"square:\n"
+	"LOCAL x\n"
+	"RETURN x * x\n";
+
+static struct mu_par count(struct musl *m, int argc, struct mu_par argv[]) {
+	struct mu_par rv = {mu_int, {0}};
+	int *calls = mu_get_data(m);
+	rv.v.i = ++*calls;
+	return rv;
+}
+
+static void fail(long id, const char *msg) {
+	printf("FAIL thread %ld: %s\n", id, msg);
+	__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void *run_script(void *arg) {
+	long id = (long)arg;
+	struct musl *m = mu_create();
+	int k, n, calls, expected = 0;
+	const char *s;
+
+	mu_add_func(m, "count", count);
+	mu_set_data(m, &calls);
+	for(k = 0; k < RUNS; k++) {
+		n = (int)id + k % 13;
+		calls = 0;
+		mu_set_int(m, "n", n);
+		if(!mu_exec(m, script)) {
+			fail(id, mu_error_msg(m));
+			break;
+		}
+		if(mu_get_int(m, "total") != n * (n + 1) * (2 * n + 1) / 6)
+			fail(id, "wrong total");
+		if(calls != n)
+			fail(id, "wrong number of calls");
+		s = mu_get_str(m, "s$");
+		if(!s || (int)strlen(s) != n || (n >= 3 && s[2] != 'a'))
+			fail(id, "wrong string");
+		expected++;
+	}
+	if(expected != RUNS)
+		fail(id, "not all runs completed");
+	mu_cleanup(m);
+	return NULL;
+}
+
+/* The data of a pooled interpreter; COUNT() counts in calls */
+struct slot {
+	int calls;
+	int in_use;
+};
+
+static struct slot slots[POOL_SIZE];
+static int ninit;
+
+/* The pool's own interpreters get a slot each; the extras that are
+ * created when the pool runs out get none */
+static int pool_init(struct musl *m, void *data) {
+	int i = __atomic_fetch_add(&ninit, 1, __ATOMIC_RELAXED);
+	mu_set_data(m, i < POOL_SIZE ? &slots[i] : NULL);
+	return mu_add_func(m, "count", count);
+}
+
+static struct mu_pool *new_pool(void) {
+	ninit = 0;
+	memset(slots, 0, sizeof slots);
+	return mu_pool_create(POOL_SIZE, pool_init, NULL);
+}
+
+/* Acquiring more interpreters than the pool has, on one thread */
+static void test_pool(void) {
+	struct mu_pool *p = new_pool();
+	struct musl *ms[POOL_SIZE + 1];
+	int i, j, errors = failed;
+
+	if(!p) {
+		fail(0, "mu_pool_create() failed");
+		return;
+	}
+	for(i = 0; i <= POOL_SIZE; i++) {
+		if(!(ms[i] = mu_pool_acquire(p))) {
+			fail(0, "mu_pool_acquire() failed");
+			return;
+		}
+		for(j = 0; j < i; j++)
+			if(ms[i] == ms[j])
+				fail(0, "interpreter acquired twice");
+		mu_set_int(ms[i], "x", i);
+	}
+	if(mu_get_data(ms[POOL_SIZE]))
+		fail(0, "no extra interpreter when the pool ran out");
+	for(i = 0; i <= POOL_SIZE; i++)
+		mu_pool_release(p, ms[i]);
+	if(ninit != POOL_SIZE + 1)
+		fail(0, "wrong number of interpreters initialized");
+
+	/* The pool's interpreters come back reset, and the extra is gone */
+	for(i = 0; i < POOL_SIZE; i++) {
+		ms[i] = mu_pool_acquire(p);
+		if(!mu_get_data(ms[i]))
+			fail(0, "extra interpreter while the pool has free ones");
+		if(mu_has_var(ms[i], "x"))
+			fail(0, "released interpreter was not reset");
+	}
+	for(i = 0; i < POOL_SIZE; i++)
+		mu_pool_release(p, ms[i]);
+	mu_pool_free(p);
+	printf("%s pool of %d acquired %d times\n",
+			failed > errors ? "FAIL" : "ok  ", POOL_SIZE, POOL_SIZE + 1);
+}
+
+static struct mu_pool *pool;
+
+static void *use_pool(void *arg) {
+	long id = (long)arg;
+	struct slot extra, *sl;
+	struct musl *m;
+	int k, n;
+
+	for(k = 0; k < POOL_RUNS; k++) {
+		if(!(m = mu_pool_acquire(pool))) {
+			fail(id, "mu_pool_acquire() failed");
+			break;
+		}
+		if(!(sl = mu_get_data(m))) {
+			memset(&extra, 0, sizeof extra);
+			mu_set_data(m, sl = &extra);
+		}
+		if(__atomic_exchange_n(&sl->in_use, 1, __ATOMIC_ACQUIRE))
+			fail(id, "interpreter acquired by two threads");
+		if(mu_has_var(m, "total"))
+			fail(id, "acquired interpreter was not reset");
+		n = 1 + k % 7;
+		sl->calls = 0;
+		mu_set_int(m, "n", n);
+		if(!mu_exec(m, script))
+			fail(id, mu_error_msg(m));
+		else if(mu_get_int(m, "total") != n * (n + 1) * (2 * n + 1) / 6 || sl->calls != n)
+			fail(id, "wrong result from a pooled interpreter");
+		__atomic_store_n(&sl->in_use, 0, __ATOMIC_RELEASE);
+		mu_pool_release(pool, m);
+	}
+	return NULL;
+}
+
+/* More threads than interpreters, so that the pool runs out */
+static void test_pool_threads(void) {
+	pthread_t th[NTHREADS];
+	int errors = failed;
+	long i;
+
+	if(!(pool = new_pool())) {
+		fail(0, "mu_pool_create() failed");
+		return;
+	}
+	for(i = 0; i < NTHREADS; i++)
+		if(pthread_create(&th[i], NULL, use_pool, (void *)(i + 1)) != 0) {
+			fail(0, "pthread_create failed");
+			return;
+		}
+	for(i = 0; i < NTHREADS; i++)
+		pthread_join(th[i], NULL);
+	mu_pool_free(pool);
+	printf("%s %d threads sharing a pool of %d, %d times each\n",
+			failed > errors ? "FAIL" : "ok  ", NTHREADS, POOL_SIZE, POOL_RUNS);
+}
+
+int main() {
+	pthread_t th[NTHREADS];
+	struct musl *m = mu_create();
+	long i;
+
+	if(!(script = mu_compile(m, text))) {
+		printf("mu_compile: %s\n", mu_error_msg(m));
+		return EXIT_FAILURE;
+	}
+	for(i = 0; i < NTHREADS; i++)
+		if(pthread_create(&th[i], NULL, run_script, (void *)(i + 1)) != 0) {
+			printf("pthread_create failed\n");
+			return EXIT_FAILURE;
+		}
+	for(i = 0; i < NTHREADS; i++)
+		pthread_join(th[i], NULL);
+	printf("%s %d threads running one script %d times each\n",
+			failed ? "FAIL" : "ok  ", NTHREADS, RUNS);
+
+	test_pool();
+	test_pool_threads();
+
+	mu_free_script(script);
+	mu_cleanup(m);
+	if(failed)
+		return EXIT_FAILURE;
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}